@@ -0,0 +1,519 @@
+// bench.c
+// Load generator: N concurrent SESSION connections drive a READ/WRITE mix
+// over a set of files with a configurable size distribution and hot-key
+// skew, then report throughput, latency percentiles and writer lock wait
+// as text and/or JSON. Settings come from bench_conf ("KEY value" lines);
+// pass another path as the first argument to compare setups.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "netio.h"
+#include "hist.h"
+
+enum size_dist
+{
+    SIZE_FIXED,      // every file SIZE_MAX bytes
+    SIZE_UNIFORM,    // uniform in [SIZE_MIN, SIZE_MAX]
+    SIZE_LOGUNIFORM  // uniform in log space: many small files, a few large ones
+};
+
+struct bench_conf
+{
+    int port;             // PORT_NO
+    char ip[64];          // SERVER_IP
+    int sessions;         // SESSIONS concurrent connections
+    int duration;         // DURATION seconds of measured load
+    int read_pct;         // READ_PCT share of READs, the rest are WRITEs
+    int files;            // FILES distinct names (bench-<i>)
+    long long size_min;   // SIZE_MIN bytes
+    long long size_max;   // SIZE_MAX bytes
+    enum size_dist dist;  // SIZE_DIST fixed|uniform|loguniform
+    double zipf;          // ZIPF exponent for key choice, 0 = uniform
+    int populate;         // POPULATE 1: write every file before measuring
+    int compress;         // COMPRESSION deflate|none offered in HELLO
+    int text;             // OUTPUT text|json|both
+    int json;
+    char json_file[256];  // JSON_FILE, "-" = stdout
+};
+
+static struct bench_conf g_conf = {
+    .port = 8449,
+    .ip = "127.0.0.1",
+    .sessions = 16,
+    .duration = 10,
+    .read_pct = 90,
+    .files = 100,
+    .size_min = 1024,
+    .size_max = 1 << 20,
+    .dist = SIZE_LOGUNIFORM,
+    .zipf = 0.99,
+    .populate = 1,
+    .text = 1,
+    .json = 0,
+    .json_file = "-",
+};
+
+// Read bench_conf; unknown keys are ignored
+static int load_bench_conf(const char *path)
+{
+    FILE *cfg = fopen(path, "r");
+    if (!cfg)
+    {
+        fprintf(stderr, "Missing %s\n", path);
+        return -1;
+    }
+
+    char key[64], val[256];
+    while (fscanf(cfg, "%63s %255s", key, val) == 2)
+    {
+        if (strcmp(key, "PORT_NO") == 0)
+            g_conf.port = atoi(val);
+        else if (strcmp(key, "SERVER_IP") == 0)
+            snprintf(g_conf.ip, sizeof(g_conf.ip), "%.63s", val);
+        else if (strcmp(key, "SESSIONS") == 0)
+            g_conf.sessions = atoi(val) > 0 ? atoi(val) : 1;
+        else if (strcmp(key, "DURATION") == 0)
+            g_conf.duration = atoi(val) > 0 ? atoi(val) : 1;
+        else if (strcmp(key, "READ_PCT") == 0)
+            g_conf.read_pct = atoi(val) < 0 ? 0 : atoi(val) > 100 ? 100 : atoi(val);
+        else if (strcmp(key, "FILES") == 0)
+            g_conf.files = atoi(val) > 0 ? atoi(val) : 1;
+        else if (strcmp(key, "SIZE_MIN") == 0)
+            g_conf.size_min = atoll(val) > 0 ? atoll(val) : 0;
+        else if (strcmp(key, "SIZE_MAX") == 0)
+            g_conf.size_max = atoll(val) > 0 ? atoll(val) : 0;
+        else if (strcmp(key, "SIZE_DIST") == 0)
+            g_conf.dist = strcmp(val, "fixed") == 0     ? SIZE_FIXED
+                          : strcmp(val, "uniform") == 0 ? SIZE_UNIFORM
+                                                        : SIZE_LOGUNIFORM;
+        else if (strcmp(key, "ZIPF") == 0)
+            g_conf.zipf = atof(val) > 0 ? atof(val) : 0;
+        else if (strcmp(key, "POPULATE") == 0)
+            g_conf.populate = atoi(val) != 0;
+        else if (strcmp(key, "COMPRESSION") == 0)
+            g_conf.compress = strcmp(val, "deflate") == 0;
+        else if (strcmp(key, "OUTPUT") == 0)
+        {
+            g_conf.text = strcmp(val, "json") != 0;
+            g_conf.json = strcmp(val, "text") != 0;
+        }
+        else if (strcmp(key, "JSON_FILE") == 0)
+            snprintf(g_conf.json_file, sizeof(g_conf.json_file), "%s", val);
+    }
+    fclose(cfg);
+
+    if (g_conf.size_min > g_conf.size_max)
+        g_conf.size_min = g_conf.size_max;
+    return 0;
+}
+
+/* ============================================================
+ * Workload model
+ *
+ * File i has a fixed size drawn once from the size distribution,
+ * so READs see that distribution and WRITEs rewrite the same size.
+ * Keys are picked by rank from a Zipf CDF: with ZIPF near 1 a few
+ * files take most requests, like our production read traffic.
+ * ============================================================ */
+static long long *g_sizes;
+static double *g_zipf_cdf;
+static char *g_payload; // SIZE_MAX bytes of printable filler for WRITEs
+
+// xorshift64*: cheap per-thread generator
+static uint64_t rng_next(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+static double rng_unit(uint64_t *s)
+{
+    return (double)(rng_next(s) >> 11) / (double)(1ull << 53);
+}
+
+static int workload_init(void)
+{
+    int n = g_conf.files;
+    g_sizes = calloc((size_t)n, sizeof(*g_sizes));
+    g_zipf_cdf = calloc((size_t)n, sizeof(*g_zipf_cdf));
+    g_payload = malloc((size_t)g_conf.size_max + 1);
+    if (!g_sizes || !g_zipf_cdf || !g_payload)
+        return -1;
+
+    for (long long i = 0; i < g_conf.size_max; i++)
+        g_payload[i] = (char)('a' + i % 26);
+
+    uint64_t seed = 42;
+    double lo = (double)(g_conf.size_min > 0 ? g_conf.size_min : 1);
+    double hi = (double)(g_conf.size_max > 0 ? g_conf.size_max : 1);
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        double u = rng_unit(&seed);
+        if (g_conf.dist == SIZE_FIXED)
+            g_sizes[i] = g_conf.size_max;
+        else if (g_conf.dist == SIZE_UNIFORM)
+            g_sizes[i] = g_conf.size_min + (long long)(u * (double)(g_conf.size_max - g_conf.size_min));
+        else
+            g_sizes[i] = (long long)exp(log(lo) + u * (log(hi) - log(lo)));
+
+        sum += 1.0 / pow(i + 1, g_conf.zipf);
+        g_zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < n; i++)
+        g_zipf_cdf[i] /= sum;
+    return 0;
+}
+
+// Key index for one request: binary search of the Zipf CDF
+static int pick_file(uint64_t *s)
+{
+    double u = rng_unit(s);
+    int lo = 0, hi = g_conf.files - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (g_zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Sessions
+ * ============================================================ */
+struct worker
+{
+    int id;
+    pthread_t tid;
+    int fd;
+    struct connbuf cb;
+    struct zcodec zc;
+    int compress; // server accepted COMPRESS deflate
+    uint64_t rng;
+
+    // Results, private to the thread until it is joined
+    uint64_t reads, writes, errors, bytes_read, bytes_written;
+    struct hist read_lat, write_lat, lock_wait; // microseconds
+};
+
+static volatile int g_stop;
+
+static int bench_connect(struct worker *w)
+{
+    w->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (w->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)g_conf.port);
+    if (inet_pton(AF_INET, g_conf.ip, &addr.sin_addr) != 1 ||
+        connect(w->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+
+    // A threads-mode server with fewer workers than SESSIONS never answers
+    // the extra HELLOs; give up instead of hanging
+    struct timeval tv = {.tv_sec = 5}, none = {0};
+    setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char hello[80], resp[64];
+    snprintf(hello, sizeof(hello), "HELLO bench_%d_%d SESSION%s\n", getpid(), w->id,
+             g_conf.compress ? " COMPRESS deflate" : "");
+    connbuf_init(&w->cb, w->fd);
+    zcodec_init(&w->zc);
+    if (send_all(w->fd, hello, strlen(hello)) < 0 ||
+        connbuf_getline(&w->cb, resp, sizeof(resp)) <= 0 ||
+        (strcmp(resp, "OK SESSION") != 0 && strcmp(resp, "OK SESSION COMPRESS deflate") != 0))
+    {
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    w->compress = strcmp(resp, "OK SESSION COMPRESS deflate") == 0;
+    return 0;
+}
+
+// READ one file and discard the data; -1 if the session broke
+static int bench_read(struct worker *w, int file)
+{
+    char header[128], line[1024];
+    snprintf(header, sizeof(header), "READ bench-%d\n", file);
+    if (send_all(w->fd, header, strlen(header)) < 0 ||
+        connbuf_getline(&w->cb, line, sizeof(line)) <= 0)
+        return -1;
+
+    long long size;
+    if (sscanf(line, "OK READ %*s %lld", &size) != 1)
+    {
+        w->errors++;
+        return 0;
+    }
+    char buf[ZFRAME_BLOCK];
+    while (size > 0)
+    {
+        size_t want = size < (long long)sizeof(buf) ? (size_t)size : sizeof(buf), wire;
+        ssize_t r = w->compress ? connbuf_read_frame(&w->cb, &w->zc, buf, &wire)
+                                : connbuf_read(&w->cb, buf, want);
+        if (r <= 0 || r > size)
+            return -1;
+        size -= r;
+        w->bytes_read += (uint64_t)r;
+    }
+    w->reads++;
+    return 0;
+}
+
+/*
+ * WRITE one file. The length is sent only after OK WRITE, so the time
+ * until then is the server-side writer queue wait as a client sees it.
+ */
+static int bench_write(struct worker *w, int file, struct hist *lock_wait)
+{
+    char header[128], line[1024];
+    snprintf(header, sizeof(header), "WRITE bench-%d\n", file);
+    uint64_t t0 = hist_now_us();
+    if (send_all(w->fd, header, strlen(header)) < 0)
+        return -1;
+    for (;;)
+    {
+        if (connbuf_getline(&w->cb, line, sizeof(line)) <= 0)
+            return -1;
+        if (strncmp(line, "OK WRITE", 8) == 0)
+            break;
+        if (strncmp(line, "ERR", 3) == 0)
+        {
+            w->errors++;
+            return 0;
+        }
+        // NOTIFY BUSY: keep waiting
+    }
+    if (lock_wait)
+        hist_record(lock_wait, hist_now_us() - t0);
+
+    long long size = g_sizes[file];
+    char size_line[64];
+    snprintf(size_line, sizeof(size_line), "SIZE %lld\n", size);
+    if (send_all(w->fd, size_line, strlen(size_line)) < 0 ||
+        (w->compress ? send_frames(w->fd, &w->zc, g_payload, (size_t)size)
+                     : send_all(w->fd, g_payload, (size_t)size)) < 0 ||
+        connbuf_getline(&w->cb, line, sizeof(line)) <= 0)
+        return -1;
+    if (strncmp(line, "ERR", 3) == 0)
+    {
+        w->errors++;
+        return 0;
+    }
+    w->writes++;
+    w->bytes_written += (uint64_t)size;
+    return 0;
+}
+
+static void *bench_worker(void *arg)
+{
+    struct worker *w = arg;
+    while (!g_stop)
+    {
+        int file = pick_file(&w->rng);
+        int is_read = (int)(rng_next(&w->rng) % 100) < g_conf.read_pct;
+
+        uint64_t t0 = hist_now_us();
+        int rc = is_read ? bench_read(w, file) : bench_write(w, file, &w->lock_wait);
+        if (rc < 0)
+        {
+            w->errors++;
+            fprintf(stderr, "Session %d lost its connection\n", w->id);
+            break;
+        }
+        hist_record(is_read ? &w->read_lat : &w->write_lat, hist_now_us() - t0);
+    }
+    send_all(w->fd, "QUIT\n", 5);
+    close(w->fd);
+    zcodec_free(&w->zc);
+    return NULL;
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Report
+ * ============================================================ */
+struct totals
+{
+    uint64_t reads, writes, errors, bytes_read, bytes_written;
+    struct hist read_lat, write_lat, all_lat, lock_wait;
+    double seconds;
+};
+
+static void print_hist_text(const char *name, const struct hist *h)
+{
+    printf("  %-10s n=%-8llu p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms  max %8.3f ms\n",
+           name, (unsigned long long)h->count,
+           hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+           hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+static void report_text(const struct totals *t)
+{
+    const char *dist = g_conf.dist == SIZE_FIXED ? "fixed" : g_conf.dist == SIZE_UNIFORM ? "uniform" : "loguniform";
+    printf("\n=== bench: %d sessions, %d s, %d%% READ, %d files (%s %lld..%lld B), zipf %.2f ===\n",
+           g_conf.sessions, g_conf.duration, g_conf.read_pct, g_conf.files, dist,
+           g_conf.size_min, g_conf.size_max, g_conf.zipf);
+    uint64_t ops = t->reads + t->writes;
+    printf("ops        %llu (%.0f ops/s), errors %llu\n", (unsigned long long)ops,
+           ops / t->seconds, (unsigned long long)t->errors);
+    printf("read       %llu ops, %.2f MB/s\n", (unsigned long long)t->reads, t->bytes_read / 1e6 / t->seconds);
+    printf("write      %llu ops, %.2f MB/s\n", (unsigned long long)t->writes, t->bytes_written / 1e6 / t->seconds);
+    printf("latency\n");
+    print_hist_text("read", &t->read_lat);
+    print_hist_text("write", &t->write_lat);
+    print_hist_text("all", &t->all_lat);
+    print_hist_text("lock wait", &t->lock_wait);
+}
+
+static void json_hist(FILE *out, const char *name, const struct hist *h, int last)
+{
+    fprintf(out, "    \"%s\": {\"count\": %llu, \"mean_us\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, "
+                 "\"p999_us\": %llu, \"max_us\": %llu}%s\n",
+            name, (unsigned long long)h->count, (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)hist_percentile(h, 0.50), (unsigned long long)hist_percentile(h, 0.99),
+            (unsigned long long)hist_percentile(h, 0.999), (unsigned long long)h->max, last ? "" : ",");
+}
+
+static void report_json(const struct totals *t)
+{
+    FILE *out = strcmp(g_conf.json_file, "-") == 0 ? stdout : fopen(g_conf.json_file, "w");
+    if (!out)
+    {
+        perror(g_conf.json_file);
+        return;
+    }
+    const char *dist = g_conf.dist == SIZE_FIXED ? "fixed" : g_conf.dist == SIZE_UNIFORM ? "uniform" : "loguniform";
+    uint64_t ops = t->reads + t->writes;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"sessions\": %d, \"duration_s\": %d, \"read_pct\": %d, \"files\": %d, "
+                 "\"size_dist\": \"%s\", \"size_min\": %lld, \"size_max\": %lld, \"zipf\": %.3f},\n",
+            g_conf.sessions, g_conf.duration, g_conf.read_pct, g_conf.files, dist,
+            g_conf.size_min, g_conf.size_max, g_conf.zipf);
+    fprintf(out, "  \"seconds\": %.3f,\n", t->seconds);
+    fprintf(out, "  \"ops\": %llu,\n  \"ops_per_s\": %.1f,\n  \"errors\": %llu,\n",
+            (unsigned long long)ops, ops / t->seconds, (unsigned long long)t->errors);
+    fprintf(out, "  \"reads\": %llu,\n  \"writes\": %llu,\n",
+            (unsigned long long)t->reads, (unsigned long long)t->writes);
+    fprintf(out, "  \"read_mb_per_s\": %.3f,\n  \"write_mb_per_s\": %.3f,\n",
+            t->bytes_read / 1e6 / t->seconds, t->bytes_written / 1e6 / t->seconds);
+    fprintf(out, "  \"latency\": {\n");
+    json_hist(out, "read", &t->read_lat, 0);
+    json_hist(out, "write", &t->write_lat, 0);
+    json_hist(out, "all", &t->all_lat, 0);
+    json_hist(out, "lock_wait", &t->lock_wait, 1);
+    fprintf(out, "  }\n}\n");
+    if (out != stdout)
+        fclose(out);
+}
+/* ============================================================ */
+
+int main(int argc, char **argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    if (load_bench_conf(argc > 1 ? argv[1] : "bench_conf") < 0)
+        return 1;
+    if (workload_init() < 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    struct worker *ws = calloc((size_t)g_conf.sessions, sizeof(*ws));
+    if (!ws)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Every session connects before the clock starts
+    for (int i = 0; i < g_conf.sessions; i++)
+    {
+        ws[i].id = i;
+        ws[i].rng = 0x9e3779b97f4a7c15ull * (uint64_t)(i + 1);
+        if (bench_connect(&ws[i]) < 0)
+        {
+            fprintf(stderr, "Session %d could not connect to %s:%d "
+                            "(threads mode needs POOL_SIZE >= SESSIONS)\n",
+                    i, g_conf.ip, g_conf.port);
+            return 1;
+        }
+    }
+
+    if (g_conf.populate)
+    {
+        if (g_conf.text)
+            printf("Writing %d files...\n", g_conf.files);
+        for (int f = 0; f < g_conf.files; f++)
+            if (bench_write(&ws[0], f, NULL) < 0)
+            {
+                fprintf(stderr, "Populating bench-%d failed\n", f);
+                return 1;
+            }
+        ws[0].writes = ws[0].errors = ws[0].bytes_written = 0;
+    }
+
+    uint64_t t0 = hist_now_us();
+    for (int i = 0; i < g_conf.sessions; i++)
+        if (pthread_create(&ws[i].tid, NULL, bench_worker, &ws[i]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    sleep((unsigned)g_conf.duration);
+    g_stop = 1;
+
+    struct totals t = {0};
+    for (int i = 0; i < g_conf.sessions; i++)
+    {
+        pthread_join(ws[i].tid, NULL);
+        t.reads += ws[i].reads;
+        t.writes += ws[i].writes;
+        t.errors += ws[i].errors;
+        t.bytes_read += ws[i].bytes_read;
+        t.bytes_written += ws[i].bytes_written;
+        hist_merge(&t.read_lat, &ws[i].read_lat);
+        hist_merge(&t.write_lat, &ws[i].write_lat);
+        hist_merge(&t.all_lat, &ws[i].read_lat);
+        hist_merge(&t.all_lat, &ws[i].write_lat);
+        hist_merge(&t.lock_wait, &ws[i].lock_wait);
+    }
+    t.seconds = (hist_now_us() - t0) / 1e6;
+
+    if (g_conf.text)
+        report_text(&t);
+    if (g_conf.json)
+        report_json(&t);
+
+    free(ws);
+    return t.errors ? 2 : 0;
+}
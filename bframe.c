@@ -0,0 +1,68 @@
+// bframe.c
+// Binary message framing, negotiated with "HELLO ... BINARY".
+
+#include "bframe.h"
+
+#include <string.h>
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void bframe_put_crc(unsigned char *out, uint32_t crc)
+{
+    put32(out, crc);
+}
+
+uint32_t bframe_get_crc(const unsigned char *in)
+{
+    return get32(in);
+}
+
+void bframe_pack(unsigned char *out, const struct bframe *f)
+{
+    out[0] = f->version;
+    out[1] = f->code;
+    out[2] = (unsigned char)(f->flags >> 8);
+    out[3] = (unsigned char)f->flags;
+    put32(out + 4, f->meta_len);
+    put32(out + 8, (uint32_t)(f->payload_len >> 32));
+    put32(out + 12, (uint32_t)f->payload_len);
+}
+
+int bframe_unpack(const unsigned char *in, struct bframe *f)
+{
+    f->version = in[0];
+    f->code = in[1];
+    f->flags = (uint16_t)(in[2] << 8 | in[3]);
+    f->meta_len = get32(in + 4);
+    f->payload_len = (uint64_t)get32(in + 8) << 32 | get32(in + 12);
+    if (f->version != BFRAME_VERSION || f->meta_len > BFRAME_META_MAX ||
+        f->payload_len > (uint64_t)INT64_MAX)
+        return -1;
+    return 0;
+}
+
+size_t bframe_build(unsigned char *out, uint8_t code, uint16_t flags, const char *meta,
+                    size_t meta_len, uint64_t payload_len)
+{
+    if (meta_len > BFRAME_META_MAX)
+        meta_len = BFRAME_META_MAX;
+    struct bframe f = {.version = BFRAME_VERSION,
+                       .code = code,
+                       .flags = flags,
+                       .meta_len = (uint32_t)meta_len,
+                       .payload_len = payload_len};
+    bframe_pack(out, &f);
+    memcpy(out + BFRAME_HDR, meta, meta_len);
+    return BFRAME_HDR + meta_len;
+}
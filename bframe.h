@@ -0,0 +1,72 @@
+// bframe.h
+// Binary message framing, negotiated with "HELLO ... BINARY".
+
+#ifndef BFRAME_H
+#define BFRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every request and reply is a 16-byte header
+//   u8 version, u8 code, u16 flags, u32 meta length, u64 payload length
+// (big endian), the meta text (file name, range, error message), the
+// payload and, only if the payload length is not 0, a 4-byte trailer:
+// the CRC-32 of the payload when BF_FLAG_CRC is set, 0 otherwise. A
+// request's code is its operation, a reply's its status. Payload lengths
+// count raw file bytes; with COMPRESS deflate the payload travels as
+// zframe frames, as in text mode.
+#define BFRAME_VERSION 1
+#define BFRAME_HDR 16
+#define BFRAME_TRAILER 4
+#define BFRAME_META_MAX 1000
+#define BF_FLAG_CRC 0x0001
+
+enum bframe_op
+{
+    BF_READ = 1,  // meta "<name> [<offset> [<length>] | IF-NONE-MATCH <tag>]"; with
+                  // BF_FLAG_CRC the reply carries a CRC even when sent from disk
+    BF_WRITE = 2, // meta "<name>", the file is the payload
+    BF_STATS = 3,
+    BF_QUIT = 4,
+    BF_LIST = 5, // meta as after the text command: "[PREFIX <p>] [AFTER <name>] [LIMIT <n>]"
+    BF_STAT = 6  // meta "<name>"
+};
+
+enum bframe_status
+{
+    BF_OK = 0,       // final reply; READ, STATS and LIST data is the payload
+    BF_ACCEPTED = 1, // WRITE holds the lock, the payload is being stored
+    BF_NOTIFY = 2,   // WRITE queued behind another writer (meta "<name> <pos>")
+    BF_BYE = 3,
+    BF_NOT_MODIFIED = 4, // READ IF-NONE-MATCH: the tag still matches (meta "<name> <tag>")
+    BF_ERR = 16, // any error; the meta says what went wrong
+    BF_ERR_REQUEST,   // malformed or unsupported request
+    BF_ERR_NOT_FOUND, // no such file
+    BF_ERR_NAME,      // invalid file name
+    BF_ERR_RANGE,     // bad or unsatisfiable byte range
+    BF_ERR_CHECKSUM,  // payload CRC mismatch: nothing was stored
+    BF_ERR_IO         // the server could not read or store the file
+};
+
+struct bframe
+{
+    uint8_t version, code;
+    uint16_t flags;
+    uint32_t meta_len;
+    uint64_t payload_len;
+};
+
+void bframe_pack(unsigned char *out, const struct bframe *f);
+
+// Returns -1 for an unknown version or an over-long meta
+int bframe_unpack(const unsigned char *in, struct bframe *f);
+
+void bframe_put_crc(unsigned char *out, uint32_t crc);
+uint32_t bframe_get_crc(const unsigned char *in);
+
+// Header and meta of a frame in one buffer (BFRAME_HDR + BFRAME_META_MAX
+// bytes); meta longer than BFRAME_META_MAX is cut. Returns the length.
+size_t bframe_build(unsigned char *out, uint8_t code, uint16_t flags, const char *meta,
+                    size_t meta_len, uint64_t payload_len);
+
+#endif
@@ -2,11 +2,18 @@
 
 // Implementation of TCP connection on client
 #include "client.h"
+#include "netio.h"
+#include "delta.h"
+#include "bframe.h"
 #include <signal.h>
 #include <time.h>
 #include <stdlib.h>   // for exit()
 #include <sys/stat.h> // ===== ADDED: for stat()
+#include <sys/mman.h>
 #include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 // ===== PHASE 4: global socket for clean shutdown =====
 static int g_sockfd = -1;
@@ -18,18 +25,6 @@ static const char *base_name(const char *p)
     return s ? s + 1 : p;
 }
 
-static void send_all(int fd, const void *buf, size_t len)
-{
-    size_t off = 0;
-    while (off < len)
-    {
-        ssize_t n = send(fd, (const char *)buf + off, len - off, 0);
-        if (n <= 0)
-            return;
-        off += (size_t)n;
-    }
-}
-
 // ===== PHASE 4: SIGINT handler for client =====
 void client_sigint(int sig)
 {
@@ -41,6 +36,609 @@ void client_sigint(int sig)
 }
 // ==============================================
 
+// Connect and say HELLO with mode ("", " SESSION" or " BINARY"); *compress
+// is set if the server accepted "COMPRESS deflate", *binary (if given) if
+// it accepted BINARY. Returns the socket or -1.
+static int connect_and_hello(const char *server_IP, int port, const char *mode, int offer,
+                             int *compress, int *binary, struct connbuf *cb)
+{
+    // Make socket & connect
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+        return -1;
+
+    // ===== PHASE 4: save socket globally =====
+    g_sockfd = sockfd;
+    // ========================================
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    inet_pton(AF_INET, server_IP, &addr.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    // ===== PHASE 1 PARTIAL: HANDSHAKE =====
+    char hello[64];
+    snprintf(hello, sizeof(hello), "HELLO client_%d%s%s\n", getpid(), mode,
+             offer ? " COMPRESS deflate" : "");
+    send_all(sockfd, hello, strlen(hello));
+
+    char hresp[64];
+    connbuf_init(cb, sockfd);
+    if (connbuf_getline(cb, hresp, sizeof(hresp)) <= 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    if (strncmp(hresp, "OK", 2) != 0)
+    {
+        printf("Handshake failed: %s\n", hresp);
+        close(sockfd);
+        return -1;
+    }
+    // The server may decline; then the payload goes out raw
+    *compress = offer && strstr(hresp, "COMPRESS deflate") != NULL;
+    if (binary)
+        *binary = strstr(hresp, " BINARY") != NULL; // an older server stays text
+    // ====================================
+    return sockfd;
+}
+
+// Send the payload raw or, on a compressed connection, as frames
+static void send_payload(int sockfd, struct zcodec *zc, const void *data, size_t len,
+                         uint64_t *wire_bytes)
+{
+    if (zc)
+    {
+        unsigned char frame[ZFRAME_MAX];
+        unsigned streak = 0;
+        const char *p = data;
+        while (len > 0)
+        {
+            size_t n = len < ZFRAME_BLOCK ? len : ZFRAME_BLOCK;
+            size_t flen = zframe_encode(zc, &streak, p, n, frame);
+            send_all(sockfd, frame, flen);
+            *wire_bytes += (uint64_t)flen;
+            p += n;
+            len -= n;
+        }
+        return;
+    }
+    send_all(sockfd, data, len);
+    *wire_bytes += (uint64_t)len;
+}
+
+// Classic upload: WRITE, the whole file, then half-close
+static void upload_full(int sockfd, const char *fname, FILE *in, struct zcodec *zc,
+                        uint64_t *bytes_sent, uint64_t *wire_bytes)
+{
+    // Send the file name
+    char header[1024];
+    int hl = snprintf(header, sizeof(header), "WRITE %s\n", fname);
+    send_all(sockfd, header, (size_t)hl);
+
+    // Stream file bytes, one frame per block when compressing
+    char sendbuf[ZFRAME_BLOCK];
+    size_t n;
+    while ((n = fread(sendbuf, 1, sizeof(sendbuf), in)) > 0)
+    {
+        send_payload(sockfd, zc, sendbuf, n, wire_bytes);
+        *bytes_sent += (uint64_t)n;
+    }
+
+    shutdown(sockfd, SHUT_WR);
+}
+
+/*
+ * Binary upload (PROTOCOL binary, the default): one WRITE frame whose
+ * payload is the file and whose trailer is its CRC-32, so the server
+ * knows where the file ends without a half-close and stores nothing that
+ * arrived damaged. The final reply's text is left in reply. Returns 0,
+ * or -1 if the connection failed.
+ */
+static int upload_binary(int sockfd, struct connbuf *cb, const char *fname, FILE *in,
+                         struct zcodec *zc, uint64_t *bytes_sent, uint64_t *wire_bytes,
+                         char *reply, size_t cap)
+{
+    struct stat st;
+    if (fstat(fileno(in), &st) < 0)
+        return -1;
+    long long size = (long long)st.st_size;
+    unsigned char frame[BFRAME_HDR + BFRAME_META_MAX];
+    size_t flen = bframe_build(frame, BF_WRITE, BF_FLAG_CRC, fname, strlen(fname),
+                               (uint64_t)size);
+    send_all(sockfd, frame, flen);
+
+    // Exactly the announced size, even if the file changes meanwhile
+    char sendbuf[ZFRAME_BLOCK];
+    uLong crc = crc32(0L, Z_NULL, 0);
+    long long left = size;
+    while (left > 0)
+    {
+        size_t want = left < (long long)sizeof(sendbuf) ? (size_t)left : sizeof(sendbuf);
+        size_t n = fread(sendbuf, 1, want, in);
+        if (n < want)
+            memset(sendbuf + n, 0, want - n);
+        crc = crc32(crc, (const Bytef *)sendbuf, (uInt)want);
+        send_payload(sockfd, zc, sendbuf, want, wire_bytes);
+        *bytes_sent += (uint64_t)want;
+        left -= (long long)want;
+    }
+    if (size > 0)
+    {
+        unsigned char tr[BFRAME_TRAILER];
+        bframe_put_crc(tr, (uint32_t)crc);
+        send_all(sockfd, tr, sizeof(tr));
+    }
+
+    // Queue notices and the go-ahead come before the outcome
+    for (;;)
+    {
+        struct bframe f;
+        char meta[BFRAME_META_MAX + 1];
+        if (connbuf_read_full(cb, frame, BFRAME_HDR) != 1 || bframe_unpack(frame, &f) < 0 ||
+            f.payload_len != 0 || connbuf_read_full(cb, meta, f.meta_len) != 1)
+            return -1;
+        meta[f.meta_len] = '\0';
+        if (f.code == BF_NOTIFY)
+            printf("[Notification] NOTIFY BUSY %s\n", meta);
+        else if (f.code != BF_ACCEPTED)
+        {
+            snprintf(reply, cap, "%s%s", f.code >= BF_ERR ? "ERR " : "", meta);
+            break;
+        }
+    }
+    flen = bframe_build(frame, BF_QUIT, 0, "", 0, 0);
+    send_all(sockfd, frame, flen);
+    return 0;
+}
+
+/*
+ * Delta upload (UPLOAD_MODE delta): get the signatures of the server's
+ * copy, send only literals and references to blocks it already has, and
+ * let it rebuild the file under the write lock. The reply line is left
+ * in reply. Returns 0 when sent, 1 if the server could not apply the
+ * delta (send the whole file instead), -1 on error.
+ */
+static int upload_delta(int sockfd, struct connbuf *cb, const char *fname, FILE *in,
+                        struct zcodec *zc, uint64_t *bytes_sent, uint64_t *wire_bytes,
+                        char *reply, size_t cap)
+{
+    struct stat st;
+    if (fstat(fileno(in), &st) < 0)
+        return -1;
+    size_t size = (size_t)st.st_size;
+    unsigned char *data = NULL;
+    if (size > 0)
+    {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if (data == MAP_FAILED)
+            return -1;
+    }
+
+    char header[1024];
+    int hl = snprintf(header, sizeof(header), "DELTA %s\n", fname);
+    send_all(sockfd, header, (size_t)hl);
+
+    // Queue notices come first, like for WRITE
+    int rc = -1;
+    unsigned char *sigs = NULL, *delta = NULL;
+    size_t block = 0, count = 0;
+    long long total = 0;
+    while (connbuf_getline(cb, reply, cap) > 0)
+    {
+        if (strncmp(reply, "NOTIFY BUSY ", 12) == 0)
+        {
+            printf("[Notification] %s\n", reply);
+            continue;
+        }
+        if (sscanf(reply, "OK DELTA %*s %zu %zu %lld", &block, &count, &total) == 3)
+            rc = 0;
+        break;
+    }
+    if (rc < 0)
+        goto out;
+
+    rc = -1;
+    size_t tail = count ? (size_t)(total - (long long)(count - 1) * (long long)block) : 0;
+    size_t dlen;
+    long long reused;
+    if ((count && !(sigs = malloc(count * DELTA_SIG_LEN))) ||
+        (count && connbuf_read_full(cb, sigs, count * DELTA_SIG_LEN) != 1))
+        goto out;
+    delta = delta_build(data, size, block, sigs, count, tail, &dlen, &reused);
+    if (!delta)
+    {
+        send_all(sockfd, "ABORT\n", 6);
+        connbuf_getline(cb, reply, cap);
+        goto out;
+    }
+
+    char size_line[64];
+    snprintf(size_line, sizeof(size_line), "SIZE %zu\n", dlen);
+    send_all(sockfd, size_line, strlen(size_line));
+    send_payload(sockfd, zc, delta, dlen, wire_bytes);
+    *bytes_sent += (uint64_t)size;
+    printf("Delta: %lld of %zu bytes reused from the server's copy, %zu byte delta\n",
+           reused, size, dlen);
+
+    if (connbuf_getline(cb, reply, cap) > 0)
+        rc = strcmp(reply, "ERR delta mismatch") == 0 ? 1 : 0;
+
+out:
+    free(sigs);
+    free(delta);
+    if (data)
+        munmap(data, size);
+    return rc;
+}
+
+/*
+ * Parallel upload (STREAMS n, n > 1): this session sends PUT and holds
+ * the write lock, n extra sessions pull chunk numbers from a shared
+ * counter and send them with CHUNK, each reading its chunks with pread()
+ * so disk reads overlap the sends, and COMMIT publishes the file once
+ * every chunk is acknowledged. Chunks a failed stream left behind are
+ * resent over this session.
+ */
+#define STREAM_DEPTH 2              // chunks in flight per stream
+#define CHUNK_MIN (256 << 10)
+#define CHUNK_MAX (8 << 20)
+
+struct upload
+{
+    const char *server_IP;
+    int port, offer;
+    int fd; // the file, read with pread()
+    char token[32];
+    long long size, chunk;
+    size_t nchunks;
+    size_t next;         // next chunk to claim (atomic)
+    unsigned char *done; // per chunk: acknowledged
+};
+
+struct stream
+{
+    struct upload *up;
+    pthread_t tid;
+    uint64_t bytes, wire;
+};
+
+// Send chunk idx over sockfd, framed on a compressed session
+static int send_chunk(struct upload *up, int sockfd, struct zcodec *zc, size_t idx, char *buf,
+                      uint64_t *bytes, uint64_t *wire)
+{
+    long long off = (long long)idx * up->chunk;
+    size_t len = (size_t)(up->size - off < up->chunk ? up->size - off : up->chunk);
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = pread(up->fd, buf + got, len - got, off + (long long)got);
+        if (n <= 0)
+            return -1;
+        got += (size_t)n;
+    }
+    char header[96];
+    int hl = snprintf(header, sizeof(header), "CHUNK %s %zu %zu\n", up->token, idx, len);
+    if (send_all(sockfd, header, (size_t)hl) < 0)
+        return -1;
+    send_payload(sockfd, zc, buf, len, wire);
+    *bytes += (uint64_t)len;
+    return 0;
+}
+
+// Wait for the reply to the oldest chunk in flight
+static int chunk_ack(struct upload *up, struct connbuf *cb, const size_t *pending)
+{
+    char line[256];
+    size_t idx;
+    if (connbuf_getline(cb, line, sizeof(line)) <= 0 ||
+        sscanf(line, "OK CHUNK %zu", &idx) != 1 || idx != *pending)
+        return -1;
+    up->done[idx] = 1;
+    return 0;
+}
+
+static void *stream_main(void *arg)
+{
+    struct stream *st = arg;
+    struct upload *up = st->up;
+    struct connbuf cb;
+    struct zcodec zc;
+    int compress;
+    char *buf = malloc((size_t)up->chunk);
+    int sockfd = buf ? connect_and_hello(up->server_IP, up->port, " SESSION", up->offer,
+                                         &compress, NULL, &cb)
+                     : -1;
+    if (sockfd < 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    zcodec_init(&zc);
+
+    size_t pending[STREAM_DEPTH];
+    int npend = 0;
+    for (;;)
+    {
+        size_t idx = __atomic_fetch_add(&up->next, 1, __ATOMIC_RELAXED);
+        if (idx >= up->nchunks)
+            break;
+        if (npend == STREAM_DEPTH)
+        {
+            if (chunk_ack(up, &cb, &pending[0]) < 0)
+                goto out;
+            memmove(pending, pending + 1, sizeof(pending[0]) * (STREAM_DEPTH - 1));
+            npend--;
+        }
+        if (send_chunk(up, sockfd, compress ? &zc : NULL, idx, buf, &st->bytes, &st->wire) < 0)
+            goto out;
+        pending[npend++] = idx;
+    }
+    for (int i = 0; i < npend; i++)
+        if (chunk_ack(up, &cb, &pending[i]) < 0)
+            goto out;
+    send_all(sockfd, "QUIT\n", 5);
+
+out:
+    zcodec_free(&zc);
+    close(sockfd);
+    free(buf);
+    return NULL;
+}
+
+// Returns 0 with the server's last reply line in reply, -1 on error
+static int upload_parallel(int sockfd, struct connbuf *cb, struct upload *up, int streams,
+                           const char *fname, struct zcodec *zc, uint64_t *bytes_sent,
+                           uint64_t *wire_bytes, char *reply, size_t cap)
+{
+    struct stat st;
+    if (fstat(up->fd, &st) < 0)
+        return -1;
+    up->size = st.st_size;
+    // A few chunks per stream, so a slow stream doesn't hold up the end
+    up->chunk = up->size / (streams * 4);
+    up->chunk = up->chunk < CHUNK_MIN ? CHUNK_MIN : up->chunk > CHUNK_MAX ? CHUNK_MAX : up->chunk;
+    up->chunk = (up->chunk + ZFRAME_BLOCK - 1) / ZFRAME_BLOCK * ZFRAME_BLOCK;
+    up->nchunks = (size_t)((up->size + up->chunk - 1) / up->chunk);
+
+    char header[1024];
+    int hl = snprintf(header, sizeof(header), "PUT %s %lld %lld\n", fname, up->size, up->chunk);
+    send_all(sockfd, header, (size_t)hl);
+
+    // Queue notices come first, like for WRITE
+    int got;
+    while ((got = connbuf_getline(cb, reply, cap)) > 0 && strncmp(reply, "NOTIFY BUSY ", 12) == 0)
+        printf("[Notification] %s\n", reply);
+    if (got <= 0)
+        return -1;
+    if (sscanf(reply, "OK PUT %*s %31s", up->token) != 1)
+        return 0; // the server's error is the reply
+
+    char *buf = NULL;
+    struct stream *ss = calloc((size_t)streams, sizeof(*ss));
+    if (!ss || !(up->done = calloc(up->nchunks ? up->nchunks : 1, 1)))
+    {
+        free(ss);
+        return -1;
+    }
+    printf("Sending %zu chunks of %lld bytes over %d streams\n", up->nchunks, up->chunk, streams);
+    for (int i = 0; i < streams; i++)
+    {
+        ss[i].up = up;
+        if (pthread_create(&ss[i].tid, NULL, stream_main, &ss[i]) != 0)
+            ss[i].up = NULL;
+    }
+    for (int i = 0; i < streams; i++)
+    {
+        if (!ss[i].up)
+            continue;
+        pthread_join(ss[i].tid, NULL);
+        *bytes_sent += ss[i].bytes;
+        *wire_bytes += ss[i].wire;
+    }
+    free(ss);
+
+    // Resend what failed streams left behind, one at a time
+    int rc = -1;
+    for (size_t i = 0; i < up->nchunks; i++)
+    {
+        if (up->done[i])
+            continue;
+        if ((!buf && !(buf = malloc((size_t)up->chunk))) ||
+            send_chunk(up, sockfd, zc, i, buf, bytes_sent, wire_bytes) < 0 ||
+            chunk_ack(up, cb, &i) < 0)
+            goto out;
+    }
+
+    hl = snprintf(header, sizeof(header), "COMMIT %s\n", up->token);
+    send_all(sockfd, header, (size_t)hl);
+    rc = connbuf_getline(cb, reply, cap) > 0 ? 0 : -1;
+
+out:
+    free(buf);
+    free(up->done);
+    return rc;
+}
+
+/*
+ * Batch upload (UPLOAD_MODE batch with a directory as DATA_FILE_PATH):
+ * every regular file in it goes through one session as "BATCH <count>",
+ * then "FILE <name> <len>" + the bytes per file, without waiting for any
+ * reply. The output is buffered so small files share packets, and the
+ * server answers once with a status line per file.
+ */
+#define BATCH_BUF (256 << 10)
+
+struct outbuf
+{
+    int fd;
+    size_t len;
+    char data[BATCH_BUF];
+};
+
+static void out_flush(struct outbuf *ob)
+{
+    send_all(ob->fd, ob->data, ob->len);
+    ob->len = 0;
+}
+
+static void out_put(struct outbuf *ob, const void *p, size_t n)
+{
+    if (ob->len + n > sizeof(ob->data))
+        out_flush(ob);
+    if (n > sizeof(ob->data))
+    {
+        send_all(ob->fd, p, n);
+        return;
+    }
+    memcpy(ob->data + ob->len, p, n);
+    ob->len += n;
+}
+
+// Names the server can take: one word, short enough for its parser
+static int batch_name_ok(const char *name)
+{
+    if (strlen(name) >= 512)
+        return 0;
+    for (const char *p = name; *p; p++)
+        if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+            return 0;
+    return 1;
+}
+
+// Send one FILE entry of exactly size bytes, framed on a compressed session
+static void batch_send_file(struct outbuf *ob, FILE *f, const char *name, long long size,
+                            struct zcodec *zc, uint64_t *bytes_sent, uint64_t *wire_bytes)
+{
+    char header[600];
+    int hl = snprintf(header, sizeof(header), "FILE %s %lld\n", name, size);
+    out_put(ob, header, (size_t)hl);
+
+    char block[ZFRAME_BLOCK];
+    unsigned char frame[ZFRAME_MAX];
+    unsigned streak = 0;
+    long long left = size;
+    while (left > 0)
+    {
+        size_t want = left < (long long)sizeof(block) ? (size_t)left : sizeof(block);
+        size_t n = f ? fread(block, 1, want, f) : 0;
+        if (n < want)
+        {
+            // The file shrank or failed under us; pad so the stream stays in step
+            memset(block + n, 0, want - n);
+            f = NULL;
+        }
+        if (zc)
+        {
+            size_t flen = zframe_encode(zc, &streak, block, want, frame);
+            out_put(ob, frame, flen);
+            *wire_bytes += (uint64_t)flen;
+        }
+        else
+        {
+            out_put(ob, block, want);
+            *wire_bytes += (uint64_t)want;
+        }
+        *bytes_sent += (uint64_t)want;
+        left -= (long long)want;
+    }
+}
+
+// Returns 0 with a summary in reply, -1 on error
+static int upload_batch(int sockfd, struct connbuf *cb, const char *dir, struct zcodec *zc,
+                        uint64_t *bytes_sent, uint64_t *wire_bytes, char *reply, size_t cap)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return -1;
+
+    // Collect the names first: BATCH announces the count
+    char **names = NULL;
+    size_t count = 0, alloc = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (!batch_name_ok(de->d_name))
+        {
+            printf("Skipping '%s': name cannot be sent\n", de->d_name);
+            continue;
+        }
+        if (count == alloc)
+        {
+            char **p = realloc(names, (alloc = alloc ? alloc * 2 : 64) * sizeof(*names));
+            if (!p)
+                break;
+            names = p;
+        }
+        if (!(names[count] = strdup(de->d_name)))
+            break;
+        count++;
+    }
+
+    struct outbuf *ob = malloc(sizeof(*ob));
+    int rc = -1;
+    if (!ob)
+        goto out;
+    ob->fd = sockfd;
+    ob->len = 0;
+    char header[64];
+    int hl = snprintf(header, sizeof(header), "BATCH %zu\n", count);
+    out_put(ob, header, (size_t)hl);
+    for (size_t i = 0; i < count; i++)
+    {
+        int fd = openat(dirfd(d), names[i], O_RDONLY | O_CLOEXEC);
+        FILE *f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+        struct stat st;
+        long long size = f && fstat(fd, &st) == 0 ? (long long)st.st_size : 0;
+        if (fd >= 0 && !f)
+            close(fd);
+        batch_send_file(ob, f, names[i], size, zc, bytes_sent, wire_bytes);
+        if (f)
+            fclose(f);
+    }
+    out_flush(ob);
+
+    // Queue notices may come first, like for WRITE
+    long long total, stored;
+    char line[1024];
+    int got;
+    while ((got = connbuf_getline(cb, line, sizeof(line))) > 0 &&
+           strncmp(line, "NOTIFY BUSY ", 12) == 0)
+        printf("[Notification] %s\n", line);
+    if (got <= 0)
+        goto out;
+    if (sscanf(line, "OK BATCH %lld %lld", &total, &stored) != 2)
+    {
+        snprintf(reply, cap, "%s", line); // the server's error is the reply
+        rc = 0;
+        goto out;
+    }
+    for (long long i = 0; i < total && connbuf_getline(cb, line, sizeof(line)) > 0; i++)
+    {
+        size_t ll = strlen(line);
+        if (ll < 3 || strcmp(line + ll - 3, " OK") != 0)
+            printf("%s\n", line); // only failures are listed
+    }
+    snprintf(reply, cap, "Batch: %lld of %lld files received by server", stored, total);
+    rc = 0;
+
+out:
+    free(ob);
+    for (size_t i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    closedir(d);
+    return rc;
+}
+
 int main()
 {
     // ===== PHASE 4: register SIGINT handler =====
@@ -53,11 +651,17 @@ int main()
     char data_path[2048] = ""; // from DATA_FILE_PATH
     char file_path[2048] = ""; // resolved file path
     /* ========================================== */
-    char buf[64];
+    char buf[64], val[64];
+    int offer = 0;      // optional COMPRESSION deflate|none
+    int delta_mode = 0; // optional UPLOAD_MODE full|delta|batch
+    int batch_mode = 0;
+    int streams = 1;    // optional STREAMS n: parallel chunked upload when n > 1
+    int text = 0;       // optional PROTOCOL binary|text
 
     struct timespec t0, t1;
     clock_gettime(CLOCK_MONOTONIC, &t0);
     uint64_t bytes_sent = 0;
+    uint64_t wire_bytes = 0; // what the payload took on the wire
 
     // Read the config file
     FILE *cfg = fopen("client_conf", "r");
@@ -77,6 +681,23 @@ int main()
     }
     /* ======================================== */
 
+    while (fscanf(cfg, "%63s %63s", buf, val) == 2)
+    {
+        if (strcmp(buf, "COMPRESSION") == 0)
+            offer = strcmp(val, "deflate") == 0;
+        else if (strcmp(buf, "UPLOAD_MODE") == 0)
+        {
+            delta_mode = strcmp(val, "delta") == 0;
+            batch_mode = strcmp(val, "batch") == 0;
+        }
+        else if (strcmp(buf, "STREAMS") == 0)
+            streams = atoi(val) > 1 ? atoi(val) : 1;
+        else if (strcmp(buf, "PROTOCOL") == 0)
+            text = strcmp(val, "text") == 0;
+    }
+    if (delta_mode || batch_mode)
+        streams = 1; // a delta is small, and a batch is one stream by design
+
     fclose(cfg);
 
     /* ===== DATA_FILE_PATH HANDLING (SAFE ADD) ===== */
@@ -87,7 +708,8 @@ int main()
         return 1;
     }
 
-    if (S_ISDIR(st.st_mode))
+    int batch = batch_mode && S_ISDIR(st.st_mode); // batch of a single file is a WRITE
+    if (S_ISDIR(st.st_mode) && !batch)
     {
         /* ===== WARNING-FREE PATH BUILD ===== */
         strncpy(file_path, data_path, sizeof(file_path) - 1);
@@ -104,72 +726,76 @@ int main()
     }
     /* ============================================ */
     // Open the data file from file path..
-    FILE *in = fopen(file_path, "rb");
-    if (!in)
+    FILE *in = NULL;
+    if (!batch && !(in = fopen(file_path, "rb")))
         return 1;
 
-    // Make socket & connect
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct connbuf cb;
+    struct zcodec zc;
+    int compress, binary = 0;
+    zcodec_init(&zc);
+    // Plain uploads use binary frames unless PROTOCOL text asks for the
+    // original half-close protocol; the others need a text session
+    const char *mode = streams > 1 || batch ? " SESSION" : delta_mode || text ? "" : " BINARY";
+    int sockfd = connect_and_hello(server_IP, port, mode, offer, &compress, &binary, &cb);
     if (sockfd < 0)
         return 1;
 
-    // ===== PHASE 4: save socket globally =====
-    g_sockfd = sockfd;
-    // ========================================
-
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons((unsigned short)port);
-    inet_pton(AF_INET, server_IP, &addr.sin_addr);
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-        return 1;
-
-    // ===== PHASE 1 PARTIAL: HANDSHAKE =====
-    char hello[64];
-    snprintf(hello, sizeof(hello), "HELLO client_%d\n", getpid());
-    send_all(sockfd, hello, strlen(hello));
-
-    char hresp[64];
-    ssize_t hr = recv(sockfd, hresp, sizeof(hresp) - 1, 0);
-    if (hr <= 0)
+    const char *fname = base_name(file_path);
+    char reply[1024] = "";
+    int have_reply = 0;
+    if (batch)
     {
-        close(sockfd);
-        return 1;
+        have_reply = upload_batch(sockfd, &cb, data_path, compress ? &zc : NULL, &bytes_sent,
+                                  &wire_bytes, reply, sizeof(reply)) == 0;
     }
-    hresp[hr] = '\0';
-    if (strncmp(hresp, "OK", 2) != 0)
+    else if (delta_mode)
     {
-        printf("Handshake failed: %s\n", hresp);
-        close(sockfd);
-        return 1;
+        int rc = upload_delta(sockfd, &cb, fname, in, compress ? &zc : NULL, &bytes_sent,
+                              &wire_bytes, reply, sizeof(reply));
+        if (rc == 1)
+        {
+            // The server's copy changed under us or the delta was damaged: send it all
+            printf("%s; sending the whole file\n", reply);
+            close(sockfd);
+            bytes_sent = wire_bytes = 0;
+            if ((sockfd = connect_and_hello(server_IP, port, "", offer, &compress, NULL, &cb)) < 0)
+                return 1;
+            upload_full(sockfd, fname, in, compress ? &zc : NULL, &bytes_sent, &wire_bytes);
+        }
+        else
+            have_reply = rc == 0;
     }
-    // ====================================
-
-    // Send the file name
-    const char *fname = base_name(file_path);
-    char header[1024];
-    int hl = snprintf(header, sizeof(header), "WRITE %s\n", fname);
-    send_all(sockfd, header, (size_t)hl);
-
-    // Stream file bytes
-    char sendbuf[65536];
-    size_t n;
-    while ((n = fread(sendbuf, 1, sizeof(sendbuf), in)) > 0)
+    else if (streams > 1)
     {
-        send_all(sockfd, sendbuf, n);
-        bytes_sent += (uint64_t)n;
+        struct upload up = {.server_IP = server_IP, .port = port, .offer = offer,
+                            .fd = fileno(in)};
+        have_reply = upload_parallel(sockfd, &cb, &up, streams, fname, compress ? &zc : NULL,
+                                     &bytes_sent, &wire_bytes, reply, sizeof(reply)) == 0;
     }
-    fclose(in);
-
-    shutdown(sockfd, SHUT_WR);
+    else if (binary)
+    {
+        have_reply = upload_binary(sockfd, &cb, fname, in, compress ? &zc : NULL, &bytes_sent,
+                                   &wire_bytes, reply, sizeof(reply)) == 0;
+    }
+    else
+    {
+        upload_full(sockfd, fname, in, compress ? &zc : NULL, &bytes_sent, &wire_bytes);
+    }
+    zcodec_free(&zc);
+    if (in)
+        fclose(in);
     clock_gettime(CLOCK_MONOTONIC, &t1);
 
-    char reply[128];
-    ssize_t r = recv(sockfd, reply, sizeof(reply) - 1, 0);
-    if (r > 0)
+    if (!have_reply)
+    {
+        ssize_t r = connbuf_read(&cb, reply, sizeof(reply) - 1);
+        if (r > 0)
+            reply[r] = '\0';
+        have_reply = r > 0;
+    }
+    if (have_reply)
     {
-        reply[r] = '\0';
-
         // ===== PHASE 4: handle server shutdown =====
         if (strncmp(reply, "SERVER_SHUTDOWN", 15) == 0)
         {
@@ -179,7 +805,7 @@ int main()
         }
         // ==========================================
 
-        printf("%s", reply);
+        printf("%s%s", reply, !strchr(reply, '\n') ? "\n" : "");
     }
     else
     {
@@ -190,6 +816,9 @@ int main()
     double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
     double MB = bytes_sent / 1e6;
     printf("TCP: sent %" PRIu64 " bytes in %.3f s (%.2f MB/s)\n", bytes_sent, dt, MB / dt);
+    if (compress || delta_mode)
+        printf("On the wire: %" PRIu64 " payload bytes (%.1fx)\n", wire_bytes,
+               wire_bytes ? (double)bytes_sent / (double)wire_bytes : 1.0);
 
     close(sockfd);
     return 0;
@@ -1,16 +1,26 @@
 // client_ops.c
 // Part 3 client: supports READ (cat) and WRITE (simple nano-like line editor)
 // + displays real-time notifications from server when file is busy.
+// LIST and STAT show what the server holds without reading it.
+// READ keeps the last copy of each file and only re-fetches changed ones.
+// All menu operations share one SESSION connection to the server;
+// Download adds parallel range sessions of its own.
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+
+#include "netio.h"
 
 // ===== PHASE 4: global socket & SIGINT handler =====
 static int g_ops_sockfd = -1;
@@ -25,38 +35,19 @@ void client_ops_sigint(int sig)
 }
 // ==================================================
 
-static int recv_line(int fd, char *buf, size_t cap)
-{
-    size_t i = 0;
-    while (i + 1 < cap)
-    {
-        char ch;
-        ssize_t r = recv(fd, &ch, 1, 0);
-        if (r == 0)
-            return 0;   // connection closed
-        if (r < 0)
-            return -1;  // error
-        buf[i++] = ch;
-        if (ch == '\n')
-            break;
-    }
-    buf[i] = '\0';
-    return 1;
-}
+// Read buffer of the session connection (g_ops_sockfd)
+static struct connbuf g_cb;
 
-static void send_all(int fd, const void *buf, size_t len)
-{
-    size_t off = 0;
-    while (off < len)
-    {
-        ssize_t n = send(fd, (const char *)buf + off, len - off, 0);
-        if (n <= 0)
-            return;
-        off += (size_t)n;
-    }
-}
+// COMPRESSION deflate in client_ops_conf: offer compressed transfers
+static int g_offer_compress;
 
-static int connect_to_server(const char *ip, int port)
+// Codec of the session connection; g_compress says whether the server took it
+static struct zcodec g_zc;
+static int g_compress;
+
+// Open a SESSION connection; replies are read through cb. *compress is
+// set when the server accepted compressed transfers for it.
+static int connect_to_server(const char *ip, int port, struct connbuf *cb, int *compress)
 {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
@@ -86,19 +77,20 @@ static int connect_to_server(const char *ip, int port)
 
     /* ===== PHASE 1 PARTIAL: HANDSHAKE ===== */
     char hello[64];
-    snprintf(hello, sizeof(hello), "HELLO client_ops_%d\n", getpid());
+    snprintf(hello, sizeof(hello), "HELLO client_ops_%d SESSION%s\n", getpid(),
+             g_offer_compress ? " COMPRESS deflate" : "");
     send_all(sockfd, hello, strlen(hello));
 
+    connbuf_init(cb, sockfd);
     char resp[64];
-    ssize_t r = recv(sockfd, resp, sizeof(resp) - 1, 0);
-    if (r <= 0)
+    if (connbuf_getline(cb, resp, sizeof(resp)) <= 0)
     {
         close(sockfd);
         return -1;
     }
-    resp[r] = '\0';
 
-    if (strncmp(resp, "OK", 2) != 0)
+    *compress = strcmp(resp, "OK SESSION COMPRESS deflate") == 0;
+    if (strcmp(resp, "OK SESSION") != 0 && !*compress)
     {
         fprintf(stderr, "Handshake failed: %s\n", resp);
         close(sockfd);
@@ -109,6 +101,70 @@ static int connect_to_server(const char *ip, int port)
     return sockfd;
 }
 
+static void session_close(void)
+{
+    if (g_ops_sockfd >= 0)
+        close(g_ops_sockfd);
+    g_ops_sockfd = -1;
+    zcodec_free(&g_zc);
+    g_compress = 0;
+}
+
+/*
+ * Next piece of a reply body with want bytes left: one decoded frame on
+ * a compressed connection (z != NULL), else whatever is buffered or
+ * arrives next. buf holds ZFRAME_BLOCK bytes. Returns the bytes stored,
+ * or <= 0 if the connection broke or sent more than was announced.
+ */
+static ssize_t read_body(struct connbuf *cb, struct zcodec *z, char *buf, long long want)
+{
+    if (z)
+    {
+        size_t wire;
+        ssize_t r = connbuf_read_frame(cb, z, buf, &wire);
+        return r > want ? -1 : r;
+    }
+    size_t n = want < ZFRAME_BLOCK ? (size_t)want : ZFRAME_BLOCK;
+    return connbuf_read(cb, buf, n);
+}
+
+/*
+ * Send a command header on the session and read the first reply line.
+ * The session is opened on first use; if the server dropped an idle
+ * session the command is retried once on a fresh connection.
+ */
+static int session_request(const char *ip, int port, const char *header,
+                           char *line, size_t cap)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (g_ops_sockfd < 0)
+        {
+            /* ===== PHASE 4: track active socket ===== */
+            g_ops_sockfd = connect_to_server(ip, port, &g_cb, &g_compress);
+            /* ======================================= */
+            if (g_ops_sockfd < 0)
+                return -1;
+        }
+        if (send_all(g_ops_sockfd, header, strlen(header)) == 0 &&
+            connbuf_getline(&g_cb, line, cap) > 0)
+        {
+            /* ===== PHASE 4: server shutdown handling ===== */
+            if (strncmp(line, "SERVER_SHUTDOWN", 15) == 0)
+            {
+                printf("Server is shutting down. Client exiting.\n");
+                session_close();
+                exit(0);
+            }
+            /* ============================================ */
+            return 1;
+        }
+        session_close();
+    }
+    fprintf(stderr, "Lost connection to server.\n");
+    return -1;
+}
+
 static void trim_newline(char *s)
 {
     size_t n = strlen(s);
@@ -119,49 +175,194 @@ static void trim_newline(char *s)
     }
 }
 
+/*
+ * Read cache: the last copy of each file read, as
+ * READ_CACHE_DIR/<name> = "<tag>\n" + the bytes. READ sends the tag as
+ * IF-NONE-MATCH, so an unchanged file costs one round trip and no
+ * payload. A new copy goes to <name>.tmp and is renamed over the old
+ * one, so an interrupted read never leaves a tag with the wrong bytes.
+ */
+#define READ_CACHE_DIR ".client_ops_cache"
+
+// Cached copy of filename, positioned at its first byte, with its tag in tag
+static FILE *read_cache_open(const char *filename, char *tag, size_t cap)
+{
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%s", READ_CACHE_DIR, filename);
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    if (!fgets(tag, (int)cap, f) || tag[0] == '\n' || !strchr(tag, '\n'))
+    {
+        fclose(f);
+        return NULL;
+    }
+    trim_newline(tag);
+    return f;
+}
+
+// New cache file for filename, tag line written; read_cache_commit() publishes it
+static FILE *read_cache_create(const char *filename, const char *tag)
+{
+    if (mkdir(READ_CACHE_DIR, 0755) < 0 && errno != EEXIST)
+        return NULL;
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%s.tmp", READ_CACHE_DIR, filename);
+    FILE *f = fopen(path, "wb");
+    if (f)
+        fprintf(f, "%s\n", tag);
+    return f;
+}
+
+static void read_cache_commit(FILE *f, const char *filename, int ok)
+{
+    char tmp[1100], path[1100];
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", READ_CACHE_DIR, filename);
+    snprintf(path, sizeof(path), "%s/%s", READ_CACHE_DIR, filename);
+    if (fclose(f) != 0 || !ok || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
 /*
  * READ mode (cat equivalent)
  */
 static void do_read(const char *ip, int port, const char *filename)
 {
-    int fd = connect_to_server(ip, port);
-    if (fd < 0)
+    char tag[128];
+    FILE *cached = read_cache_open(filename, tag, sizeof(tag));
+
+    char header[1024];
+    if (cached)
+        snprintf(header, sizeof(header), "READ %s IF-NONE-MATCH %s\n", filename, tag);
+    else
+        snprintf(header, sizeof(header), "READ %s\n", filename);
+
+    char line[1024];
+    if (session_request(ip, port, header, line, sizeof(line)) < 0)
+    {
+        if (cached)
+            fclose(cached);
         return;
+    }
 
-    /* ===== PHASE 4: track active socket ===== */
-    g_ops_sockfd = fd;
-    /* ======================================= */
+    char buf[ZFRAME_BLOCK];
+    if (cached && strncmp(line, "OK NOTMODIFIED ", 15) == 0)
+    {
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), cached)) > 0)
+            fwrite(buf, 1, n, stdout);
+        fclose(cached);
+        return;
+    }
+    if (cached)
+        fclose(cached);
 
-    char header[1024];
-    snprintf(header, sizeof(header), "READ %s\n", filename);
-    send_all(fd, header, strlen(header));
+    long long size;
+    int fields = sscanf(line, "OK READ %*s %lld %127s", &size, tag);
+    if (fields < 1)
+    {
+        printf("%s\n", line);
+        return;
+    }
+    // An older server sends no tag: nothing to cache under
+    FILE *keep = fields == 2 ? read_cache_create(filename, tag) : NULL;
 
-    char buf[4096];
-    for (;;)
+    int ok = 1;
+    while (size > 0)
     {
-        ssize_t r = recv(fd, buf, sizeof(buf), 0);
-        if (r == 0)
-            break;
-        if (r < 0)
+        ssize_t r = read_body(&g_cb, g_compress ? &g_zc : NULL, buf, size);
+        if (r <= 0)
         {
-            perror("recv");
+            fprintf(stderr, "Server closed connection mid-file.\n");
+            session_close();
+            ok = 0;
             break;
         }
+        fwrite(buf, 1, (size_t)r, stdout);
+        if (keep && fwrite(buf, 1, (size_t)r, keep) != (size_t)r)
+            ok = 0;
+        size -= r;
+    }
+    if (keep)
+        read_cache_commit(keep, filename, ok);
+}
 
-        /* ===== PHASE 4: server shutdown handling ===== */
-        if (r >= 15 && memcmp(buf, "SERVER_SHUTDOWN", 15) == 0)
+// "<sec>.<nsec>" from LIST / STAT as local time
+static void print_entry(const char *name, long long size, const char *mtime)
+{
+    time_t t = (time_t)strtoll(mtime, NULL, 10);
+    char when[32] = "?";
+    struct tm tm;
+    if (localtime_r(&t, &tm))
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%-40s %12lld  %s\n", name, size, when);
+}
+
+/*
+ * LIST: every file whose name starts with prefix, a page at a time
+ */
+static void do_list(const char *ip, int port, const char *prefix)
+{
+    char after[512] = "";
+    long long shown = 0;
+    for (;;)
+    {
+        char header[1200], line[1024];
+        snprintf(header, sizeof(header), "LIST%s%s%s%s\n", prefix[0] ? " PREFIX " : "", prefix,
+                 after[0] ? " AFTER " : "", after);
+        if (session_request(ip, port, header, line, sizeof(line)) < 0)
+            return;
+        long long count, len;
+        int more;
+        if (sscanf(line, "OK LIST %lld %lld %d", &count, &len, &more) != 3)
         {
-            printf("Server is shutting down. Client exiting.\n");
-            close(fd);
-            exit(0);
+            printf("%s\n", line);
+            return;
         }
-        /* ============================================ */
-
-        fwrite(buf, 1, (size_t)r, stdout);
+        char *body = malloc((size_t)len + 1);
+        if (!body || (len > 0 && connbuf_read_full(&g_cb, body, (size_t)len) != 1))
+        {
+            fprintf(stderr, "Server closed connection mid-list.\n");
+            free(body);
+            session_close();
+            return;
+        }
+        body[len] = '\0';
+        char *save = NULL;
+        for (char *l = strtok_r(body, "\n", &save); l; l = strtok_r(NULL, "\n", &save))
+        {
+            char name[512], mtime[64];
+            long long size;
+            if (sscanf(l, "%511s %lld %63s", name, &size, mtime) != 3)
+                continue;
+            print_entry(name, size, mtime);
+            snprintf(after, sizeof(after), "%s", name);
+        }
+        free(body);
+        shown += count;
+        if (!more || count == 0)
+            break;
     }
+    printf("%lld file(s)\n", shown);
+}
 
-    close(fd);
-    g_ops_sockfd = -1;
+/*
+ * STAT: size and modification time of one file
+ */
+static void do_stat(const char *ip, int port, const char *filename)
+{
+    char header[1024], line[1024];
+    snprintf(header, sizeof(header), "STAT %s\n", filename);
+    if (session_request(ip, port, header, line, sizeof(line)) < 0)
+        return;
+    char name[512], mtime[64];
+    long long size;
+    if (sscanf(line, "OK STAT %511s %lld %63s", name, &size, mtime) != 3)
+    {
+        printf("%s\n", line);
+        return;
+    }
+    print_entry(name, size, mtime);
 }
 
 /*
@@ -169,67 +370,60 @@ static void do_read(const char *ip, int port, const char *filename)
  */
 static void do_write(const char *ip, int port, const char *filename)
 {
-    int fd = connect_to_server(ip, port);
-    if (fd < 0)
-        return;
-
-    /* ===== PHASE 4: track active socket ===== */
-    g_ops_sockfd = fd;
-    /* ======================================= */
-
     char header[1024];
     snprintf(header, sizeof(header), "WRITE %s\n", filename);
-    send_all(fd, header, strlen(header));
 
     char line[1024];
+    if (session_request(ip, port, header, line, sizeof(line)) < 0)
+        return;
+
     for (;;)
     {
-        int rc = recv_line(fd, line, sizeof(line));
-
-        if (rc == 0)
-        {
-            fprintf(stderr, "Server closed connection while waiting.\n");
-            close(fd);
-            return;
-        }
-        if (rc < 0)
-        {
-            perror("recv_line");
-            close(fd);
-            return;
-        }
-
         /* ===== PHASE 4: server shutdown handling ===== */
         if (strncmp(line, "SERVER_SHUTDOWN", 15) == 0)
         {
             printf("Server is shutting down. Client exiting.\n");
-            close(fd);
+            session_close();
             exit(0);
         }
         /* ============================================ */
 
         if (strncmp(line, "NOTIFY BUSY ", 12) == 0)
         {
-            printf("[Notification] %s is currently being edited by another client.\n",
-                   line + 12);
-            continue;
+            int pos = 0;
+            sscanf(line + 12, "%*s %d", &pos);
+            printf("[Notification] %s is currently being edited by another client "
+                   "(you are #%d in line).\n", filename, pos);
         }
-
-        if (strncmp(line, "OK WRITE ", 9) == 0)
+        else if (strncmp(line, "OK WRITE ", 9) == 0)
         {
             printf("Write lock granted. Enter text now.\n");
             printf("Commands: ':wq' = save+quit, ':q!' = quit without saving\n\n");
             break;
         }
-
-        if (strncmp(line, "ERR", 3) == 0)
+        else if (strncmp(line, "ERR", 3) == 0)
         {
-            printf("%s", line);
-            close(fd);
+            printf("%s\n", line);
             return;
         }
+        else
+        {
+            printf("%s\n", line);
+        }
 
-        printf("%s", line);
+        int rc = connbuf_getline(&g_cb, line, sizeof(line));
+        if (rc == 0)
+        {
+            fprintf(stderr, "Server closed connection while waiting.\n");
+            session_close();
+            return;
+        }
+        if (rc < 0)
+        {
+            perror("recv");
+            session_close();
+            return;
+        }
     }
 
     size_t cap = 4096;
@@ -238,7 +432,8 @@ static void do_write(const char *ip, int port, const char *filename)
     if (!content)
     {
         fprintf(stderr, "Out of memory\n");
-        close(fd);
+        send_all(g_ops_sockfd, "ABORT\n", 6);
+        connbuf_getline(&g_cb, line, sizeof(line));
         return;
     }
     content[0] = '\0';
@@ -256,9 +451,11 @@ static void do_write(const char *ip, int port, const char *filename)
 
         if (strcmp(input, ":q!") == 0)
         {
+            // Release the write lock and leave the file untouched
+            send_all(g_ops_sockfd, "ABORT\n", 6);
+            connbuf_getline(&g_cb, line, sizeof(line));
             printf("Quit without saving.\n");
             free(content);
-            close(fd);
             return;
         }
         if (strcmp(input, ":wq") == 0)
@@ -274,7 +471,8 @@ static void do_write(const char *ip, int port, const char *filename)
             {
                 fprintf(stderr, "Out of memory\n");
                 free(content);
-                close(fd);
+                send_all(g_ops_sockfd, "ABORT\n", 6);
+                connbuf_getline(&g_cb, line, sizeof(line));
                 return;
             }
             content = tmp;
@@ -286,26 +484,277 @@ static void do_write(const char *ip, int port, const char *filename)
         content[len] = '\0';
     }
 
-    if (len > 0)
-        send_all(fd, content, len);
-
-    shutdown(fd, SHUT_WR);
+    char size_line[64];
+    snprintf(size_line, sizeof(size_line), "SIZE %zu\n", len);
+    send_all(g_ops_sockfd, size_line, strlen(size_line));
+    if (len > 0 && g_compress)
+        send_frames(g_ops_sockfd, &g_zc, content, len);
+    else if (len > 0)
+        send_all(g_ops_sockfd, content, len);
 
-    char reply[1024];
-    ssize_t r = recv(fd, reply, sizeof(reply) - 1, 0);
-    if (r > 0)
+    if (connbuf_getline(&g_cb, line, sizeof(line)) > 0)
     {
-        reply[r] = '\0';
-        printf("%s", reply);
+        printf("%s\n", line);
     }
     else
     {
         printf("No confirmation from server.\n");
+        session_close();
     }
 
     free(content);
+}
+
+/*
+ * DOWNLOAD mode: parallel, resumable fetch into ./<filename>.
+ * The file is split into DOWNLOAD_STREAMS segments, each fetched with
+ * "READ name offset length" on its own session and pwrite()n into
+ * <filename>.part. Progress lives in <filename>.part.state: the total
+ * size and the version tag of the file, then one fixed-width line per
+ * segment with the bytes already stored, rewritten in place after each
+ * chunk. An interrupted download resumes from there if the file still
+ * has that tag; a segment whose reply names another version fails, so
+ * the .part file never mixes two versions. The .part file is renamed
+ * into place when done.
+ */
+#define DOWNLOAD_STREAMS 4
+#define STATE_LINE 21  // "%020lld\n"
+#define STATE_TAG 128  // "%-127s\n"
+#define STATE_HEAD (STATE_LINE + STATE_TAG)
+
+struct segment
+{
+    const char *ip;
+    int port;
+    const char *filename;
+    const char *tag; // version being downloaded ("" from a server without tags)
+    int part_fd;
+    int state_fd;
+    int index;
+    long long total;
+    long long start; // first byte of the segment
+    long long len;   // segment length
+    long long done;  // bytes already stored
+    int ok;
+    int changed; // the server sent another version of the file
+};
+
+// Progress of segment i
+static int state_store(int fd, int i, long long value)
+{
+    char rec[STATE_LINE + 1];
+    snprintf(rec, sizeof(rec), "%020lld\n", value);
+    return pwrite(fd, rec, STATE_LINE, STATE_HEAD + (off_t)i * STATE_LINE) == STATE_LINE ? 0
+                                                                                         : -1;
+}
+
+// Which file the progress belongs to: its size and version tag
+static int state_head(int fd, long long total, const char *tag)
+{
+    char rec[STATE_HEAD + 1];
+    snprintf(rec, sizeof(rec), "%020lld\n%-*.*s\n", total, STATE_TAG - 1, STATE_TAG - 1, tag);
+    return pwrite(fd, rec, STATE_HEAD, 0) == STATE_HEAD ? 0 : -1;
+}
+
+// Load progress into segs; returns 0 only if the state matches total and tag
+static int state_load(int fd, long long total, const char *tag, struct segment *segs)
+{
+    char head[STATE_HEAD + 1], saved[STATE_TAG];
+    head[STATE_HEAD] = '\0';
+    long long v;
+    saved[0] = '\0';
+    if (pread(fd, head, STATE_HEAD, 0) != STATE_HEAD || sscanf(head, "%lld", &v) != 1 ||
+        v != total)
+        return -1;
+    sscanf(head + STATE_LINE, "%127s", saved);
+    if (strcmp(saved, tag) != 0)
+        return -1;
+    char rec[STATE_LINE + 1];
+    rec[STATE_LINE] = '\0';
+    for (int i = 0; i < DOWNLOAD_STREAMS; i++)
+    {
+        if (pread(fd, rec, STATE_LINE, STATE_HEAD + (off_t)i * STATE_LINE) != STATE_LINE ||
+            sscanf(rec, "%lld", &v) != 1 || v < 0 || v > segs[i].len)
+            return -1;
+        segs[i].done = v;
+    }
+    return 0;
+}
+
+static void *segment_fetch(void *arg)
+{
+    struct segment *sg = arg;
+    long long want = sg->len - sg->done;
+    if (want == 0)
+    {
+        sg->ok = 1;
+        return NULL;
+    }
+
+    struct connbuf cb;
+    struct zcodec zc;
+    int compress;
+    int fd = connect_to_server(sg->ip, sg->port, &cb, &compress);
+    if (fd < 0)
+        return NULL;
+    zcodec_init(&zc);
+
+    char header[1024], line[1024] = "";
+    snprintf(header, sizeof(header), "READ %s %lld %lld\n", sg->filename,
+             sg->start + sg->done, want);
+    long long off = -1, len = -1, total = -1;
+    char tag[STATE_TAG] = "";
+    if (send_all(fd, header, strlen(header)) < 0 ||
+        connbuf_getline(&cb, line, sizeof(line)) <= 0 ||
+        sscanf(line, "OK RANGE %*s %lld %lld %lld %127s", &off, &len, &total, tag) < 3 ||
+        total != sg->total || len != want || strcmp(tag, sg->tag) != 0)
+    {
+        // Another size or version: these bytes don't belong with the rest
+        sg->changed = strncmp(line, "OK RANGE ", 9) == 0 && (total != sg->total ||
+                                                            strcmp(tag, sg->tag) != 0);
+        fprintf(stderr, "Segment %d: %s\n", sg->index, line);
+        close(fd);
+        return NULL;
+    }
+
+    char buf[ZFRAME_BLOCK];
+    while (want > 0)
+    {
+        ssize_t r = read_body(&cb, compress ? &zc : NULL, buf, want);
+        if (r <= 0)
+            break;
+        if (pwrite(sg->part_fd, buf, (size_t)r, (off_t)(sg->start + sg->done)) != r)
+        {
+            perror("pwrite");
+            break;
+        }
+        // Data first, then the progress record that covers it
+        sg->done += r;
+        want -= r;
+        state_store(sg->state_fd, sg->index, sg->done);
+    }
+    sg->ok = want == 0;
+
+    send_all(fd, "QUIT\n", 5);
     close(fd);
-    g_ops_sockfd = -1;
+    zcodec_free(&zc);
+    return NULL;
+}
+
+static void do_download(const char *ip, int port, const char *filename)
+{
+    // Probe the total size with an empty range
+    char header[1024], line[1024];
+    snprintf(header, sizeof(header), "READ %s 0 0\n", filename);
+    if (session_request(ip, port, header, line, sizeof(line)) < 0)
+        return;
+    long long off, len, total;
+    char tag[STATE_TAG] = "";
+    if (sscanf(line, "OK RANGE %*s %lld %lld %lld %127s", &off, &len, &total, tag) < 3)
+    {
+        printf("%s\n", line);
+        return;
+    }
+
+    char part[1100], state[1100];
+    snprintf(part, sizeof(part), "%s.part", filename);
+    snprintf(state, sizeof(state), "%s.part.state", filename);
+
+    struct segment segs[DOWNLOAD_STREAMS];
+    long long seg_len = (total + DOWNLOAD_STREAMS - 1) / DOWNLOAD_STREAMS;
+    for (int i = 0; i < DOWNLOAD_STREAMS; i++)
+    {
+        long long start = (long long)i * seg_len;
+        if (start > total)
+            start = total;
+        long long end = start + seg_len < total ? start + seg_len : total;
+        segs[i] = (struct segment){.ip = ip, .port = port, .filename = filename,
+                                   .tag = tag, .index = i, .total = total,
+                                   .start = start, .len = end - start};
+    }
+
+    int state_fd = open(state, O_RDWR | O_CREAT, 0644);
+    int part_fd = open(part, O_RDWR | O_CREAT, 0644);
+    if (state_fd < 0 || part_fd < 0)
+    {
+        perror("open");
+        if (state_fd >= 0)
+            close(state_fd);
+        if (part_fd >= 0)
+            close(part_fd);
+        return;
+    }
+
+    // Resume only if the saved progress belongs to this version of the file
+    if (state_load(state_fd, total, tag, segs) == 0)
+    {
+        long long have = 0;
+        for (int i = 0; i < DOWNLOAD_STREAMS; i++)
+            have += segs[i].done;
+        printf("Resuming %s: %lld of %lld bytes already here.\n", filename, have, total);
+    }
+    else
+    {
+        if (ftruncate(part_fd, 0) < 0 || ftruncate(state_fd, 0) < 0 ||
+            state_head(state_fd, total, tag) < 0)
+        {
+            perror("state");
+            close(state_fd);
+            close(part_fd);
+            return;
+        }
+        for (int i = 0; i < DOWNLOAD_STREAMS; i++)
+        {
+            segs[i].done = 0;
+            state_store(state_fd, i, 0);
+        }
+    }
+
+    pthread_t tids[DOWNLOAD_STREAMS];
+    for (int i = 0; i < DOWNLOAD_STREAMS; i++)
+    {
+        segs[i].part_fd = part_fd;
+        segs[i].state_fd = state_fd;
+        segs[i].ok = 0;
+        segs[i].changed = 0;
+        if (pthread_create(&tids[i], NULL, segment_fetch, &segs[i]) != 0)
+            tids[i] = 0;
+    }
+
+    int ok = 1, changed = 0;
+    for (int i = 0; i < DOWNLOAD_STREAMS; i++)
+    {
+        if (tids[i])
+            pthread_join(tids[i], NULL);
+        ok = ok && tids[i] && segs[i].ok;
+        changed = changed || segs[i].changed;
+    }
+
+    // A short file from an earlier, larger attempt is cut to size
+    if (ok && ftruncate(part_fd, (off_t)total) < 0)
+        ok = 0;
+    close(state_fd);
+    close(part_fd);
+
+    if (!ok && changed)
+    {
+        printf("%s changed on the server during the download; choose Download again to "
+               "start over.\n",
+               filename);
+        return;
+    }
+    if (!ok)
+    {
+        printf("Download of %s interrupted; choose Download again to resume.\n", filename);
+        return;
+    }
+    if (rename(part, filename) < 0)
+    {
+        perror("rename");
+        return;
+    }
+    unlink(state);
+    printf("Downloaded %s (%lld bytes) over %d streams.\n", filename, total, DOWNLOAD_STREAMS);
 }
 
 int main()
@@ -332,6 +781,10 @@ int main()
         fclose(cfg);
         return 1;
     }
+    // Optional: COMPRESSION deflate|none
+    char val[64];
+    if (fscanf(cfg, "%63s %63s", key, val) == 2 && strcmp(key, "COMPRESSION") == 0)
+        g_offer_compress = strcmp(val, "deflate") == 0;
     fclose(cfg);
 
     for (;;)
@@ -339,7 +792,10 @@ int main()
         printf("\n=== Client Ops Menu ===\n");
         printf("1) Read file (cat)\n");
         printf("2) Write/edit file (nano-like)\n");
-        printf("3) Exit\n");
+        printf("3) Download file (parallel, resumable)\n");
+        printf("4) List files\n");
+        printf("5) File info (size, modified)\n");
+        printf("6) Exit\n");
         printf("Choose: ");
 
         char choice[16];
@@ -347,15 +803,20 @@ int main()
             break;
 
         int c = atoi(choice);
-        if (c == 3)
+        if (c == 6)
             break;
 
         char filename[512];
-        printf("Filename (no slashes, no ..): ");
+        printf(c == 4 ? "Name prefix (empty = all files): " : "Filename (no slashes, no ..): ");
         if (!fgets(filename, sizeof(filename), stdin))
             break;
         trim_newline(filename);
 
+        if (c == 4)
+        {
+            do_list(ip, port, filename);
+            continue;
+        }
         if (strlen(filename) == 0)
             continue;
 
@@ -363,9 +824,21 @@ int main()
             do_read(ip, port, filename);
         else if (c == 2)
             do_write(ip, port, filename);
+        else if (c == 3)
+            do_download(ip, port, filename);
+        else if (c == 5)
+            do_stat(ip, port, filename);
         else
             printf("Invalid choice.\n");
     }
 
+    if (g_ops_sockfd >= 0)
+    {
+        char bye[16];
+        send_all(g_ops_sockfd, "QUIT\n", 5);
+        connbuf_getline(&g_cb, bye, sizeof(bye));
+        session_close();
+    }
+
     return 0;
 }
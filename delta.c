@@ -0,0 +1,436 @@
+// delta.c
+// rsync-style delta uploads: block signatures of the server's copy,
+// a client-built delta of copies and literals, and its server-side apply.
+
+#include "delta.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (128 << 10)
+
+size_t delta_block_size(long long total)
+{
+    // sqrt keeps signatures and per-block matching cost in balance; round
+    // up to 1 KB so blocks line up with typical edits of text files
+    size_t b = (size_t)sqrt((double)total);
+    b = (b + 1023) & ~(size_t)1023;
+    if (b < DELTA_BLOCK_MIN)
+        b = DELTA_BLOCK_MIN;
+    if (b > DELTA_BLOCK_MAX)
+        b = DELTA_BLOCK_MAX;
+    return b;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    put32(p, (uint32_t)(v >> 32));
+    put32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+// rsync's rolling checksum: a = sum of bytes, b = sum of prefix sums, mod 2^16
+static uint32_t weak_sum(const unsigned char *p, size_t n, uint32_t *a, uint32_t *b)
+{
+    uint32_t sa = 0, sb = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sa += p[i];
+        sb += sa;
+    }
+    *a = sa & 0xffff;
+    *b = sb & 0xffff;
+    return *a | *b << 16;
+}
+
+// MurmurHash64A: fast, well mixed, and only consulted after a weak match
+static uint64_t strong_sum(const unsigned char *p, size_t n)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t h = 0x5bd1e995ULL ^ (n * m);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t k;
+        memcpy(&k, p + i, 8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    uint64_t t = 0;
+    for (size_t j = n - i; j > 0; j--)
+        t = t << 8 | p[i + j - 1];
+    if (n - i)
+    {
+        h ^= t;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+int delta_signatures(int fd, long long total, size_t block, unsigned char *out)
+{
+    unsigned char *buf = malloc(block);
+    if (!buf)
+        return ENOMEM;
+    long long off = 0;
+    while (off < total)
+    {
+        size_t want = total - off < (long long)block ? (size_t)(total - off) : block;
+        size_t got = 0;
+        while (got < want)
+        {
+            ssize_t r = pread(fd, buf + got, want - got, (off_t)(off + (long long)got));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+            {
+                free(buf);
+                return r < 0 ? errno : EIO;
+            }
+            got += (size_t)r;
+        }
+        uint32_t a, b;
+        put32(out, weak_sum(buf, want, &a, &b));
+        put64(out + 4, strong_sum(buf, want));
+        out += DELTA_SIG_LEN;
+        off += (long long)want;
+    }
+    free(buf);
+    return 0;
+}
+
+/* ============================================================
+ * Client side: build the delta
+ * ============================================================ */
+struct dbuf
+{
+    unsigned char *p;
+    size_t len, cap;
+    int oom;
+};
+
+static unsigned char *dbuf_grow(struct dbuf *d, size_t add)
+{
+    if (d->oom)
+        return NULL;
+    if (d->len + add > d->cap)
+    {
+        size_t cap = d->cap ? d->cap : 4096;
+        while (cap < d->len + add)
+            cap *= 2;
+        unsigned char *tmp = realloc(d->p, cap);
+        if (!tmp)
+        {
+            d->oom = 1;
+            return NULL;
+        }
+        d->p = tmp;
+        d->cap = cap;
+    }
+    unsigned char *at = d->p + d->len;
+    d->len += add;
+    return at;
+}
+
+static void emit_literal(struct dbuf *d, const unsigned char *src, size_t n)
+{
+    while (n > 0)
+    {
+        size_t take = n < DELTA_LIT_MAX ? n : DELTA_LIT_MAX;
+        unsigned char *at = dbuf_grow(d, 5 + take);
+        if (!at)
+            return;
+        at[0] = 'L';
+        put32(at + 1, (uint32_t)take);
+        memcpy(at + 5, src, take);
+        src += take;
+        n -= take;
+    }
+}
+
+// Copy of block i; extends the previous record when that is a copy
+// ending right before block i
+static void emit_copy(struct dbuf *d, size_t *last_copy, uint32_t i)
+{
+    if (*last_copy != (size_t)-1 && *last_copy + 9 == d->len &&
+        get32(d->p + *last_copy + 1) + get32(d->p + *last_copy + 5) == i)
+    {
+        put32(d->p + *last_copy + 5, get32(d->p + *last_copy + 5) + 1);
+        return;
+    }
+    unsigned char *at = dbuf_grow(d, 9);
+    if (!at)
+        return;
+    *last_copy = (size_t)(at - d->p);
+    at[0] = 'C';
+    put32(at + 1, i);
+    put32(at + 5, 1);
+}
+
+// zlib's crc32 takes a uInt length: feed big buffers in pieces
+static uint32_t crc_all(const unsigned char *p, size_t n)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    while (n > 0)
+    {
+        uInt take = n > (1u << 30) ? (1u << 30) : (uInt)n;
+        crc = crc32(crc, p, take);
+        p += take;
+        n -= take;
+    }
+    return (uint32_t)crc;
+}
+
+unsigned char *delta_build(const unsigned char *data, size_t len, size_t block,
+                           const unsigned char *sigs, size_t count, size_t tail,
+                           size_t *out_len, long long *reused)
+{
+    struct dbuf d = {0};
+    size_t last_copy = (size_t)-1;
+    *reused = 0;
+
+    // Chained hash of the full blocks' weak sums
+    size_t full = count > 0 && tail < block ? count - 1 : count;
+    size_t nb = 1;
+    while (nb < 2 * full)
+        nb *= 2;
+    int *head = malloc(nb * sizeof(int));
+    int *next = malloc((full ? full : 1) * sizeof(int));
+    if (!head || !next)
+    {
+        free(head);
+        free(next);
+        return NULL;
+    }
+    memset(head, -1, nb * sizeof(int));
+    for (size_t i = 0; i < full; i++)
+    {
+        size_t h = get32(sigs + i * DELTA_SIG_LEN) & (nb - 1);
+        next[i] = head[h];
+        head[h] = (int)i;
+    }
+
+    size_t pos = 0, lit = 0;
+    uint32_t a = 0, b = 0, w = 0;
+    if (full > 0 && len >= block)
+        w = weak_sum(data, block, &a, &b);
+    while (full > 0 && pos + block <= len)
+    {
+        int match = -1;
+        uint64_t strong = 0;
+        int have_strong = 0;
+        for (int i = head[w & (nb - 1)]; i >= 0; i = next[i])
+        {
+            const unsigned char *s = sigs + (size_t)i * DELTA_SIG_LEN;
+            if (get32(s) != w)
+                continue;
+            if (!have_strong)
+            {
+                strong = strong_sum(data + pos, block);
+                have_strong = 1;
+            }
+            if (get64(s + 4) == strong)
+            {
+                match = i;
+                break;
+            }
+        }
+
+        if (match >= 0)
+        {
+            emit_literal(&d, data + lit, pos - lit);
+            emit_copy(&d, &last_copy, (uint32_t)match);
+            *reused += (long long)block;
+            pos += block;
+            lit = pos;
+            if (pos + block <= len)
+                w = weak_sum(data + pos, block, &a, &b);
+            continue;
+        }
+
+        // Slide the window one byte
+        if (pos + block < len)
+        {
+            unsigned char out = data[pos], in = data[pos + block];
+            a = (a - out + in) & 0xffff;
+            b = (b - (uint32_t)block * out + a) & 0xffff;
+            w = a | b << 16;
+        }
+        pos++;
+        if (pos - lit >= DELTA_LIT_MAX)
+        {
+            emit_literal(&d, data + lit, pos - lit);
+            lit = pos;
+        }
+    }
+
+    // The old file's short last block can only match the very end
+    if (tail > 0 && tail < block && len - lit >= tail)
+    {
+        const unsigned char *s = sigs + (count - 1) * DELTA_SIG_LEN;
+        const unsigned char *end = data + len - tail;
+        uint32_t ta, tb;
+        if (weak_sum(end, tail, &ta, &tb) == get32(s) && strong_sum(end, tail) == get64(s + 4))
+        {
+            emit_literal(&d, data + lit, (size_t)(end - (data + lit)));
+            emit_copy(&d, &last_copy, (uint32_t)(count - 1));
+            *reused += (long long)tail;
+            lit = len;
+        }
+    }
+    emit_literal(&d, data + lit, len - lit);
+
+    unsigned char *at = dbuf_grow(&d, 13);
+    if (at)
+    {
+        at[0] = 'E';
+        put64(at + 1, (uint64_t)len);
+        put32(at + 9, crc_all(data, len));
+    }
+    free(head);
+    free(next);
+    if (d.oom)
+    {
+        free(d.p);
+        return NULL;
+    }
+    *out_len = d.len;
+    return d.p;
+}
+
+/* ============================================================
+ * Server side: apply the delta
+ * ============================================================ */
+static int write_full(int fd, const unsigned char *p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return w < 0 ? errno : EIO;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+int delta_apply(int old_fd, long long old_total, size_t block, int delta_fd, int out,
+                long long *reused)
+{
+    *reused = 0;
+    if (lseek(delta_fd, 0, SEEK_SET) < 0)
+        return errno;
+    int dfd = dup(delta_fd);
+    FILE *in = dfd >= 0 ? fdopen(dfd, "rb") : NULL;
+    unsigned char *buf = malloc(DELTA_LIT_MAX > block ? DELTA_LIT_MAX : block);
+    if (!in || !buf)
+    {
+        if (in)
+            fclose(in);
+        else if (dfd >= 0)
+            close(dfd);
+        free(buf);
+        return ENOMEM;
+    }
+
+    size_t count = (size_t)((old_total + (long long)block - 1) / (long long)block);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    unsigned long long size = 0;
+    int rc = -1;
+    unsigned char rec[13];
+    while (fread(rec, 1, 1, in) == 1)
+    {
+        if (rec[0] == 'C' && fread(rec + 1, 1, 8, in) == 8)
+        {
+            uint32_t first = get32(rec + 1), n = get32(rec + 5);
+            if (n == 0 || first >= count || n > count - first)
+                break;
+            long long off = (long long)first * (long long)block;
+            long long end = (long long)(first + n) * (long long)block;
+            if (end > old_total)
+                end = old_total;
+            int err = 0;
+            while (off < end && !err)
+            {
+                size_t want = end - off < (long long)block ? (size_t)(end - off) : block;
+                ssize_t r = pread(old_fd, buf, want, (off_t)off);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    err = r < 0 ? errno : EIO;
+                else if ((err = write_full(out, buf, (size_t)r)) == 0)
+                {
+                    crc = crc32(crc, buf, (uInt)r);
+                    off += r;
+                    size += (unsigned long long)r;
+                    *reused += r;
+                }
+            }
+            if (err)
+            {
+                rc = err;
+                break;
+            }
+            continue;
+        }
+        if (rec[0] == 'L' && fread(rec + 1, 1, 4, in) == 4)
+        {
+            uint32_t n = get32(rec + 1);
+            if (n == 0 || n > DELTA_LIT_MAX || fread(buf, 1, n, in) != n)
+                break;
+            int err = write_full(out, buf, n);
+            if (err)
+            {
+                rc = err;
+                break;
+            }
+            crc = crc32(crc, buf, n);
+            size += n;
+            continue;
+        }
+        if (rec[0] == 'E' && fread(rec + 1, 1, 12, in) == 12)
+        {
+            // Must be the last record and describe exactly what was built
+            if (fgetc(in) == EOF && get64(rec + 1) == size && get32(rec + 9) == (uint32_t)crc)
+                rc = 0;
+            break;
+        }
+        break;
+    }
+    if (rc == -1 && ferror(in))
+        rc = EIO;
+    fclose(in);
+    free(buf);
+    return rc;
+}
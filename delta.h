@@ -0,0 +1,43 @@
+// delta.h
+// rsync-style delta uploads: block signatures of the server's copy,
+// a client-built delta of copies and literals, and its server-side apply.
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One signature per block of the old file: weak rolling sum (32-bit) and
+// strong hash (64-bit), both big endian. The last block may be short.
+#define DELTA_SIG_LEN 12
+
+// Delta records (all numbers big endian):
+//   'C' u32 first u32 n   copy old blocks first .. first + n - 1
+//   'L' u32 len <bytes>   literal data, at most DELTA_LIT_MAX bytes
+//   'E' u64 size u32 crc  end: new file size and zlib crc32 of the whole file
+#define DELTA_LIT_MAX 65536
+
+// Block size the server uses for a file of total bytes (~sqrt(total))
+size_t delta_block_size(long long total);
+
+// Signatures of the first total bytes of fd into out (count * DELTA_SIG_LEN
+// bytes, count = ceil(total / block)). Returns 0 or an errno.
+int delta_signatures(int fd, long long total, size_t block, unsigned char *out);
+
+// Delta that turns the old file described by sigs (count blocks of block
+// bytes, the last one of tail bytes) into data[0, len). Returns a
+// malloc'd buffer and its length in *out_len, or NULL when out of memory.
+// *reused gets the number of bytes the delta copies from the old file.
+unsigned char *delta_build(const unsigned char *data, size_t len, size_t block,
+                           const unsigned char *sigs, size_t count, size_t tail,
+                           size_t *out_len, long long *reused);
+
+// Rebuild the new file into out from old_fd (old_total bytes, signed with
+// block) and the delta read from delta_fd at offset 0. *reused gets the
+// bytes copied from the old file. Returns 0, an errno if a file failed,
+// or -1 if the delta is malformed or the result fails its size/crc check.
+int delta_apply(int old_fd, long long old_total, size_t block, int delta_fd, int out,
+                long long *reused);
+
+#endif
@@ -0,0 +1,91 @@
+// hist.c
+// Latency histograms shared by the server (STATS) and the benchmark.
+
+#include "hist.h"
+
+#include <string.h>
+#include <time.h>
+
+uint64_t hist_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static int hist_index(uint64_t v)
+{
+    if (v < 2 * HIST_SUB)
+        return (int)v;
+    // Keep the top HIST_SUB_BITS + 1 bits: v >> shift is in [HIST_SUB, 2 * HIST_SUB)
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    int i = (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+uint64_t hist_bucket_low(int i)
+{
+    if (i < 2 * HIST_SUB)
+        return (uint64_t)i;
+    int shift = i / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+    __atomic_fetch_add(&h->buckets[hist_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void hist_snapshot(const struct hist *h, struct hist *out)
+{
+    out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        out->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+    // Bucket counts of a live snapshot can run ahead of count; use their sum
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        total += h->buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p * (double)total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t high = i + 1 < HIST_BUCKETS ? hist_bucket_low(i + 1) - 1 : h->max;
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,45 @@
+// hist.h
+// Latency histograms shared by the server (STATS) and the benchmark.
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HDR-style log-linear buckets: exact below 2 * HIST_SUB, then HIST_SUB
+// buckets per power of two, so any value is within ~6% of its bucket.
+// Values are microseconds; the last bucket collects everything above ~3 months.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 640
+
+struct hist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Monotonic clock in microseconds
+uint64_t hist_now_us(void);
+
+// Add one value. Lock-free (relaxed atomics), so any number of threads
+// can record into the same histogram without serializing on a mutex.
+void hist_record(struct hist *h, uint64_t value);
+
+// Copy h with atomic loads; read percentiles from the copy
+void hist_snapshot(const struct hist *h, struct hist *out);
+
+// Add src's samples into dst (not atomic: dst must be private)
+void hist_merge(struct hist *dst, const struct hist *src);
+
+// Value at or below which a fraction p (0..1) of the samples fall,
+// reported as the upper bound of its bucket, capped at the maximum
+uint64_t hist_percentile(const struct hist *h, double p);
+
+// Smallest value that lands in bucket i
+uint64_t hist_bucket_low(int i);
+
+#endif
@@ -0,0 +1,166 @@
+// netio.c
+// Buffered socket I/O shared by server and clients.
+
+#include "netio.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+void connbuf_init(struct connbuf *cb, int fd)
+{
+    cb->fd = fd;
+    cb->start = cb->end = 0;
+}
+
+size_t connbuf_pending(const struct connbuf *cb)
+{
+    return cb->end - cb->start;
+}
+
+// Pull more bytes from the socket; returns bytes added, 0 on EOF, -1 on error
+static ssize_t connbuf_fill(struct connbuf *cb)
+{
+    if (cb->start > 0)
+    {
+        memmove(cb->buf, cb->buf + cb->start, cb->end - cb->start);
+        cb->end -= cb->start;
+        cb->start = 0;
+    }
+    for (;;)
+    {
+        ssize_t r = recv(cb->fd, cb->buf + cb->end, sizeof(cb->buf) - cb->end, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r > 0)
+            cb->end += (size_t)r;
+        return r;
+    }
+}
+
+int connbuf_getline(struct connbuf *cb, char *out, size_t cap)
+{
+    size_t limit = cap - 1 < sizeof(cb->buf) ? cap - 1 : sizeof(cb->buf);
+    size_t scanned = 0;
+    for (;;)
+    {
+        size_t avail = cb->end - cb->start;
+        char *p = cb->buf + cb->start;
+        char *nl = memchr(p + scanned, '\n', avail - scanned);
+
+        if (nl || avail >= limit)
+        {
+            size_t len = nl ? (size_t)(nl - p) : limit;
+            if (len > limit)
+                len = limit; // over-long line: hand out the first piece
+            memcpy(out, p, len);
+            out[len] = '\0';
+            cb->start += len + (nl && p + len == nl ? 1 : 0);
+            return 1;
+        }
+        scanned = avail;
+
+        ssize_t r = connbuf_fill(cb);
+        if (r == 0)
+            return 0;
+        if (r < 0)
+            return -1;
+    }
+}
+
+ssize_t connbuf_read(struct connbuf *cb, void *dst, size_t len)
+{
+    size_t avail = cb->end - cb->start;
+    if (avail == 0)
+    {
+        if (len >= sizeof(cb->buf))
+        {
+            for (;;)
+            {
+                ssize_t r = recv(cb->fd, dst, len, 0);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                return r;
+            }
+        }
+        ssize_t r = connbuf_fill(cb);
+        if (r <= 0)
+            return r;
+        avail = cb->end - cb->start;
+    }
+    if (len > avail)
+        len = avail;
+    memcpy(dst, cb->buf + cb->start, len);
+    cb->start += len;
+    return (ssize_t)len;
+}
+
+int connbuf_read_full(struct connbuf *cb, void *dst, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t r = connbuf_read(cb, (char *)dst + got, len - got);
+        if (r <= 0)
+            return r == 0 && got == 0 ? 0 : -1;
+        got += (size_t)r;
+    }
+    return 1;
+}
+
+ssize_t connbuf_read_frame(struct connbuf *cb, struct zcodec *z, void *dst, size_t *wire)
+{
+    unsigned char hdr[ZFRAME_HDR];
+    size_t raw;
+    int rc = connbuf_read_full(cb, hdr, sizeof(hdr));
+    if (rc <= 0)
+        return rc;
+    if (zframe_parse(hdr, &raw, wire) < 0)
+        return -1;
+
+    // Stored frames land in dst directly; compressed ones go through z->buf
+    unsigned char *body = dst;
+    if (*wire < raw)
+    {
+        if (!z->buf && !(z->buf = malloc(ZFRAME_MAX)))
+            return -1;
+        body = z->buf;
+    }
+    if (connbuf_read_full(cb, body, *wire) != 1 ||
+        zframe_decode(z, body, *wire, dst, raw) < 0)
+        return -1;
+    *wire += ZFRAME_HDR;
+    return (ssize_t)raw;
+}
+
+int send_all(int fd, const void *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = send(fd, (const char *)buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+int send_frames(int fd, struct zcodec *z, const void *buf, size_t len)
+{
+    unsigned char out[ZFRAME_MAX];
+    unsigned streak = 0;
+    const char *p = buf;
+    while (len > 0)
+    {
+        size_t n = len < ZFRAME_BLOCK ? len : ZFRAME_BLOCK;
+        if (send_all(fd, out, zframe_encode(z, &streak, p, n, out)) < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
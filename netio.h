@@ -0,0 +1,55 @@
+// netio.h
+// Buffered socket I/O shared by server and clients.
+
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "zframe.h"
+
+#define CONNBUF_SIZE 16384
+
+// Per-connection read buffer: one recv() fills it in bulk and lines or
+// payload are handed out from it, so bytes that arrive in the same
+// segment as a header line are never lost or re-read one at a time.
+struct connbuf
+{
+    int fd;
+    size_t start, end; // unread bytes are buf[start, end)
+    char buf[CONNBUF_SIZE];
+};
+
+void connbuf_init(struct connbuf *cb, int fd);
+
+// Bytes already buffered and not yet handed out
+size_t connbuf_pending(const struct connbuf *cb);
+
+// Read one '\n'-terminated line into out (newline stripped). A line longer
+// than cap - 1 is returned in cap - 1 sized pieces.
+// Returns 1 on success, 0 if the peer closed first, -1 on error.
+int connbuf_getline(struct connbuf *cb, char *out, size_t cap);
+
+// Read up to len payload bytes: buffered bytes first, then the socket.
+// Large reads with an empty buffer go straight into dst.
+// Returns bytes read, 0 on EOF, -1 on error.
+ssize_t connbuf_read(struct connbuf *cb, void *dst, size_t len);
+
+// Read exactly len bytes. Returns 1 on success, 0 if the peer closed
+// before the first byte, -1 on error or a close part way through.
+int connbuf_read_full(struct connbuf *cb, void *dst, size_t len);
+
+// Read one compressed-transfer frame (see zframe.h) and decode it into
+// dst (ZFRAME_BLOCK bytes). *wire gets the bytes it took on the wire.
+// Returns the decoded length, 0 if the peer closed between frames, or -1
+// on error, a truncated frame or a frame that does not decode.
+ssize_t connbuf_read_frame(struct connbuf *cb, struct zcodec *z, void *dst, size_t *wire);
+
+// Send the whole buffer; returns 0 on success, -1 on error
+int send_all(int fd, const void *buf, size_t len);
+
+// Send len bytes as compressed-transfer frames; returns 0 or -1
+int send_frames(int fd, struct zcodec *z, const void *buf, size_t len);
+
+#endif
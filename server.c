@@ -1,8 +1,14 @@
 // Implementation of TCP connection on server
 
 // imports
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // accept4, epoll and friends
 #include "server.h"
+#include "netio.h"
+#include "hist.h"
+#include "zframe.h"
+#include "delta.h"
+#include "bframe.h"
+#include "uring.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,366 +17,7290 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <sys/inotify.h>
+
+// Shared directory where server stores all files
+#define SHARED_DIR "./shared"
+
+// Uploads are staged as SHARED_DIR/.upload-<name>.XXXXXX and renamed into place
+#define UPLOAD_PREFIX ".upload-"
 
 /* ============================================================
- * PHASE 4: Client tracking for graceful shutdown
+ * Server configuration (server_conf: one "KEY value" per line)
  * ============================================================ */
-#define MAX_CLIENTS 128
+enum io_mode
+{
+    IO_THREADS, // blocking worker pool (default)
+    IO_EPOLL,   // non-blocking epoll reactor
+    IO_URING    // the reactor, with io_uring requests instead of epoll
+};
 
-static int client_fds[MAX_CLIENTS]; // stores active client sockets
-static int client_count = 0;        // number of active clients
-static pthread_mutex_t client_mu = PTHREAD_MUTEX_INITIALIZER;
-/* ============================================================ */
+enum durability
+{
+    DUR_NONE,      // publish with rename(); the kernel writes it back when it likes
+    DUR_FDATASYNC, // flush every upload and the directory before acknowledging it
+    DUR_GROUP      // uploads finishing together share one flush (see commit_main)
+};
 
-// Shared directory where server stores all files
-#define SHARED_DIR "./shared"
+struct server_conf
+{
+    int port;            // PORT_NO
+    enum io_mode mode;   // IO_MODE threads|epoll|uring
+    int reactor_threads; // REACTOR_THREADS (epoll and uring modes)
+    int pool_size;       // POOL_SIZE worker threads (threads mode only)
+    int queue_size;      // QUEUE_SIZE pending connections before "ERR busy"
+    int backlog;         // BACKLOG passed to listen()
+    int test_delays;     // TEST_DELAYS 1: re-enable the demo sleeps in READ
+    int cache_mb;        // CACHE_MB content cache budget, 0 = off
+    int cache_file_kb;   // CACHE_FILE_KB largest file kept in the cache
+    int compression;     // COMPRESSION 1: accept "COMPRESS deflate" in HELLO
+    enum durability durability; // DURABILITY none|fdatasync|group
+    int group_commit_ms;        // GROUP_COMMIT_MS how long a group flush waits for company
+    int rate_client_kbps;       // RATE_CLIENT_KBPS per HELLO client id, 0 = unlimited
+    int rate_total_kbps;        // RATE_TOTAL_KBPS shared by active clients by weight, 0 = unlimited
+    int rate_burst_kb;          // RATE_BURST_KB sent at full speed by a client that was idle
+    int drain_secs;             // DRAIN_SECS commands in flight may finish after SIGINT
+};
+
+static struct server_conf g_conf = {
+    .port = -1,
+    .mode = IO_THREADS,
+    .reactor_threads = 4,
+    .pool_size = 32,
+    .queue_size = 128,
+    .backlog = 128,
+    .test_delays = 0,
+    .cache_mb = 64,
+    .cache_file_kb = 1024,
+    .compression = 1,
+    .durability = DUR_NONE,
+    .group_commit_ms = 0,
+    .rate_client_kbps = 0,
+    .rate_total_kbps = 0,
+    .rate_burst_kb = 256,
+    .drain_secs = 10,
+};
+/* ============================================================ */
 
 /* ============================================================
  * PHASE 4: Global shutdown flag & SIGINT handler
  * ============================================================ */
 volatile sig_atomic_t server_running = 1;
+volatile sig_atomic_t drain_now = 0; // second signal: don't wait for transfers
 
 void handle_sigint(int sig)
 {
     (void)sig;          // suppress unused warning
+    if (!server_running)
+        drain_now = 1;
     server_running = 0; // tell main accept-loop to exit
 }
 /* ============================================================ */
 
-// Structure to pass client socket fd to thread
+/* ============================================================
+ * Connection registry (IO_MODE threads)
+ *
+ * Every connection a worker serves is linked into g_conns while it
+ * is open, together with the command it is running, so a shutdown
+ * can tell idle sessions from transfers in flight and never touches
+ * a descriptor that was already closed (and maybe reused). Entries
+ * live in the session; linking and unlinking are O(1). The reactors
+ * keep the same state in their own connection lists (reactor_drain).
+ * ============================================================ */
+struct conn_entry
+{
+    int fd;
+    char op[16];    // command in progress, "" = idle
+    char file[512];
+    uint64_t bytes; // payload moved, for the shutdown report (relaxed atomic)
+    int closing;    // no new commands; 1: tell SERVER_SHUTDOWN on the way out, 2: don't
+    struct conn_entry *prev, *next;
+};
+
+static struct
+{
+    pthread_mutex_t mu;
+    struct conn_entry *head;
+    int count;
+} g_conns = {.mu = PTHREAD_MUTEX_INITIALIZER};
+
+// Returns -1 if the server is shutting down (nothing is linked then)
+static int conn_register(struct conn_entry *e, int fd)
+{
+    memset(e, 0, sizeof(*e));
+    e->fd = fd;
+    pthread_mutex_lock(&g_conns.mu);
+    if (!server_running)
+    {
+        pthread_mutex_unlock(&g_conns.mu);
+        return -1;
+    }
+    e->next = g_conns.head;
+    if (g_conns.head)
+        g_conns.head->prev = e;
+    g_conns.head = e;
+    g_conns.count++;
+    pthread_mutex_unlock(&g_conns.mu);
+    return 0;
+}
+
+// Returns 1 if the connection still has to be told SERVER_SHUTDOWN
+static int conn_unregister(struct conn_entry *e)
+{
+    pthread_mutex_lock(&g_conns.mu);
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        g_conns.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    g_conns.count--;
+    int tell = e->closing == 1;
+    pthread_mutex_unlock(&g_conns.mu);
+    return tell;
+}
+
+// A command starts: "<op> <file> ..."; -1 = refused, the server is shutting down
+static int conn_begin(struct conn_entry *e, const char *line)
+{
+    char op[16] = "", file[512] = "";
+    sscanf(line, "%15s %511s", op, file);
+    pthread_mutex_lock(&g_conns.mu);
+    int rc = 0;
+    if (e->closing || !server_running)
+    {
+        e->closing = e->closing ? e->closing : 1;
+        rc = -1;
+    }
+    else
+    {
+        memcpy(e->op, op, sizeof(op));
+        memcpy(e->file, file, sizeof(file));
+    }
+    pthread_mutex_unlock(&g_conns.mu);
+    return rc;
+}
+
+// The command is done; -1 = the server is shutting down, take no more.
+// last: the connection ends anyway (legacy client, error), so nothing
+// may be sent after the reply.
+static int conn_end(struct conn_entry *e, int last)
+{
+    pthread_mutex_lock(&g_conns.mu);
+    e->op[0] = '\0';
+    int rc = 0;
+    if (last)
+        e->closing = 2;
+    else if (e->closing || !server_running)
+    {
+        e->closing = e->closing ? e->closing : 1;
+        rc = -1;
+    }
+    pthread_mutex_unlock(&g_conns.mu);
+    return rc;
+}
+/* ============================================================ */
+
+// Accepted connection waiting in the worker pool queue
 struct client_ctx
 {
-    int fd; // Client connection file descriptor
+    int fd;                     // Client connection file descriptor
+    struct timespec queued_at; // When accept() handed it to the queue
 };
 
-// file lock linked list
-typedef struct FileLockNode
+/* ============================================================
+ * Per-file lock registry
+ *
+ * Entries live in a hash table split into LOCK_SHARDS shards, each
+ * with its own mutex, so lookups for different files rarely contend
+ * and cost O(1) regardless of how many names have been seen. An
+ * entry is reference counted by the requests using it and freed
+ * when the last one lets go, so memory tracks active files only.
+ * ============================================================ */
+#define LOCK_SHARDS 64
+#define LOCK_BUCKETS_INIT 16
+
+struct file_lock
 {
     char *name;
-    pthread_rwlock_t rw;
-    struct FileLockNode *next;
-} FileLockNode;
+    uint32_t hash;
+    int refs; // requests holding or waiting for the lock (guarded by shard mutex)
+    struct file_lock *next; // bucket chain
 
-// Head of lock list
-static FileLockNode *g_locks = NULL;
+    // Writer queue (see below), guarded by mu
+    pthread_mutex_t mu;
+    int held;
+    struct lock_waiter *head, *tail;
+};
 
-// Mutex
-static pthread_mutex_t g_locks_mu = PTHREAD_MUTEX_INITIALIZER;
+struct lock_shard
+{
+    pthread_mutex_t mu;
+    struct file_lock **buckets;
+    size_t nbuckets; // power of two
+    size_t count;
+};
 
-// Ensure shared directory exists
-static void shared_dir(void)
+static struct lock_shard g_lock_shards[LOCK_SHARDS];
+static pthread_once_t g_lock_once = PTHREAD_ONCE_INIT;
+
+static void lock_registry_init(void)
 {
-    struct stat st;
-    if (stat(SHARED_DIR, &st) == -1)
+    for (int i = 0; i < LOCK_SHARDS; i++)
+        pthread_mutex_init(&g_lock_shards[i].mu, NULL);
+}
+
+// FNV-1a
+static uint32_t name_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct lock_shard *lock_shard_of(uint32_t hash)
+{
+    return &g_lock_shards[hash % LOCK_SHARDS];
+}
+
+static size_t lock_bucket_of(const struct lock_shard *sh, uint32_t hash)
+{
+    return (hash / LOCK_SHARDS) & (sh->nbuckets - 1);
+}
+
+// Double the bucket array once the chains average more than one entry
+static void lock_shard_grow(struct lock_shard *sh)
+{
+    size_t n = sh->nbuckets ? sh->nbuckets * 2 : LOCK_BUCKETS_INIT;
+    struct file_lock **nb = calloc(n, sizeof(*nb));
+    if (!nb)
+        return; // keep the old table; chains just get longer
+    size_t old_n = sh->nbuckets;
+    struct file_lock **old = sh->buckets;
+    sh->buckets = nb;
+    sh->nbuckets = n;
+    for (size_t i = 0; i < old_n; i++)
+    {
+        struct file_lock *e = old[i];
+        while (e)
+        {
+            struct file_lock *next = e->next;
+            size_t b = lock_bucket_of(sh, e->hash);
+            e->next = nb[b];
+            nb[b] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+// Look up (or create) the lock entry for filename and take a reference
+static struct file_lock *file_lock_get(const char *filename)
+{
+    pthread_once(&g_lock_once, lock_registry_init);
+
+    uint32_t h = name_hash(filename);
+    struct lock_shard *sh = lock_shard_of(h);
+
+    pthread_mutex_lock(&sh->mu);
+    if (sh->nbuckets == 0 || sh->count >= sh->nbuckets)
+        lock_shard_grow(sh);
+    if (sh->nbuckets == 0)
+    {
+        pthread_mutex_unlock(&sh->mu);
+        return NULL;
+    }
+
+    size_t b = lock_bucket_of(sh, h);
+    for (struct file_lock *e = sh->buckets[b]; e; e = e->next)
+    {
+        if (e->hash == h && strcmp(e->name, filename) == 0)
+        {
+            e->refs++;
+            pthread_mutex_unlock(&sh->mu);
+            return e;
+        }
+    }
+
+    struct file_lock *e = calloc(1, sizeof(*e));
+    if (!e || !(e->name = strdup(filename)))
+    {
+        free(e);
+        pthread_mutex_unlock(&sh->mu);
+        return NULL;
+    }
+    e->hash = h;
+    e->refs = 1;
+    pthread_mutex_init(&e->mu, NULL);
+    e->next = sh->buckets[b];
+    sh->buckets[b] = e;
+    sh->count++;
+
+    pthread_mutex_unlock(&sh->mu);
+    return e;
+}
+
+// Drop a reference; the entry is freed when nobody holds or waits on it
+static void file_lock_put(struct file_lock *lk)
+{
+    struct lock_shard *sh = lock_shard_of(lk->hash);
+
+    pthread_mutex_lock(&sh->mu);
+    if (--lk->refs > 0)
+    {
+        pthread_mutex_unlock(&sh->mu);
+        return;
+    }
+    struct file_lock **pp = &sh->buckets[lock_bucket_of(sh, lk->hash)];
+    while (*pp != lk)
+        pp = &(*pp)->next;
+    *pp = lk->next;
+    sh->count--;
+    pthread_mutex_unlock(&sh->mu);
+
+    pthread_mutex_destroy(&lk->mu);
+    free(lk->name);
+    free(lk);
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Writer queue
+ *
+ * Each file admits one writer at a time; the others wait in FIFO
+ * order on the file's entry. Releasing hands ownership straight to
+ * the head of the queue and wakes it, together with every waiter
+ * whose place in line moved up, so there is no polling and no gap
+ * between one writer finishing and the next starting. A waiter is
+ * either a worker thread blocked on its condvar or an epoll
+ * connection whose reactor is woken through its eventfd.
+ * ============================================================ */
+struct reactor;
+static void reactor_wake(struct reactor *r);
+
+struct lock_waiter
+{
+    struct lock_waiter *next;
+    int granted;        // ownership handed over; the waiter now holds the lock
+    int changed;        // granted or moved up since the waiter last looked
+    pthread_cond_t *cv; // worker thread waiting in handle_write, or
+    struct reactor *r;  // reactor owning the waiting connection
+};
+
+static void waiter_signal(struct lock_waiter *w)
+{
+    w->changed = 1;
+    if (w->cv)
+        pthread_cond_signal(w->cv);
+    else
+        reactor_wake(w->r);
+}
+
+// 1-based place in line, 0 once granted (caller holds lk->mu)
+static int waiter_position(struct file_lock *lk, struct lock_waiter *w)
+{
+    if (w->granted)
+        return 0;
+    int pos = 1;
+    for (struct lock_waiter *q = lk->head; q != w; q = q->next)
+        pos++;
+    return pos;
+}
+
+// Take the lock if it is free, else join the queue; returns 0 or the queue position
+static int writer_acquire(struct file_lock *lk, struct lock_waiter *w)
+{
+    pthread_mutex_lock(&lk->mu);
+    w->next = NULL;
+    w->granted = w->changed = 0;
+    if (!lk->held)
+    {
+        lk->held = 1;
+        w->granted = 1;
+        pthread_mutex_unlock(&lk->mu);
+        return 0;
+    }
+    if (lk->tail)
+        lk->tail->next = w;
+    else
+        lk->head = w;
+    lk->tail = w;
+    int pos = waiter_position(lk, w);
+    pthread_mutex_unlock(&lk->mu);
+    return pos;
+}
+
+// Block until w is granted or moves up, for at most ms; returns 0 once
+// granted, the new position if it moved, or -1 on timeout
+static int writer_wait(struct file_lock *lk, struct lock_waiter *w, int ms)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&lk->mu);
+    int rc = 0;
+    while (!w->changed && rc == 0)
+        rc = pthread_cond_timedwait(w->cv, &lk->mu, &until);
+    int pos = -1;
+    if (w->changed)
+    {
+        w->changed = 0;
+        pos = waiter_position(lk, w);
+    }
+    pthread_mutex_unlock(&lk->mu);
+    return pos;
+}
+
+// Reactor variant of writer_wait: -1 if nothing changed since the last look
+static int writer_poll(struct file_lock *lk, struct lock_waiter *w)
+{
+    pthread_mutex_lock(&lk->mu);
+    int pos = -1;
+    if (w->changed)
+    {
+        w->changed = 0;
+        pos = waiter_position(lk, w);
+    }
+    pthread_mutex_unlock(&lk->mu);
+    return pos;
+}
+
+// Hand the lock to the next waiter, or mark it free (caller holds lk->mu)
+static void writer_handoff(struct file_lock *lk)
+{
+    struct lock_waiter *w = lk->head;
+    if (!w)
+    {
+        lk->held = 0;
+        return;
+    }
+    lk->head = w->next;
+    if (!lk->head)
+        lk->tail = NULL;
+    w->next = NULL;
+    w->granted = 1;
+    waiter_signal(w);
+    for (struct lock_waiter *q = lk->head; q; q = q->next)
+        waiter_signal(q);
+}
+
+static void writer_release(struct file_lock *lk)
+{
+    pthread_mutex_lock(&lk->mu);
+    writer_handoff(lk);
+    pthread_mutex_unlock(&lk->mu);
+}
+
+// Leave the queue (client went away); passes the lock on if it was just granted
+static void writer_cancel(struct file_lock *lk, struct lock_waiter *w)
+{
+    pthread_mutex_lock(&lk->mu);
+    if (w->granted)
+    {
+        writer_handoff(lk);
+        pthread_mutex_unlock(&lk->mu);
+        return;
+    }
+    struct lock_waiter **pp = &lk->head, *prev = NULL;
+    while (*pp != w)
+    {
+        prev = *pp;
+        pp = &(*pp)->next;
+    }
+    *pp = w->next;
+    if (lk->tail == w)
+        lk->tail = prev;
+    for (struct lock_waiter *q = w->next; q; q = q->next)
+        waiter_signal(q);
+    pthread_mutex_unlock(&lk->mu);
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Content cache (CACHE_MB / CACHE_FILE_KB)
+ *
+ * Small files are kept in memory after their first READ and
+ * served from there until a WRITE publishes a new version, which
+ * drops the entry (upload_finish). Entries sit on one LRU list;
+ * inserting past the byte budget evicts from the cold end. A
+ * reader holds a reference while it sends, so an entry evicted or
+ * invalidated mid-reply is freed by the last reader, not under it.
+ *
+ * A reader that filled the cache from an fd it opened before a
+ * concurrent rename must not install that old version: every
+ * invalidation bumps the generation of the name's slot in gens, and
+ * a fill only goes in if that generation is unchanged since the
+ * reader's lookup. Uploads of other files (bar a slot collision)
+ * don't hold back fills.
+ * ============================================================ */
+#define CACHE_BUCKETS_INIT 64
+#define CACHE_GEN_SLOTS 4096 // power of two
+#define TAG_LEN 64
+
+/*
+ * Version tag of an open file, for READ IF-NONE-MATCH. Every upload
+ * is published by renaming a new file over the old one, so the inode
+ * changes with each version; size and mtime (ns) cover files replaced
+ * behind the server's back. Nothing is kept in memory, so tags stay
+ * valid across restarts.
+ */
+static void file_tag(const struct stat *st, char *tag, size_t cap)
+{
+    snprintf(tag, cap, "%llx-%llx-%llx", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+                 (unsigned long long)st->st_mtim.tv_nsec);
+}
+
+struct cache_entry
+{
+    char *name;
+    uint32_t hash;
+    char *data;
+    size_t size;
+    char tag[TAG_LEN]; // file_tag() of the version the data came from
+    int refs; // readers + 1 while in the cache (guarded by g_cache.mu)
+    struct cache_entry *hnext;      // bucket chain
+    struct cache_entry *prev, *next; // LRU list, head = most recently used
+};
+
+struct cache_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;     // entries dropped to stay within the budget
+    unsigned long invalidations; // entries dropped because a WRITE replaced the file
+};
+
+static struct
+{
+    pthread_mutex_t mu;
+    struct cache_entry **buckets;
+    size_t nbuckets; // power of two
+    size_t count;
+    struct cache_entry *head, *tail;
+    size_t bytes;     // sum of linked entry sizes
+    size_t budget;    // CACHE_MB, 0 = cache disabled
+    size_t max_file;  // CACHE_FILE_KB, larger files are always streamed
+    unsigned long gens[CACHE_GEN_SLOTS]; // by name hash, bumped by every invalidation
+    struct cache_stats stats;
+} g_cache = {.mu = PTHREAD_MUTEX_INITIALIZER};
+
+static struct cache_entry **cache_slot(uint32_t hash, const char *name)
+{
+    struct cache_entry **pp = &g_cache.buckets[hash & (g_cache.nbuckets - 1)];
+    while (*pp && ((*pp)->hash != hash || strcmp((*pp)->name, name) != 0))
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+static void cache_grow(void)
+{
+    size_t n = g_cache.nbuckets ? g_cache.nbuckets * 2 : CACHE_BUCKETS_INIT;
+    struct cache_entry **nb = calloc(n, sizeof(*nb));
+    if (!nb)
+        return; // keep the old table; chains just get longer
+    for (size_t i = 0; i < g_cache.nbuckets; i++)
+    {
+        struct cache_entry *e = g_cache.buckets[i];
+        while (e)
+        {
+            struct cache_entry *next = e->hnext;
+            e->hnext = nb[e->hash & (n - 1)];
+            nb[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(g_cache.buckets);
+    g_cache.buckets = nb;
+    g_cache.nbuckets = n;
+}
+
+static void cache_free(struct cache_entry *e)
+{
+    free(e->name);
+    free(e->data);
+    free(e);
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        g_cache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        g_cache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = g_cache.head;
+    if (g_cache.head)
+        g_cache.head->prev = e;
+    g_cache.head = e;
+    if (!g_cache.tail)
+        g_cache.tail = e;
+}
+
+// Take e out of the table and list; returns 1 if the caller must free it
+static int cache_remove_locked(struct cache_entry *e)
+{
+    *cache_slot(e->hash, e->name) = e->hnext;
+    lru_unlink(e);
+    g_cache.count--;
+    g_cache.bytes -= e->size;
+    return --e->refs == 0;
+}
+
+// Can a file of this size be cached at all?
+static int cache_admits(long long size)
+{
+    return g_cache.budget > 0 && size >= 0 && (size_t)size <= g_cache.max_file &&
+           (size_t)size <= g_cache.budget;
+}
+
+// Referenced entry for name, or NULL; *gen receives the generation to pass to cache_fill
+static struct cache_entry *cache_lookup(const char *name, unsigned long *gen)
+{
+    if (g_cache.budget == 0)
+        return NULL;
+
+    uint32_t hash = name_hash(name);
+    pthread_mutex_lock(&g_cache.mu);
+    *gen = g_cache.gens[hash & (CACHE_GEN_SLOTS - 1)];
+    struct cache_entry *e = NULL;
+    if (g_cache.nbuckets)
+        e = *cache_slot(hash, name);
+    if (e)
+    {
+        e->refs++;
+        lru_unlink(e);
+        lru_push_front(e);
+        g_cache.stats.hits++;
+    }
+    else
+        g_cache.stats.misses++;
+    pthread_mutex_unlock(&g_cache.mu);
+    return e;
+}
+
+/*
+ * Read size bytes of the open file fd into a new entry and install it
+ * if name was not invalidated since cache_lookup returned gen. The
+ * entry is returned referenced either way, so the caller can serve its
+ * snapshot from memory; NULL if the read fails or memory is short.
+ */
+static struct cache_entry *cache_fill(const char *name, int fd, size_t size, const char *tag,
+                                      unsigned long gen)
+{
+    struct cache_entry *e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->name = strdup(name);
+    e->data = malloc(size ? size : 1);
+    if (!e->name || !e->data)
+    {
+        cache_free(e);
+        return NULL;
+    }
+    size_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = pread(fd, e->data + got, size - got, (off_t)got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            cache_free(e);
+            return NULL;
+        }
+        got += (size_t)n;
+    }
+    e->size = size;
+    snprintf(e->tag, sizeof(e->tag), "%s", tag);
+    e->hash = name_hash(name);
+    e->refs = 1;
+
+    struct cache_entry *victims = NULL;
+    pthread_mutex_lock(&g_cache.mu);
+    if (g_cache.gens[e->hash & (CACHE_GEN_SLOTS - 1)] == gen)
+    {
+        if (g_cache.nbuckets == 0 || g_cache.count >= g_cache.nbuckets)
+            cache_grow();
+        if (g_cache.nbuckets)
+        {
+            // A racing reader may have installed the same version already
+            struct cache_entry *old = *cache_slot(e->hash, name);
+            if (old && cache_remove_locked(old))
+            {
+                old->hnext = victims;
+                victims = old;
+            }
+            while (g_cache.tail && g_cache.bytes + size > g_cache.budget)
+            {
+                struct cache_entry *lru = g_cache.tail;
+                g_cache.stats.evictions++;
+                if (cache_remove_locked(lru))
+                {
+                    lru->hnext = victims;
+                    victims = lru;
+                }
+            }
+            struct cache_entry **pp = cache_slot(e->hash, name);
+            e->hnext = NULL;
+            *pp = e;
+            lru_push_front(e);
+            e->refs++;
+            g_cache.count++;
+            g_cache.bytes += size;
+        }
+    }
+    pthread_mutex_unlock(&g_cache.mu);
+
+    // Free outside the mutex
+    while (victims)
+    {
+        struct cache_entry *next = victims->hnext;
+        cache_free(victims);
+        victims = next;
+    }
+    return e;
+}
+
+// Drop a reader's reference
+static void cache_put(struct cache_entry *e)
+{
+    pthread_mutex_lock(&g_cache.mu);
+    int last = --e->refs == 0;
+    pthread_mutex_unlock(&g_cache.mu);
+    if (last)
+        cache_free(e);
+}
+
+// A new version of name was published: forget the cached one
+static void cache_invalidate(const char *name)
+{
+    if (g_cache.budget == 0)
+        return;
+
+    struct cache_entry *e = NULL;
+    uint32_t hash = name_hash(name);
+    pthread_mutex_lock(&g_cache.mu);
+    g_cache.gens[hash & (CACHE_GEN_SLOTS - 1)]++;
+    if (g_cache.nbuckets)
+        e = *cache_slot(hash, name);
+    if (e)
+    {
+        g_cache.stats.invalidations++;
+        if (!cache_remove_locked(e))
+            e = NULL; // still being sent; the last reader frees it
+    }
+    pthread_mutex_unlock(&g_cache.mu);
+    if (e)
+        cache_free(e);
+}
+
+static void cache_report(void)
+{
+    if (g_cache.budget == 0)
+        return;
+
+    pthread_mutex_lock(&g_cache.mu);
+    struct cache_stats st = g_cache.stats;
+    size_t count = g_cache.count, bytes = g_cache.bytes;
+    pthread_mutex_unlock(&g_cache.mu);
+
+    printf("Cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, "
+           "%zu files / %zu bytes resident\n",
+           st.hits, st.misses, st.evictions, st.invalidations, count, bytes);
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Server statistics (STATS command)
+ *
+ * Counters and latency histograms are updated with relaxed atomic
+ * adds from whichever thread serves the request, so recording
+ * never takes a lock. STATS reads them the same way; the snapshot
+ * is not a single instant, but each value is exact.
+ * ============================================================ */
+struct server_stats
+{
+    uint64_t accepted; // connections accepted
+    uint64_t active;   // connections currently open
+    uint64_t rejected; // turned away by admission control
+    uint64_t reads;    // READ commands
+    uint64_t not_modified; // conditional READs answered without the body
+    uint64_t writes;   // WRITE commands
+    uint64_t errors;   // ERR replies sent
+    uint64_t bytes_in; // WRITE payload bytes received
+    uint64_t bytes_out; // READ file bytes sent
+    uint64_t comp_raw;  // payload bytes sent or received as zframe frames
+    uint64_t comp_wire; // what those frames took on the wire
+    uint64_t deltas;       // DELTA uploads applied
+    uint64_t delta_reused; // bytes they copied from the previous version
+    uint64_t commits;        // uploads published
+    uint64_t commit_flushes; // fdatasync/syncfs/directory fsync calls made for them
+    uint64_t shaped_pauses;   // transfers paused by bandwidth shaping
+    uint64_t shaped_pause_us; // time they spent paused
+    uint64_t watchers;     // connections subscribed with WATCH
+    uint64_t watch_events; // CHANGED lines queued for them
+    uint64_t watch_lost;   // events dropped: subscriber too slow or watch thread behind
+
+    // Microseconds
+    struct hist handshake; // accept -> HELLO answered
+    struct hist lock_wait; // WRITE queued on the file's writer queue
+    struct hist transfer;  // payload received / file sent
+    struct hist request;   // command line parsed -> reply done
+    struct hist commit;    // upload complete -> published as durably as DURABILITY asks
+};
+
+static struct server_stats g_stats;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&g_stats.field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&g_stats.field, __ATOMIC_RELAXED)
+
+// Count ERR replies wherever a reply line is sent
+static void stats_reply(const char *msg)
+{
+    if (strncmp(msg, "ERR", 3) == 0)
+        STAT_ADD(errors, 1);
+}
+
+static size_t stats_hist(char *buf, size_t cap, size_t len, const char *name, const struct hist *live)
+{
+    struct hist h;
+    hist_snapshot(live, &h);
+    if (len < cap)
+        len += (size_t)snprintf(buf + len, cap - len,
+                                "latency_%s_us count %llu mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+                                name, (unsigned long long)h.count,
+                                (unsigned long long)(h.count ? h.sum / h.count : 0),
+                                (unsigned long long)hist_percentile(&h, 0.50),
+                                (unsigned long long)hist_percentile(&h, 0.90),
+                                (unsigned long long)hist_percentile(&h, 0.99),
+                                (unsigned long long)hist_percentile(&h, 0.999),
+                                (unsigned long long)h.max);
+
+    // Raw buckets as "<lowest value>:<count>" so clients can merge or re-plot them
+    if (len < cap)
+        len += (size_t)snprintf(buf + len, cap - len, "latency_%s_us_buckets", name);
+    for (int i = 0; i < HIST_BUCKETS && len < cap; i++)
+        if (h.buckets[i])
+            len += (size_t)snprintf(buf + len, cap - len, " %llu:%llu",
+                                    (unsigned long long)hist_bucket_low(i),
+                                    (unsigned long long)h.buckets[i]);
+    if (len < cap)
+        len += (size_t)snprintf(buf + len, cap - len, "\n");
+    return len;
+}
+
+static const char *durability_name(enum durability d)
+{
+    return d == DUR_FDATASYNC ? "fdatasync" : d == DUR_GROUP ? "group" : "none";
+}
+
+/*
+ * Build the STATS reply: "OK STATS <length>\n" followed by <length>
+ * bytes of "key value" lines. Returns a malloc'd, NUL-terminated
+ * buffer (or NULL).
+ */
+static char *stats_reply_text(size_t *out_len)
+{
+    size_t cap = 64 * 1024;
+    char *body = malloc(cap);
+    if (!body)
+        return NULL;
+
+    pthread_mutex_lock(&g_cache.mu);
+    struct cache_stats cs = g_cache.stats;
+    pthread_mutex_unlock(&g_cache.mu);
+
+    size_t len = (size_t)snprintf(body, cap,
+                                  "connections_accepted %llu\n"
+                                  "connections_active %llu\n"
+                                  "connections_rejected %llu\n"
+                                  "reads %llu\n"
+                                  "reads_not_modified %llu\n"
+                                  "writes %llu\n"
+                                  "errors %llu\n"
+                                  "bytes_in %llu\n"
+                                  "bytes_out %llu\n"
+                                  "compressed_raw_bytes %llu\n"
+                                  "compressed_wire_bytes %llu\n"
+                                  "deltas %llu\n"
+                                  "delta_reused_bytes %llu\n"
+                                  "durability %s\n"
+                                  "commits %llu\n"
+                                  "commit_flushes %llu\n"
+                                  "shaped_pauses %llu\n"
+                                  "shaped_pause_us %llu\n"
+                                  "watchers %llu\n"
+                                  "watch_events %llu\n"
+                                  "watch_lost %llu\n"
+                                  "cache_hits %lu\n"
+                                  "cache_misses %lu\n"
+                                  "cache_evictions %lu\n",
+                                  (unsigned long long)STAT_GET(accepted),
+                                  (unsigned long long)STAT_GET(active),
+                                  (unsigned long long)STAT_GET(rejected),
+                                  (unsigned long long)STAT_GET(reads),
+                                  (unsigned long long)STAT_GET(not_modified),
+                                  (unsigned long long)STAT_GET(writes),
+                                  (unsigned long long)STAT_GET(errors),
+                                  (unsigned long long)STAT_GET(bytes_in),
+                                  (unsigned long long)STAT_GET(bytes_out),
+                                  (unsigned long long)STAT_GET(comp_raw),
+                                  (unsigned long long)STAT_GET(comp_wire),
+                                  (unsigned long long)STAT_GET(deltas),
+                                  (unsigned long long)STAT_GET(delta_reused),
+                                  durability_name(g_conf.durability),
+                                  (unsigned long long)STAT_GET(commits),
+                                  (unsigned long long)STAT_GET(commit_flushes),
+                                  (unsigned long long)STAT_GET(shaped_pauses),
+                                  (unsigned long long)STAT_GET(shaped_pause_us),
+                                  (unsigned long long)STAT_GET(watchers),
+                                  (unsigned long long)STAT_GET(watch_events),
+                                  (unsigned long long)STAT_GET(watch_lost),
+                                  cs.hits, cs.misses, cs.evictions);
+    len = stats_hist(body, cap, len, "handshake", &g_stats.handshake);
+    len = stats_hist(body, cap, len, "lock_wait", &g_stats.lock_wait);
+    len = stats_hist(body, cap, len, "transfer", &g_stats.transfer);
+    len = stats_hist(body, cap, len, "request", &g_stats.request);
+    len = stats_hist(body, cap, len, "commit", &g_stats.commit);
+    if (len > cap)
+        len = cap;
+
+    char hdr[64];
+    int hlen = snprintf(hdr, sizeof(hdr), "OK STATS %zu\n", len);
+    char *msg = malloc((size_t)hlen + len + 1);
+    if (msg)
+    {
+        memcpy(msg, hdr, (size_t)hlen);
+        memcpy(msg + hlen, body, len);
+        msg[hlen + len] = '\0';
+        *out_len = (size_t)hlen + len;
+    }
+    free(body);
+    return msg;
+}
+/* ============================================================ */
+
+// Permission bits for newly created files (0666 minus the umask, like fopen)
+static mode_t g_new_file_mode = 0644;
+
+// Replies are small lines written whole: send them now instead of letting
+// Nagle hold one back for the client's delayed ACK (~40 ms per exchange)
+static void set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Ensure shared directory exists
+static void shared_dir(void)
+{
+    struct stat st;
+    if (stat(SHARED_DIR, &st) == -1)
+    {
+        // owner only permissions
+        mkdir(SHARED_DIR, 0700);
+    }
+
+    mode_t mask = umask(0);
+    umask(mask);
+    g_new_file_mode = 0666 & ~mask;
+
+    // Staging files left behind by a crashed upload are never published
+    DIR *dir = opendir(SHARED_DIR);
+    if (!dir)
+        return;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (strncmp(de->d_name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) == 0)
+        {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Filenames must stay inside SHARED_DIR
+static int valid_filename(const char *filename)
+{
+    return strstr(filename, "..") == NULL && strchr(filename, '/') == NULL &&
+           strncmp(filename, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) != 0;
+}
+
+/* ============================================================
+ * Metadata index (LIST and STAT)
+ *
+ * Name, size and mtime of every published file, kept in memory: a
+ * hash table for STAT and a name-sorted array for LIST, so a listing
+ * is one binary search for its start and a walk from there, however
+ * many files the directory holds. It is filled by one scan at
+ * startup, updated by upload_rename() as uploads are published, and
+ * by an inotify thread for changes made behind the server's back
+ * (files copied in, edited or deleted by hand). The directory is only
+ * scanned again if the kernel's inotify queue overflows.
+ *
+ * Replacing an existing file only updates its entry in place. A new or
+ * deleted name shifts the tail of the sorted array, which is O(n) under
+ * the write lock: at a million files that is up to 8 MB of pointers,
+ * roughly a millisecond during which LIST and STAT wait.
+ * ============================================================ */
+#define INDEX_BUCKETS_INIT 1024
+#define LIST_DEFAULT 1000  // entries per LIST reply unless LIMIT says otherwise
+#define LIST_MAX 100000    // largest LIMIT accepted
+
+struct index_entry
+{
+    uint32_t hash;
+    long long size;
+    struct timespec mtime;
+    struct index_entry *next; // hash chain
+    char name[];
+};
+
+struct index_table
+{
+    struct index_entry **buckets;
+    size_t nbuckets;
+    struct index_entry **sorted; // by name (strcmp order)
+    size_t count, cap;
+};
+
+static struct
+{
+    pthread_rwlock_t mu;
+    pthread_mutex_t refresh_mu; // one index_refresh() at a time, so stats apply in order
+    struct index_table t;
+    int inotify_fd;
+} g_index = {.mu = PTHREAD_RWLOCK_INITIALIZER,
+             .refresh_mu = PTHREAD_MUTEX_INITIALIZER,
+             .inotify_fd = -1};
+
+static struct index_entry **index_slot(struct index_table *t, uint32_t hash, const char *name)
+{
+    struct index_entry **pp = &t->buckets[hash & (t->nbuckets - 1)];
+    while (*pp && ((*pp)->hash != hash || strcmp((*pp)->name, name) != 0))
+        pp = &(*pp)->next;
+    return pp;
+}
+
+// First position in t->sorted whose name is >= name (> name if after)
+static size_t index_bound(const struct index_table *t, const char *name, int after)
+{
+    size_t lo = 0, hi = t->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(t->sorted[mid]->name, name);
+        if (cmp < 0 || (after && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Room for one more entry in both views
+static int index_reserve(struct index_table *t)
+{
+    if (t->count == t->cap)
+    {
+        size_t cap = t->cap ? t->cap * 2 : INDEX_BUCKETS_INIT;
+        struct index_entry **sorted = realloc(t->sorted, cap * sizeof(*sorted));
+        if (!sorted)
+            return -1;
+        t->sorted = sorted;
+        t->cap = cap;
+    }
+    if (t->count < t->nbuckets * 2)
+        return 0;
+
+    // Rehash once chains average two entries
+    size_t nb = t->nbuckets ? t->nbuckets * 2 : INDEX_BUCKETS_INIT;
+    struct index_entry **buckets = calloc(nb, sizeof(*buckets));
+    if (!buckets)
+        return t->nbuckets ? 0 : -1; // longer chains, still correct
+    for (size_t i = 0; i < t->nbuckets; i++)
+        for (struct index_entry *e = t->buckets[i], *next; e; e = next)
+        {
+            next = e->next;
+            e->next = buckets[e->hash & (nb - 1)];
+            buckets[e->hash & (nb - 1)] = e;
+        }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->nbuckets = nb;
+    return 0;
+}
+
+static void index_table_free(struct index_table *t)
+{
+    for (size_t i = 0; i < t->count; i++)
+        free(t->sorted[i]);
+    free(t->sorted);
+    free(t->buckets);
+    memset(t, 0, sizeof(*t));
+}
+
+static int index_by_name(const void *a, const void *b)
+{
+    return strcmp((*(struct index_entry *const *)a)->name, (*(struct index_entry *const *)b)->name);
+}
+
+// Build a table from a full scan of SHARED_DIR: regular files with names
+// a client could ask for, sorted once at the end
+static int index_build(struct index_table *t)
+{
+    memset(t, 0, sizeof(*t));
+    DIR *dir = opendir(SHARED_DIR);
+    if (!dir)
+        return -1;
+    struct dirent *de;
+    struct stat st;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (!valid_filename(de->d_name) || fstatat(dirfd(dir), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        size_t nl = strlen(de->d_name) + 1;
+        struct index_entry *e = malloc(sizeof(*e) + nl);
+        if (!e || index_reserve(t) < 0)
+        {
+            free(e);
+            closedir(dir);
+            index_table_free(t);
+            return -1;
+        }
+        memcpy(e->name, de->d_name, nl);
+        e->hash = name_hash(e->name);
+        e->size = (long long)st.st_size;
+        e->mtime = st.st_mtim;
+        struct index_entry **pp = index_slot(t, e->hash, e->name);
+        e->next = NULL;
+        *pp = e;
+        t->sorted[t->count++] = e;
+    }
+    closedir(dir);
+    if (t->count > 1)
+        qsort(t->sorted, t->count, sizeof(*t->sorted), index_by_name);
+    return 0;
+}
+
+// (Re)load the whole index; the old table is replaced only once the new one is built
+static int index_scan(void)
+{
+    struct index_table t;
+    if (index_build(&t) < 0)
+        return -1;
+    pthread_rwlock_wrlock(&g_index.mu);
+    struct index_table old = g_index.t;
+    g_index.t = t;
+    pthread_rwlock_unlock(&g_index.mu);
+    index_table_free(&old);
+    return 0;
+}
+
+/*
+ * Bring one name up to date with the directory. Refreshes take turns on
+ * refresh_mu, so of two threads refreshing the same name the later look
+ * at the disk is also the one that sticks. The stat() itself runs before
+ * the table's write lock is taken.
+ */
+static void index_refresh(const char *filename)
+{
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+    uint32_t hash = name_hash(filename);
+
+    // LIST and STAT never wait for the disk
+    pthread_mutex_lock(&g_index.refresh_mu);
+    int present = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    pthread_rwlock_wrlock(&g_index.mu);
+    struct index_table *t = &g_index.t;
+    struct index_entry **pp = t->nbuckets ? index_slot(t, hash, filename) : NULL;
+    struct index_entry *e = pp ? *pp : NULL;
+    if (present && !e)
+    {
+        size_t nl = strlen(filename) + 1;
+        if (index_reserve(t) < 0 || !(e = malloc(sizeof(*e) + nl)))
+        {
+            pthread_rwlock_unlock(&g_index.mu);
+            pthread_mutex_unlock(&g_index.refresh_mu);
+            fprintf(stderr, "Index: out of memory, '%s' not listed\n", filename);
+            return;
+        }
+        memcpy(e->name, filename, nl);
+        e->hash = hash;
+        e->next = NULL;
+        *index_slot(t, hash, filename) = e; // reserve may have rehashed
+        size_t pos = index_bound(t, filename, 0);
+        memmove(t->sorted + pos + 1, t->sorted + pos, (t->count - pos) * sizeof(*t->sorted));
+        t->sorted[pos] = e;
+        t->count++;
+    }
+    if (present)
+    {
+        e->size = (long long)st.st_size;
+        e->mtime = st.st_mtim;
+    }
+    else if (e)
+    {
+        *pp = e->next;
+        size_t pos = index_bound(t, filename, 0);
+        memmove(t->sorted + pos, t->sorted + pos + 1, (t->count - pos - 1) * sizeof(*t->sorted));
+        t->count--;
+        free(e);
+    }
+    pthread_rwlock_unlock(&g_index.mu);
+    pthread_mutex_unlock(&g_index.refresh_mu);
+}
+
+// Follow out-of-band changes. Every upload shows up here too (staging
+// file written, renamed), so events are read in bulk: after each batch
+// the thread sleeps INDEX_WATCH_MS instead of waking once per event.
+// Our own renames are already in the index by then.
+#define INDEX_WATCH_MS 10
+
+static void *index_watch(void *arg)
+{
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;)
+    {
+        ssize_t n = read(g_index.inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("inotify");
+            return NULL;
+        }
+        for (char *p = buf; p < buf + n;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                printf("Index: inotify queue overflowed, rescanning %s\n", SHARED_DIR);
+                index_scan(); // changes were lost
+            }
+            else if (ev->len > 0 && valid_filename(ev->name))
+                index_refresh(ev->name);
+        }
+        usleep(INDEX_WATCH_MS * 1000);
+    }
+}
+
+// Scan SHARED_DIR and start following it. Without inotify the index
+// still tracks everything published through the server.
+static int index_start(void)
+{
+    if (index_scan() < 0)
+        return -1;
+    g_index.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (g_index.inotify_fd < 0 ||
+        inotify_add_watch(g_index.inotify_fd, SHARED_DIR,
+                          IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_DELETE) < 0)
+    {
+        perror("inotify: changes made outside the server won't be listed");
+        return 0;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, index_watch, NULL) == 0)
+        pthread_detach(tid);
+    return 0;
+}
+
+// "OK STAT <name> <size> <mtime>\n" into msg, mtime as seconds.nanoseconds
+static void index_stat_reply(const char *filename, char *msg, size_t cap)
+{
+    uint32_t hash = name_hash(filename);
+    pthread_rwlock_rdlock(&g_index.mu);
+    struct index_entry *e = g_index.t.nbuckets ? *index_slot(&g_index.t, hash, filename) : NULL;
+    if (e)
+        snprintf(msg, cap, "OK STAT %s %lld %lld.%09ld\n", e->name, e->size,
+                 (long long)e->mtime.tv_sec, e->mtime.tv_nsec);
+    else
+        snprintf(msg, cap, "ERR file not found\n");
+    pthread_rwlock_unlock(&g_index.mu);
+}
+
+/*
+ * LIST [PREFIX <p>] [AFTER <name>] [LIMIT <n>] ->
+ *   OK LIST <count> <length> <more>\n followed by <length> bytes of
+ *   "<name> <size> <mtime>" lines in name order
+ * more is 1 if further names match: the next page is the same LIST
+ * with AFTER <last name returned>. Returns a malloc'd reply (length in
+ * *len), or NULL with msg set to an error line.
+ */
+static char *index_list_reply(const char *args, size_t *len, const char **msg)
+{
+    char prefix[512] = "", after[512] = "", word[16], val[512];
+    long long limit = LIST_DEFAULT;
+    int have_after = 0, used;
+    while (sscanf(args, "%15s %511s%n", word, val, &used) == 2)
+    {
+        if (strcmp(word, "PREFIX") == 0)
+            snprintf(prefix, sizeof(prefix), "%s", val);
+        else if (strcmp(word, "AFTER") == 0)
+        {
+            snprintf(after, sizeof(after), "%s", val);
+            have_after = 1;
+        }
+        else if (strcmp(word, "LIMIT") == 0)
+            limit = strtoll(val, NULL, 10);
+        else
+            break;
+        args += used;
+    }
+    *msg = "ERR bad list\n";
+    if (sscanf(args, "%15s", word) == 1 || limit <= 0 || limit > LIST_MAX)
+        return NULL;
+
+    *msg = "ERR out of memory\n";
+    size_t cap = 4096, blen = 0;
+    char *body = malloc(cap);
+    if (!body)
+        return NULL;
+    size_t plen = strlen(prefix);
+    long long count = 0;
+    int more = 0;
+
+    pthread_rwlock_rdlock(&g_index.mu);
+    const struct index_table *t = &g_index.t;
+    size_t i = index_bound(t, prefix, 0);
+    if (have_after && strcmp(after, prefix) >= 0)
+        i = index_bound(t, after, 1);
+    for (; i < t->count && strncmp(t->sorted[i]->name, prefix, plen) == 0; i++)
+    {
+        if (count == limit)
+        {
+            more = 1;
+            break;
+        }
+        const struct index_entry *e = t->sorted[i];
+        size_t need = strlen(e->name) + 64;
+        if (blen + need > cap)
+        {
+            while (blen + need > cap)
+                cap *= 2;
+            char *tmp = realloc(body, cap);
+            if (!tmp)
+            {
+                pthread_rwlock_unlock(&g_index.mu);
+                free(body);
+                return NULL;
+            }
+            body = tmp;
+        }
+        blen += (size_t)snprintf(body + blen, cap - blen, "%s %lld %lld.%09ld\n", e->name, e->size,
+                                 (long long)e->mtime.tv_sec, e->mtime.tv_nsec);
+        count++;
+    }
+    pthread_rwlock_unlock(&g_index.mu);
+
+    char hdr[96];
+    int hl = snprintf(hdr, sizeof(hdr), "OK LIST %lld %zu %d\n", count, blen, more);
+    char *reply = malloc((size_t)hl + blen + 1);
+    if (reply)
+    {
+        memcpy(reply, hdr, (size_t)hl);
+        memcpy(reply + hl, body, blen);
+        reply[hl + blen] = '\0';
+        *len = (size_t)hl + blen;
+    }
+    free(body);
+    return reply;
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Change notifications (WATCH)
+ *
+ * "WATCH [<name>...] [PREFIX <p>]..." turns a session into a
+ * subscription (no names: every file). The server answers
+ * "OK WATCH <count>" and from then on pushes
+ *   CHANGED <name> <size> <tag>
+ * whenever an upload of a matching file is published; the tag is the
+ * one READ IF-NONE-MATCH takes. The connection is handed to the watch
+ * thread, which owns every subscriber, so a watcher costs neither a
+ * worker nor reactor time. Publishing only formats the event and
+ * appends it to the thread's inbox: matching, copying into thousands
+ * of output buffers and the non-blocking sends all happen on the watch
+ * thread. A subscriber too slow to take its events loses them instead
+ * of holding anything up; once its buffer has drained it gets
+ * "LOST <n>" and should re-LIST what it follows.
+ * ============================================================ */
+#define WATCH_BUCKETS 4096       // exact-name subscriptions, hashed
+#define WATCH_SUBS_MAX 1024      // names and prefixes per subscriber
+#define WATCH_OUT_MAX (64 << 10) // undelivered events per subscriber
+#define WATCH_INBOX_MAX 65536    // events waiting for the watch thread
+#define WATCH_MAX_EVENTS 256
+#define WATCH_IDLE_MS 500 // wake-up period to notice shutdown
+#define WATCH_BATCH_MS 5  // pause after delivering, so bursts share one send per watcher
+
+// Inbox message: a connection to adopt, or a published change
+struct watch_msg
+{
+    struct watch_msg *next;
+    int fd;          // >= 0: adopt fd; data is output still owed to it, then its input
+    size_t out_len;  // ... of which this much is output
+    size_t name_len; // change (fd -1): data is the CHANGED line, the name at data + 8
+    size_t len;
+    char data[];
+};
+
+struct watcher;
+
+struct watch_sub
+{
+    struct watcher *w;
+    struct watch_sub *next;  // bucket chain, or the prefix list
+    struct watch_sub *wnext; // w's subscriptions
+    uint32_t hash;
+    int prefix;
+    size_t len;
+    char pat[];
+};
+
+struct watcher
+{
+    int fd;
+    char in[1024]; // unparsed input
+    size_t in_len;
+    char *out;
+    size_t out_cap, out_off, out_len;
+    unsigned long long lost; // events dropped while out was full
+    unsigned long long seq;  // last event queued, so overlapping subscriptions send it once
+    struct watch_sub *subs;
+    int nsubs;
+    int closing; // BYE queued: close once out is flushed
+    uint32_t events;
+    int dirty; // on the list of watchers with new output
+    struct watcher *dirty_next;
+    struct watcher *prev, *next;
+};
+
+static struct
+{
+    pthread_mutex_t mu;
+    struct watch_msg *head, *tail; // inbox, oldest first
+    int queued;                    // changes in it
+    int stopped;                   // the thread has exited: no more adoptions
+    int started;
+    pthread_t tid;
+    int wake_fd;
+    int epfd;
+
+    // Watch thread only
+    struct watcher *list;
+    struct watcher *dirty;
+    struct watch_sub *buckets[WATCH_BUCKETS];
+    struct watch_sub *prefixes;
+    unsigned long long seq;
+} g_watch = {.mu = PTHREAD_MUTEX_INITIALIZER, .wake_fd = -1, .epfd = -1};
+
+// Queue m for the watch thread. Returns -1 (m freed) once it has stopped.
+static int watch_push(struct watch_msg *m)
+{
+    pthread_mutex_lock(&g_watch.mu);
+    if (g_watch.stopped || (m->fd < 0 && g_watch.queued >= WATCH_INBOX_MAX))
+    {
+        if (m->fd < 0 && !g_watch.stopped)
+            STAT_ADD(watch_lost, 1); // the thread is far behind: shed, don't block
+        pthread_mutex_unlock(&g_watch.mu);
+        free(m);
+        return -1;
+    }
+    m->next = NULL;
+    if (g_watch.tail)
+        g_watch.tail->next = m;
+    else
+        g_watch.head = m;
+    g_watch.tail = m;
+    if (m->fd < 0)
+        g_watch.queued++;
+    pthread_mutex_unlock(&g_watch.mu);
+
+    uint64_t one = 1;
+    if (write(g_watch.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+    return 0;
+}
+
+// An upload of filename was just published: tell its watchers. One
+// stat() and one queued message; nothing at all while nobody watches.
+static void watch_publish(const char *filename)
+{
+    if (STAT_GET(watchers) == 0)
+        return;
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+    if (stat(path, &st) < 0)
+        return;
+    char tag[TAG_LEN];
+    file_tag(&st, tag, sizeof(tag));
+    size_t nl = strlen(filename);
+    struct watch_msg *m = malloc(sizeof(*m) + nl + TAG_LEN + 32);
+    if (!m)
+        return;
+    m->fd = -1;
+    m->out_len = 0;
+    m->name_len = nl;
+    m->len = (size_t)sprintf(m->data, "CHANGED %s %lld %s\n", filename, (long long)st.st_size,
+                             tag);
+    watch_push(m);
+}
+
+/*
+ * Hand fd over to the watch thread: line is the WATCH command, in what
+ * the client sent after it and out the replies it is still owed. The
+ * caller must not touch fd afterwards. Returns -1 if the server is
+ * shutting down (fd stays the caller's).
+ */
+static int watch_adopt(int fd, const char *line, const char *in, size_t in_len,
+                       const char *out, size_t out_len)
+{
+    size_t ll = strlen(line);
+    struct watch_msg *m = malloc(sizeof(*m) + out_len + ll + 1 + in_len);
+    if (!m)
+        return -1;
+    m->fd = fd;
+    m->out_len = out_len;
+    m->name_len = 0;
+    memcpy(m->data, out, out_len);
+    memcpy(m->data + out_len, line, ll);
+    m->data[out_len + ll] = '\n';
+    memcpy(m->data + out_len + ll + 1, in, in_len);
+    m->len = out_len + ll + 1 + in_len;
+    return watch_push(m);
+}
+
+// "WATCH" or "WATCH ..."
+static int watch_command(const char *line)
+{
+    return strncmp(line, "WATCH", 5) == 0 && (line[5] == '\0' || line[5] == ' ');
+}
+
+static int watch_queue(struct watcher *w, const char *data, size_t len)
+{
+    if (w->out_len + len > w->out_cap)
+    {
+        size_t cap = w->out_cap ? w->out_cap : 4096;
+        while (cap < w->out_len + len)
+            cap *= 2;
+        char *p = realloc(w->out, cap);
+        if (!p)
+            return -1;
+        w->out = p;
+        w->out_cap = cap;
+    }
+    memcpy(w->out + w->out_len, data, len);
+    w->out_len += len;
+    if (!w->dirty)
+    {
+        w->dirty = 1;
+        w->dirty_next = g_watch.dirty;
+        g_watch.dirty = w;
+    }
+    return 0;
+}
+
+static void watch_reply(struct watcher *w, const char *msg)
+{
+    stats_reply(msg);
+    watch_queue(w, msg, strlen(msg));
+}
+
+static void watch_unsubscribe(struct watch_sub *s)
+{
+    struct watch_sub **pp = s->prefix ? &g_watch.prefixes
+                                      : &g_watch.buckets[s->hash & (WATCH_BUCKETS - 1)];
+    while (*pp != s)
+        pp = &(*pp)->next;
+    *pp = s->next;
+}
+
+static int watch_subscribe(struct watcher *w, const char *pat, int prefix)
+{
+    size_t len = strlen(pat);
+    struct watch_sub *s = malloc(sizeof(*s) + len + 1);
+    if (!s)
+        return -1;
+    s->w = w;
+    s->prefix = prefix;
+    s->len = len;
+    s->hash = name_hash(pat);
+    memcpy(s->pat, pat, len + 1);
+    struct watch_sub **head = prefix ? &g_watch.prefixes
+                                     : &g_watch.buckets[s->hash & (WATCH_BUCKETS - 1)];
+    s->next = *head;
+    *head = s;
+    s->wnext = w->subs;
+    w->subs = s;
+    w->nsubs++;
+    return 0;
+}
+
+// "WATCH [<name>...] [PREFIX <p>]...": everything is checked before anything is added
+static void watch_add(struct watcher *w, const char *line)
+{
+    char args[1024], *save = NULL;
+    snprintf(args, sizeof(args), "%s", line + 5);
+    int count = 0;
+    const char *err = NULL;
+    for (char *t = strtok_r(args, " ", &save); t && !err; t = strtok_r(NULL, " ", &save))
+    {
+        int prefix = strcmp(t, "PREFIX") == 0;
+        if (prefix && !(t = strtok_r(NULL, " ", &save)))
+            err = "ERR bad header\n";
+        else if (prefix ? strchr(t, '/') != NULL : !valid_filename(t))
+            err = "ERR invalid filename\n";
+        count++;
+    }
+    if (!err && w->nsubs + (count ? count : 1) > WATCH_SUBS_MAX)
+        err = "ERR too many watches\n";
+    if (err)
+    {
+        watch_reply(w, err);
+        return;
+    }
+
+    snprintf(args, sizeof(args), "%s", line + 5);
+    save = NULL;
+    int rc = count ? 0 : watch_subscribe(w, "", 1); // no names: every file
+    for (char *t = strtok_r(args, " ", &save); t && rc == 0; t = strtok_r(NULL, " ", &save))
+    {
+        int prefix = strcmp(t, "PREFIX") == 0;
+        if (prefix)
+            t = strtok_r(NULL, " ", &save);
+        rc = watch_subscribe(w, t, prefix);
+    }
+    char msg[64];
+    snprintf(msg, sizeof(msg), rc == 0 ? "OK WATCH %d\n" : "ERR out of memory\n", w->nsubs);
+    watch_reply(w, msg);
+}
+
+static void watch_line(struct watcher *w, const char *line)
+{
+    if (w->closing)
+        return;
+    if (strcmp(line, "QUIT") == 0)
+    {
+        watch_reply(w, "BYE\n");
+        w->closing = 1;
+    }
+    else if (watch_command(line))
+        watch_add(w, line);
+    else
+        watch_reply(w, "ERR only WATCH and QUIT while watching\n");
+}
+
+// Split input into lines; an over-long line is cut like recv_line does
+static void watch_input(struct watcher *w, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = sizeof(w->in) - 1 - w->in_len;
+        if (n > len)
+            n = len;
+        memcpy(w->in + w->in_len, data, n);
+        w->in_len += n;
+        data += n;
+        len -= n;
+        for (;;)
+        {
+            char *nl = memchr(w->in, '\n', w->in_len);
+            if (!nl && w->in_len < sizeof(w->in) - 1)
+                break;
+            size_t take = nl ? (size_t)(nl - w->in) + 1 : w->in_len;
+            size_t ll = nl ? take - 1 : take;
+            if (ll > 0 && w->in[ll - 1] == '\r')
+                ll--;
+            char line[1024];
+            memcpy(line, w->in, ll);
+            line[ll] = '\0';
+            memmove(w->in, w->in + take, w->in_len - take);
+            w->in_len -= take;
+            watch_line(w, line);
+        }
+    }
+}
+
+static void watch_close(struct watcher *w)
+{
+    while (w->subs)
+    {
+        struct watch_sub *s = w->subs;
+        w->subs = s->wnext;
+        watch_unsubscribe(s);
+        free(s);
+    }
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        g_watch.list = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    close(w->fd); // also leaves the epoll set
+    free(w->out);
+    free(w);
+    STAT_ADD(watchers, -1);
+    STAT_ADD(active, -1);
+}
+
+// Send what is queued. Returns -1 if w was closed.
+static int watch_flush(struct watcher *w)
+{
+    for (;;)
+    {
+        while (w->out_off < w->out_len)
+        {
+            ssize_t n = send(w->fd, w->out + w->out_off, w->out_len - w->out_off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0)
+            {
+                watch_close(w);
+                return -1;
+            }
+            w->out_off += (size_t)n;
+        }
+        if (w->out_off < w->out_len)
+            break;
+        w->out_off = w->out_len = 0;
+        if (w->closing)
+        {
+            watch_close(w);
+            return -1;
+        }
+        if (w->lost == 0)
+            break;
+        // Caught up again: say how much it missed
+        char msg[48];
+        snprintf(msg, sizeof(msg), "LOST %llu\n", w->lost);
+        w->lost = 0;
+        watch_queue(w, msg, strlen(msg));
+    }
+    uint32_t ev = EPOLLIN | (w->out_off < w->out_len ? EPOLLOUT : 0);
+    if (ev != w->events)
+    {
+        struct epoll_event e = {.events = ev, .data.ptr = w};
+        epoll_ctl(g_watch.epfd, EPOLL_CTL_MOD, w->fd, &e);
+        w->events = ev;
+    }
+    return 0;
+}
+
+static void watch_take(struct watch_msg *m)
+{
+    struct watcher *w = calloc(1, sizeof(*w));
+    struct epoll_event e = {.events = EPOLLIN, .data.ptr = w};
+    if (!w || fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        epoll_ctl(g_watch.epfd, EPOLL_CTL_ADD, m->fd, &e) < 0)
+    {
+        perror("watch");
+        close(m->fd);
+        free(w);
+        STAT_ADD(active, -1);
+        return;
+    }
+    w->fd = m->fd;
+    w->events = EPOLLIN;
+    w->next = g_watch.list;
+    if (g_watch.list)
+        g_watch.list->prev = w;
+    g_watch.list = w;
+    STAT_ADD(watchers, 1);
+    watch_queue(w, m->data, m->out_len);
+    watch_input(w, m->data + m->out_len, m->len - m->out_len);
+}
+
+static void watch_event(struct watcher *w, const struct watch_msg *m)
+{
+    if (w->seq == g_watch.seq || w->closing)
+        return;
+    w->seq = g_watch.seq;
+    if (w->lost > 0 || w->out_len - w->out_off + m->len > WATCH_OUT_MAX)
+    {
+        w->lost++;
+        STAT_ADD(watch_lost, 1);
+        return;
+    }
+    watch_queue(w, m->data, m->len);
+    STAT_ADD(watch_events, 1);
+}
+
+static void watch_deliver(const struct watch_msg *m)
+{
+    char name[512];
+    size_t nl = m->name_len < sizeof(name) ? m->name_len : sizeof(name) - 1;
+    memcpy(name, m->data + 8, nl);
+    name[nl] = '\0';
+    uint32_t hash = name_hash(name);
+    g_watch.seq++;
+    for (struct watch_sub *s = g_watch.buckets[hash & (WATCH_BUCKETS - 1)]; s; s = s->next)
+        if (s->hash == hash && strcmp(s->pat, name) == 0)
+            watch_event(s->w, m);
+    for (struct watch_sub *s = g_watch.prefixes; s; s = s->next)
+        if (strncmp(name, s->pat, s->len) == 0)
+            watch_event(s->w, m);
+}
+
+// Work through the inbox in the order it was filled; returns the changes delivered
+static int watch_on_wake(void)
+{
+    uint64_t n;
+    while (read(g_watch.wake_fd, &n, sizeof(n)) < 0 && errno == EINTR)
+        ;
+    pthread_mutex_lock(&g_watch.mu);
+    struct watch_msg *m = g_watch.head;
+    g_watch.head = g_watch.tail = NULL;
+    g_watch.queued = 0;
+    pthread_mutex_unlock(&g_watch.mu);
+    int changes = 0;
+    while (m)
+    {
+        struct watch_msg *next = m->next;
+        if (m->fd >= 0)
+            watch_take(m);
+        else
+        {
+            watch_deliver(m);
+            changes++;
+        }
+        free(m);
+        m = next;
+    }
+    return changes;
+}
+
+static void watch_on_readable(struct watcher *w)
+{
+    char buf[4096];
+    for (;;)
+    {
+        ssize_t n = recv(w->fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            w->closing = 1; // flush() closes it; nothing more will be read
+            w->out_off = w->out_len = 0;
+            if (!w->dirty)
+            {
+                w->dirty = 1;
+                w->dirty_next = g_watch.dirty;
+                g_watch.dirty = w;
+            }
+            return;
+        }
+        watch_input(w, buf, (size_t)n);
+    }
+}
+
+static void *watch_main(void *arg)
+{
+    (void)arg;
+    struct epoll_event events[WATCH_MAX_EVENTS];
+    while (server_running)
+    {
+        int n = epoll_wait(g_watch.epfd, events, WATCH_MAX_EVENTS, WATCH_IDLE_MS);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        int changes = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct watcher *w = events[i].data.ptr;
+            if (!w)
+                changes = watch_on_wake();
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                watch_on_readable(w);
+            else if (!w->dirty)
+                watch_flush(w); // EPOLLOUT only
+        }
+        // Every watcher with new output gets one send for all of it
+        while (g_watch.dirty)
+        {
+            struct watcher *w = g_watch.dirty;
+            g_watch.dirty = w->dirty_next;
+            w->dirty = 0;
+            watch_flush(w);
+        }
+        // Under a stream of uploads, let the next events gather instead
+        // of waking once per event (like index_watch)
+        if (changes > 0)
+            usleep(WATCH_BATCH_MS * 1000);
+    }
+
+    // Shutdown: nothing more is adopted; tell every subscriber
+    pthread_mutex_lock(&g_watch.mu);
+    g_watch.stopped = 1;
+    struct watch_msg *m = g_watch.head;
+    g_watch.head = g_watch.tail = NULL;
+    pthread_mutex_unlock(&g_watch.mu);
+    while (m)
+    {
+        struct watch_msg *next = m->next;
+        if (m->fd >= 0)
+        {
+            send(m->fd, "SERVER_SHUTDOWN\n", 16, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(m->fd);
+            STAT_ADD(active, -1);
+        }
+        free(m);
+        m = next;
+    }
+    while (g_watch.list)
+    {
+        send(g_watch.list->fd, "SERVER_SHUTDOWN\n", 16, MSG_NOSIGNAL | MSG_DONTWAIT);
+        watch_close(g_watch.list);
+    }
+    return NULL;
+}
+
+static int watch_start(void)
+{
+    g_watch.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_watch.epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event e = {.events = EPOLLIN, .data.ptr = NULL};
+    if (g_watch.wake_fd < 0 || g_watch.epfd < 0 ||
+        epoll_ctl(g_watch.epfd, EPOLL_CTL_ADD, g_watch.wake_fd, &e) < 0 ||
+        pthread_create(&g_watch.tid, NULL, watch_main, NULL) != 0)
+    {
+        g_watch.stopped = 1; // WATCH is answered with SERVER_SHUTDOWN
+        return -1;
+    }
+    g_watch.started = 1;
+    return 0;
+}
+
+// After server_running dropped: the thread says goodbye and exits
+static void watch_stop(void)
+{
+    if (!g_watch.started)
+        return;
+    uint64_t one = 1;
+    if (write(g_watch.wake_fd, &one, sizeof(one)) < 0)
+        perror("eventfd");
+    pthread_join(g_watch.tid, NULL);
+    printf("Watch: %llu event(s) sent, %llu lost\n",
+           (unsigned long long)STAT_GET(watch_events),
+           (unsigned long long)STAT_GET(watch_lost));
+}
+/* ============================================================ */
+
+/*
+ * Writes never touch the published file. The payload goes to a fresh
+ * staging file that replaces the target with rename() once it is
+ * complete, so readers keep streaming the version they opened, never
+ * see a half-written file, and don't need the per-file lock at all.
+ */
+
+// Create the staging file for filename; its path is stored in tmp.
+// Returns the open fd, or -1 with errno set.
+static int upload_open(const char *filename, char *tmp, size_t cap)
+{
+    snprintf(tmp, cap, "%s/%s%s.XXXXXX", SHARED_DIR, UPLOAD_PREFIX, filename);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // Keep the mode of the version being replaced; new files get the fopen default
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+    fchmod(fd, stat(path, &st) == 0 ? (st.st_mode & 07777) : g_new_file_mode);
+    return fd;
+}
+
+// Rename a complete staging file over filename. Returns 0 or an errno.
+static int upload_rename(const char *filename, const char *tmp)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+    if (rename(tmp, path) < 0)
+    {
+        int err = errno;
+        unlink(tmp);
+        return err;
+    }
+    cache_invalidate(filename);
+    index_refresh(filename);
+    watch_publish(filename);
+    STAT_ADD(commits, 1);
+    return 0;
+}
+
+/* ============================================================
+ * Durability (DURABILITY in server_conf)
+ *
+ * With none, "File Received by server" only means the upload is
+ * published: data and rename reach the disk whenever the kernel
+ * writes them back. fdatasync flushes each upload, renames it and
+ * flushes the directory before the reply, so every writer pays for
+ * its own device flushes. group gives the same guarantee for less:
+ * finished uploads queue for the commit thread, which flushes the
+ * whole batch with one syncfs(), renames them all, flushes the
+ * directory once and then acknowledges them together. Uploads that
+ * finish during a flush form the next batch; while writers overlap
+ * like that, the thread also waits GROUP_COMMIT_MS before each
+ * flush so more of them can join. Either way a file is published only
+ * once its data is on disk, so a crash never leaves a torn file
+ * under a name. STATS reports the acknowledgement latency as
+ * latency_commit_us, next to the flush count.
+ *
+ * Worker threads block in upload_finish(). Reactors queue the
+ * request and move on; the commit thread wakes them through their
+ * eventfd like a writer lock handoff (see rconn_on_wake). A reactor
+ * connection that closes meanwhile disowns its request: the commit
+ * thread frees it and releases its write lock once it is published.
+ * ============================================================ */
+struct commit_req
+{
+    const char *filename, *tmp;
+    int err;           // 0 or an errno, once done
+    int done;          // guarded by g_commit.mu
+    int orphaned;      // owner gone (guarded by g_commit.mu): freed when done
+    struct file_lock *lock; // an orphan's write lock, released when done
+    struct reactor *r; // woken when done; NULL: a worker waits on done_cv
+    uint64_t queued_us;
+    struct commit_req *next;
+    char names[]; // filename and tmp of a commit_queue() request
+};
+
+static struct
+{
+    pthread_mutex_t mu;
+    pthread_cond_t cv;      // requests queued for the commit thread
+    pthread_cond_t done_cv; // a batch was acknowledged
+    struct commit_req *head, *tail;
+    int busy;  // a batch is being flushed
+    int dirfd; // SHARED_DIR, for syncfs() and the directory flush
+} g_commit = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .cv = PTHREAD_COND_INITIALIZER,
+    .done_cv = PTHREAD_COND_INITIALIZER,
+    .dirfd = -1,
+};
+
+// Make the renames so far survive a crash. Returns 0 or an errno.
+static int commit_dir_sync(void)
+{
+    STAT_ADD(commit_flushes, 1);
+    return fsync(g_commit.dirfd) < 0 ? errno : 0;
+}
+
+// DURABILITY fdatasync: flush one upload, publish it, flush the directory
+static int commit_one(const char *filename, const char *tmp)
+{
+    int fd = open(tmp, O_RDONLY | O_CLOEXEC);
+    int err = fd < 0 || fdatasync(fd) < 0 ? errno : 0;
+    if (fd >= 0)
+        close(fd);
+    STAT_ADD(commit_flushes, 1);
+    if (err)
+    {
+        unlink(tmp);
+        return err;
+    }
+    if ((err = upload_rename(filename, tmp)) != 0)
+        return err;
+    return commit_dir_sync();
+}
+
+// DURABILITY group: one data flush and one directory flush for the batch
+static void commit_group(struct commit_req *batch)
+{
+    STAT_ADD(commit_flushes, 1);
+    int err = syncfs(g_commit.dirfd) < 0 ? errno : 0;
+    int renamed = 0;
+    for (struct commit_req *q = batch; q; q = q->next)
+    {
+        if (err)
+            unlink(q->tmp);
+        else if ((q->err = upload_rename(q->filename, q->tmp)) == 0)
+            renamed++;
+        if (err)
+            q->err = err;
+    }
+    if (renamed && (err = commit_dir_sync()) != 0)
+        for (struct commit_req *q = batch; q; q = q->next)
+            if (q->err == 0)
+                q->err = err;
+}
+
+// Free a request nobody waits for, handing its write lock on
+static void commit_free(struct commit_req *q)
+{
+    if (q->lock)
+    {
+        writer_release(q->lock);
+        file_lock_put(q->lock);
+    }
+    free(q);
+}
+
+static void *commit_main(void *arg)
+{
+    (void)arg;
+    int shared = 0; // the last batch had company: writers are finishing concurrently
+    pthread_mutex_lock(&g_commit.mu);
+    for (;;)
+    {
+        while (!g_commit.head)
+            pthread_cond_wait(&g_commit.cv, &g_commit.mu);
+        if (g_conf.durability == DUR_GROUP && g_conf.group_commit_ms > 0 && shared)
+        {
+            // Let writers finishing at about the same time share this flush.
+            // A lone writer is not kept waiting for company that never comes.
+            pthread_mutex_unlock(&g_commit.mu);
+            usleep((useconds_t)g_conf.group_commit_ms * 1000);
+            pthread_mutex_lock(&g_commit.mu);
+        }
+        struct commit_req *batch = g_commit.head;
+        g_commit.head = g_commit.tail = NULL;
+        g_commit.busy = 1;
+        pthread_mutex_unlock(&g_commit.mu);
+
+        if (g_conf.durability == DUR_GROUP)
+            commit_group(batch);
+        else
+            for (struct commit_req *q = batch; q; q = q->next)
+                q->err = commit_one(q->filename, q->tmp);
+
+        pthread_mutex_lock(&g_commit.mu);
+        uint64_t now = hist_now_us();
+        shared = batch->next != NULL || g_commit.head != NULL;
+        struct commit_req *orphans = NULL;
+        while (batch)
+        {
+            struct commit_req *q = batch;
+            struct reactor *r = q->r;
+            batch = q->next;
+            hist_record(&g_stats.commit, now - q->queued_us);
+            q->done = 1; // its owner may free it from here on
+            if (q->orphaned)
+            {
+                q->next = orphans;
+                orphans = q;
+            }
+            else if (r)
+                reactor_wake(r);
+        }
+        g_commit.busy = 0;
+        pthread_cond_broadcast(&g_commit.done_cv);
+        if (orphans)
+        {
+            // Their connections closed while they were queued
+            pthread_mutex_unlock(&g_commit.mu);
+            while (orphans)
+            {
+                struct commit_req *next = orphans->next;
+                commit_free(orphans);
+                orphans = next;
+            }
+            pthread_mutex_lock(&g_commit.mu);
+        }
+    }
+    return NULL;
+}
+
+// Open the directory and start the commit thread (DURABILITY other than none)
+static int commit_start(void)
+{
+    g_commit.dirfd = open(SHARED_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (g_commit.dirfd < 0)
+        return -1;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, commit_main, NULL) != 0)
+    {
+        close(g_commit.dirfd);
+        g_commit.dirfd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Queue a complete staging file for publishing; r is woken once it is done
+static void commit_submit(struct commit_req *q, const char *filename, const char *tmp,
+                          struct reactor *r)
+{
+    q->filename = filename;
+    q->tmp = tmp;
+    q->err = 0;
+    q->done = 0;
+    q->orphaned = 0;
+    q->lock = NULL;
+    q->r = r;
+    q->queued_us = hist_now_us();
+    q->next = NULL;
+    pthread_mutex_lock(&g_commit.mu);
+    if (g_commit.tail)
+        g_commit.tail->next = q;
+    else
+        g_commit.head = q;
+    g_commit.tail = q;
+    pthread_cond_signal(&g_commit.cv);
+    pthread_mutex_unlock(&g_commit.mu);
+}
+
+// Queue a request of its own for a reactor connection, which may close
+// before it is done (commit_disown). NULL if out of memory.
+static struct commit_req *commit_queue(const char *filename, const char *tmp,
+                                       struct reactor *r)
+{
+    size_t fl = strlen(filename) + 1, tl = strlen(tmp) + 1;
+    struct commit_req *q = malloc(sizeof(*q) + fl + tl);
+    if (!q)
+        return NULL;
+    memcpy(q->names, filename, fl);
+    memcpy(q->names + fl, tmp, tl);
+    commit_submit(q, q->names, q->names + fl, r);
+    return q;
+}
+
+// The connection that queued q is closing: nobody will wait for it. The
+// commit thread frees it and releases lk (the file's write lock, held
+// until the upload is published) when it is done.
+static void commit_disown(struct commit_req *q, struct file_lock *lk)
+{
+    pthread_mutex_lock(&g_commit.mu);
+    int done = q->done;
+    if (!done)
+    {
+        q->orphaned = 1;
+        q->lock = lk;
+    }
+    pthread_mutex_unlock(&g_commit.mu);
+    if (done)
+    {
+        q->lock = lk;
+        commit_free(q);
+    }
+}
+
+// Wait until every queued upload is published, including those of
+// connections that closed meanwhile (at shutdown)
+static void commit_drain(void)
+{
+    if (g_commit.dirfd < 0)
+        return;
+    pthread_mutex_lock(&g_commit.mu);
+    while (g_commit.head || g_commit.busy)
+        pthread_cond_wait(&g_commit.done_cv, &g_commit.mu);
+    pthread_mutex_unlock(&g_commit.mu);
+}
+
+static int commit_done(struct commit_req *q)
+{
+    pthread_mutex_lock(&g_commit.mu);
+    int done = q->done;
+    pthread_mutex_unlock(&g_commit.mu);
+    return done;
+}
+
+// Block until q is done. Returns its outcome.
+static int commit_wait(struct commit_req *q)
+{
+    pthread_mutex_lock(&g_commit.mu);
+    while (!q->done)
+        pthread_cond_wait(&g_commit.done_cv, &g_commit.mu);
+    pthread_mutex_unlock(&g_commit.mu);
+    return q->err;
+}
+
+// Publish a complete staging file (ok) as durably as DURABILITY asks, or
+// throw it away. Returns 0 or an errno.
+static int upload_finish(const char *filename, const char *tmp, int ok)
+{
+    if (!ok)
+    {
+        unlink(tmp);
+        return 0;
+    }
+    if (g_conf.durability == DUR_GROUP)
+    {
+        struct commit_req q;
+        commit_submit(&q, filename, tmp, NULL);
+        return commit_wait(&q);
+    }
+    uint64_t started = hist_now_us();
+    int err = g_conf.durability == DUR_FDATASYNC ? commit_one(filename, tmp)
+                                                 : upload_rename(filename, tmp);
+    hist_record(&g_stats.commit, hist_now_us() - started);
+    return err;
+}
+
+static void commit_report(void)
+{
+    struct hist h;
+    hist_snapshot(&g_stats.commit, &h);
+    printf("Durability %s: %llu upload(s) published with %llu flush(es), ack p50 %llu us, "
+           "p99 %llu us\n",
+           durability_name(g_conf.durability), (unsigned long long)STAT_GET(commits),
+           (unsigned long long)STAT_GET(commit_flushes),
+           (unsigned long long)hist_percentile(&h, 0.50),
+           (unsigned long long)hist_percentile(&h, 0.99));
+}
+/* ============================================================ */
+
+/*
+ * Delta uploads: "DELTA <name>" queues for the write lock like WRITE,
+ * then gets
+ *   OK DELTA <name> <block> <count> <total>\n<count * DELTA_SIG_LEN bytes>
+ * with the signatures of the current version (count 0 if there is none).
+ * The client answers "SIZE <len>" + a <len>-byte delta (see delta.h), or
+ * "ABORT". The delta is staged in an unlinked scratch file, applied to
+ * the version that was signed (still held open and still current, since
+ * we hold the lock) and the result is published like any upload. A delta
+ * that does not apply gets "ERR delta mismatch"; the client can then
+ * fall back to a plain WRITE.
+ */
+struct delta_base
+{
+    int fd;          // version being replaced, -1 if there is none
+    long long total; // its size
+    size_t block;    // signature block size
+};
+
+// Open the current version and build the OK DELTA reply with its
+// signatures. Returns a malloc'd reply (length in *len), or NULL.
+static char *delta_offer(const char *filename, struct delta_base *db, size_t *len)
+{
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+    db->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (db->fd >= 0 && (fstat(db->fd, &st) < 0 || !S_ISREG(st.st_mode)))
+    {
+        close(db->fd); // nothing to copy from: the delta will be all literals
+        db->fd = -1;
+    }
+    db->total = db->fd >= 0 ? (long long)st.st_size : 0;
+    db->block = delta_block_size(db->total);
+    size_t count = (size_t)((db->total + (long long)db->block - 1) / (long long)db->block);
+
+    char hdr[1024];
+    int hl = snprintf(hdr, sizeof(hdr), "OK DELTA %s %zu %zu %lld\n", filename, db->block,
+                      count, db->total);
+    char *msg = malloc((size_t)hl + count * DELTA_SIG_LEN);
+    if (!msg)
+        return NULL;
+    memcpy(msg, hdr, (size_t)hl);
+    if (count && delta_signatures(db->fd, db->total, db->block, (unsigned char *)msg + hl) != 0)
+    {
+        free(msg);
+        return NULL;
+    }
+    *len = (size_t)hl + count * DELTA_SIG_LEN;
+    return msg;
+}
+
+// Unnamed scratch file for a received delta, next to the uploads
+static int delta_stage_open(void)
+{
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s/%sdelta.XXXXXX", SHARED_DIR, UPLOAD_PREFIX);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(tmp);
+    return fd;
+}
+
+// Rebuild filename from its base and the staged delta into a new staging
+// file (path in tmp), to be published like any upload. Returns 0, an
+// errno, or -1 if the delta did not apply; on failure tmp is removed.
+static int delta_rebuild(const char *filename, const struct delta_base *db, int delta_fd,
+                         char *tmp, size_t cap)
+{
+    int out = upload_open(filename, tmp, cap);
+    if (out < 0)
+        return errno;
+    long long reused;
+    int err = delta_apply(db->fd, db->total, db->block, delta_fd, out, &reused);
+    if (close(out) < 0 && err == 0)
+        err = errno;
+    if (err)
+    {
+        unlink(tmp);
+        return err;
+    }
+    STAT_ADD(deltas, 1);
+    STAT_ADD(delta_reused, reused);
+    return 0;
+}
+
+/*
+ * Parallel chunked uploads, sessions only:
+ *   PUT <name> <size> <chunk> -> [NOTIFY BUSY <name> <pos>]... OK PUT <name> <token>
+ *   CHUNK <token> <index> <len> -> <len> payload bytes: the <index>th <chunk>
+ *                                bytes of the file (the last one shorter),
+ *                                then OK CHUNK <index>
+ *   COMMIT <token>            -> the confirmation, or ERR missing chunks <n>
+ * PUT queues for the write lock like WRITE and stages the upload at its
+ * final size. CHUNKs may then arrive in any order on any session, usually
+ * several in parallel; each is written at its own offset, and resending
+ * one is harmless. A refused CHUNK still has its payload consumed, so a
+ * pipelining client stays in sync. COMMIT publishes the file with the
+ * usual rename. The upload belongs to the session that sent PUT: if that
+ * closes first, the upload is dropped and the lock released.
+ */
+#define PUT_MAX_CHUNKS (1 << 20)
+
+struct put_txn
+{
+    char token[17];
+    char filename[512];
+    char tmp[1024];         // staging file
+    struct file_lock *lock; // held until commit or abort; our reference
+    long long size, chunk;
+    size_t nchunks, have;
+    unsigned char *got; // per chunk: received
+    int refs;           // the owning session + CHUNKs in flight
+    int closed;         // committed or aborted: no more CHUNKs
+    struct put_txn *next;
+};
+
+static struct
+{
+    pthread_mutex_t mu;
+    struct put_txn *list;
+} g_puts = {.mu = PTHREAD_MUTEX_INITIALIZER};
+
+// Stage an upload for filename, whose write lock lk the caller holds and
+// hands over with its reference on success. Returns NULL with errno set.
+static struct put_txn *put_begin(const char *filename, struct file_lock *lk, long long size,
+                                 long long chunk)
+{
+    if (size < 0 || chunk <= 0 || (size + chunk - 1) / chunk > PUT_MAX_CHUNKS)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct put_txn *t = calloc(1, sizeof(*t));
+    size_t nchunks = (size_t)((size + chunk - 1) / chunk);
+    if (!t || !(t->got = calloc(nchunks ? nchunks : 1, 1)))
+    {
+        free(t);
+        errno = ENOMEM;
+        return NULL;
+    }
+    int fd = upload_open(filename, t->tmp, sizeof(t->tmp));
+    if (fd < 0 || ftruncate(fd, size) < 0 || close(fd) < 0)
+    {
+        int err = errno;
+        if (fd >= 0)
+            upload_finish(filename, t->tmp, 0);
+        free(t->got);
+        free(t);
+        errno = err;
+        return NULL;
+    }
+
+    uint64_t rnd[1];
+    if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd))
+        rnd[0] = hist_now_us() ^ ((uint64_t)(uintptr_t)t << 16);
+    snprintf(t->token, sizeof(t->token), "%016llx", (unsigned long long)rnd[0]);
+    snprintf(t->filename, sizeof(t->filename), "%s", filename);
+    t->lock = lk;
+    t->size = size;
+    t->chunk = chunk;
+    t->nchunks = nchunks;
+    t->refs = 1;
+
+    pthread_mutex_lock(&g_puts.mu);
+    t->next = g_puts.list;
+    g_puts.list = t;
+    pthread_mutex_unlock(&g_puts.mu);
+    return t;
+}
+
+static void put_unlink_locked(struct put_txn *t)
+{
+    for (struct put_txn **p = &g_puts.list; *p; p = &(*p)->next)
+        if (*p == t)
+        {
+            *p = t->next;
+            break;
+        }
+    t->closed = 1;
+}
+
+static void put_unref(struct put_txn *t)
+{
+    pthread_mutex_lock(&g_puts.mu);
+    int last = --t->refs == 0;
+    pthread_mutex_unlock(&g_puts.mu);
+    if (last)
+    {
+        free(t->got);
+        free(t);
+    }
+}
+
+// Open chunk idx (len bytes) of the upload named by token for writing,
+// positioned at its offset, through a private fd so parallel chunks never
+// share a file position. On success *tp holds a reference for
+// put_chunk_done(). Returns the fd, or -1 with the error reply in *err.
+static int put_chunk_open(const char *token, long long idx, long long len,
+                          struct put_txn **tp, const char **err)
+{
+    pthread_mutex_lock(&g_puts.mu);
+    struct put_txn *t = g_puts.list;
+    while (t && strcmp(t->token, token) != 0)
+        t = t->next;
+    long long off = t ? idx * t->chunk : 0;
+    if (!t || idx < 0 || (size_t)idx >= t->nchunks ||
+        len != (t->size - off < t->chunk ? t->size - off : t->chunk))
+    {
+        pthread_mutex_unlock(&g_puts.mu);
+        *err = t ? "ERR bad chunk\n" : "ERR unknown upload\n";
+        return -1;
+    }
+    // Opened under the registry lock so COMMIT cannot rename it meanwhile
+    int fd = open(t->tmp, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || lseek(fd, off, SEEK_SET) < 0)
+    {
+        pthread_mutex_unlock(&g_puts.mu);
+        *err = "ERR cannot open file\n";
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    t->refs++;
+    pthread_mutex_unlock(&g_puts.mu);
+    *tp = t;
+    return fd;
+}
+
+// A chunk's payload is in (ok) or failed; drops put_chunk_open's reference
+static void put_chunk_done(struct put_txn *t, long long idx, int ok)
+{
+    pthread_mutex_lock(&g_puts.mu);
+    if (ok && !t->got[idx])
+    {
+        t->got[idx] = 1;
+        t->have++;
+    }
+    pthread_mutex_unlock(&g_puts.mu);
+    put_unref(t);
+}
+
+// Take a fully received upload off the registry so it can be published.
+// Returns 0, or -1 with the reply in err if chunks are missing or in flight.
+static int put_close(struct put_txn *t, char *err, size_t cap)
+{
+    pthread_mutex_lock(&g_puts.mu);
+    if (t->have < t->nchunks || t->refs > 1)
+    {
+        if (t->have < t->nchunks)
+            snprintf(err, cap, "ERR missing chunks %zu\n", t->nchunks - t->have);
+        else
+            snprintf(err, cap, "ERR chunks in flight\n");
+        pthread_mutex_unlock(&g_puts.mu);
+        return -1;
+    }
+    put_unlink_locked(t);
+    pthread_mutex_unlock(&g_puts.mu);
+    return 0;
+}
+
+// The closed upload is published or failed: let the next writer in
+static void put_release(struct put_txn *t)
+{
+    writer_release(t->lock);
+    file_lock_put(t->lock);
+    t->lock = NULL;
+}
+
+// Publish a fully received upload and release its lock. Returns 0, an
+// errno, or -1 with the reply in err if chunks are missing or in flight.
+static int put_commit(struct put_txn *t, char *err, size_t cap)
+{
+    if (put_close(t, err, cap) < 0)
+        return -1;
+    int rc = upload_finish(t->filename, t->tmp, 1);
+    put_release(t);
+    return rc;
+}
+
+// The owning session is gone: drop an upload that was not committed
+static void put_abort(struct put_txn *t)
+{
+    pthread_mutex_lock(&g_puts.mu);
+    int open = !t->closed;
+    if (open)
+        put_unlink_locked(t);
+    pthread_mutex_unlock(&g_puts.mu);
+    if (open)
+    {
+        printf("Upload of '%s' abandoned\n", t->filename);
+        upload_finish(t->filename, t->tmp, 0);
+        writer_release(t->lock);
+        file_lock_put(t->lock);
+    }
+    put_unref(t);
+}
+
+/*
+ * Handshake line: "HELLO <id> [SESSION] [BINARY] [COMPRESS <codec>]".
+ * The reply echoes what was accepted ("OK", "OK SESSION", "OK BINARY",
+ * "OK SESSION COMPRESS deflate", ...); a client offering a codec we
+ * don't speak, or any codec while COMPRESSION is 0, simply gets raw
+ * transfers. BINARY switches everything after the reply to bframe.h
+ * frames and implies SESSION; without it the protocol stays text.
+ */
+struct hello
+{
+    char id[64];
+    int persistent; // SESSION (or BINARY)
+    int binary;     // BINARY
+    int compress;   // COMPRESS deflate accepted
+};
+
+static void hello_parse(const char *line, struct hello *h, char *reply, size_t cap)
+{
+    char opt[4][16] = {"", "", "", ""};
+    memset(h, 0, sizeof(*h));
+    sscanf(line, "HELLO %63s %15s %15s %15s %15s", h->id, opt[0], opt[1], opt[2], opt[3]);
+    for (int i = 0; i < 4; i++)
+    {
+        if (strcmp(opt[i], "SESSION") == 0)
+            h->persistent = 1;
+        else if (strcmp(opt[i], "BINARY") == 0)
+            h->persistent = h->binary = 1;
+        else if (strcmp(opt[i], "COMPRESS") == 0 && i < 3)
+            h->compress = g_conf.compression && strcmp(opt[++i], "deflate") == 0;
+    }
+    snprintf(reply, cap, "OK%s%s\n",
+             h->binary ? " BINARY" : h->persistent ? " SESSION" : "",
+             h->compress ? " COMPRESS deflate" : "");
+}
+
+/*
+ * In binary mode the handlers still produce their usual text replies;
+ * they are sent as frames whose status comes from the text and whose
+ * meta is the text without its prefix and newline.
+ */
+static uint8_t bin_status(const char *msg, const char **meta, size_t *len)
+{
+    static const struct
+    {
+        const char *prefix;
+        uint8_t code;
+    } map[] = {
+        {"ERR file not found", BF_ERR_NOT_FOUND},
+        {"ERR invalid filename", BF_ERR_NAME},
+        {"ERR range", BF_ERR_RANGE},
+        {"ERR bad range", BF_ERR_RANGE},
+        {"ERR checksum", BF_ERR_CHECKSUM},
+        {"ERR cannot", BF_ERR_IO},
+        {"ERR write failed", BF_ERR_IO},
+        {"ERR bad", BF_ERR_REQUEST},
+        {"ERR unknown", BF_ERR_REQUEST},
+        {"ERR session", BF_ERR_REQUEST},
+        {"ERR ", BF_ERR},
+        {"NOTIFY BUSY ", BF_NOTIFY},
+        {"OK WRITE ", BF_ACCEPTED},
+        {"OK NOTMODIFIED ", BF_NOT_MODIFIED},
+        {"BYE", BF_BYE},
+        {"OK ", BF_OK},
+    };
+    uint8_t code = BF_OK;
+    *meta = msg;
+    for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++)
+    {
+        if (strncmp(msg, map[i].prefix, strlen(map[i].prefix)) != 0)
+            continue;
+        code = map[i].code;
+        // Drop the word(s) the status already says
+        const char *drop = code == BF_NOTIFY ? "NOTIFY BUSY " : code == BF_BYE ? "BYE"
+                           : code == BF_NOT_MODIFIED ? "OK NOTMODIFIED "
+                           : code >= BF_ERR ? "ERR "
+                                            : "OK ";
+        *meta = msg + strlen(drop);
+        break;
+    }
+    *len = strcspn(*meta, "\n");
+    return code;
+}
+
+/* ============================================================
+ * Bandwidth shaping (RATE_* in server_conf)
+ *
+ * READ data and WRITE payloads are charged to a token bucket per
+ * HELLO client id, shared by all of that client's sessions. A bucket
+ * fills at the client's rate and holds up to RATE_BURST_KB, so a
+ * client that was idle gets a small request through at full speed:
+ * interactive READs stay quick next to bulk transfers. The rate is
+ * RATE_CLIENT_KBPS and, with RATE_TOTAL_KBPS set, the client's fair
+ * share of the total: every SHAPE_COUNT_US the total is divided
+ * max-min fashion by weight (RATE_WEIGHT <id>:<n>, default 1) among
+ * the clients that moved data in the last SHAPE_ACTIVE_MS, so what a
+ * light client does not use goes to the busy ones. Data moves in
+ * steps of at most SHAPE_CHUNK; a step may take the bucket below
+ * zero and the next one waits until it has refilled. Worker threads
+ * sleep for that, reactors park the connection and resume it from
+ * their event loop (rconn_throttle). Without limits nothing is
+ * tracked at all.
+ * ============================================================ */
+#define SHAPE_CHUNK 65536
+#define SHAPE_ACTIVE_MS 200
+#define SHAPE_COUNT_US 10000     // how often the shares are recomputed
+#define SHAPE_MAX_WAIT_US 50000  // longest single pause: shares change meanwhile
+#define SHAPE_WEIGHTS 64
+
+struct shape_client
+{
+    char id[64];
+    int refs;             // sessions that said HELLO with this id
+    unsigned weight;
+    double tokens;        // bytes; below zero after a step overshoots
+    uint64_t refill_us;   // tokens last brought up to date
+    uint64_t active_us;   // last charged
+    uint64_t waited_us;   // last had to wait: wants more than it gets
+    uint64_t bytes;       // charged since the shares were computed
+    double used;          // bytes/us lately (moving average)
+    int fixed;            // shape_count_locked() scratch
+    struct shape_client *next;
+};
+
+static struct
+{
+    pthread_mutex_t mu;
+    struct shape_client *clients;
+    double level;         // bytes/us per unit of weight; 0 = no contention
+    uint64_t counted_us;  // when the shares were last computed
+    struct
+    {
+        char id[64];
+        unsigned weight;
+    } weights[SHAPE_WEIGHTS]; // RATE_WEIGHT lines
+    int nweights;
+} g_shape = {.mu = PTHREAD_MUTEX_INITIALIZER};
+
+// RATE_WEIGHT <id>:<weight>
+static void shape_weight_conf(const char *val)
+{
+    char id[64];
+    unsigned w;
+    if (sscanf(val, "%63[^:]:%u", id, &w) != 2 || w == 0 || g_shape.nweights == SHAPE_WEIGHTS)
+    {
+        printf("Ignoring RATE_WEIGHT %s\n", val);
+        return;
+    }
+    memcpy(g_shape.weights[g_shape.nweights].id, id, sizeof(id));
+    g_shape.weights[g_shape.nweights++].weight = w;
+}
+
+// The bucket for a client id, referenced until shape_put(); NULL when
+// no limit is configured
+static struct shape_client *shape_get(const char *id)
+{
+    if (g_conf.rate_client_kbps == 0 && g_conf.rate_total_kbps == 0)
+        return NULL;
+    pthread_mutex_lock(&g_shape.mu);
+    struct shape_client *sc = g_shape.clients;
+    while (sc && strcmp(sc->id, id) != 0)
+        sc = sc->next;
+    if (!sc && (sc = calloc(1, sizeof(*sc))) != NULL)
+    {
+        snprintf(sc->id, sizeof(sc->id), "%s", id);
+        sc->weight = 1;
+        for (int i = 0; i < g_shape.nweights; i++)
+            if (strcmp(g_shape.weights[i].id, id) == 0)
+                sc->weight = g_shape.weights[i].weight;
+        sc->tokens = g_conf.rate_burst_kb * 1024.0;
+        sc->refill_us = hist_now_us();
+        sc->next = g_shape.clients;
+        g_shape.clients = sc;
+    }
+    if (sc)
+        sc->refs++;
+    pthread_mutex_unlock(&g_shape.mu);
+    return sc;
+}
+
+// Idle buckets nobody references are freed by shape_count_locked()
+static void shape_put(struct shape_client *sc)
+{
+    if (!sc)
+        return;
+    pthread_mutex_lock(&g_shape.mu);
+    sc->refs--;
+    pthread_mutex_unlock(&g_shape.mu);
+}
+
+/*
+ * Recompute g_shape.level (g_shape.mu held): the largest rate per unit
+ * of weight at which the active clients' demands fit in the total.
+ * A client that had to wait lately wants as much as it can get; any
+ * other is expected to keep moving what it did, with some headroom.
+ */
+static void shape_count_locked(uint64_t now)
+{
+    uint64_t elapsed = now - g_shape.counted_us;
+    if (elapsed < SHAPE_COUNT_US)
+        return;
+    g_shape.counted_us = now;
+
+    double left = g_conf.rate_total_kbps * 1024.0 / 1e6, weight = 0;
+    double cap = g_conf.rate_client_kbps * 1024.0 / 1e6;
+    struct shape_client **pp = &g_shape.clients;
+    while (*pp)
+    {
+        struct shape_client *sc = *pp;
+        sc->used = sc->used / 2 + (double)sc->bytes / (double)elapsed / 2;
+        sc->bytes = 0;
+        sc->fixed = now - sc->active_us >= SHAPE_ACTIVE_MS * 1000ull;
+        if (!sc->fixed)
+            weight += sc->weight;
+        else if (sc->refs == 0)
+        {
+            *pp = sc->next;
+            free(sc);
+            continue;
+        }
+        pp = &sc->next;
+    }
+
+    // Water-filling: settle the clients wanting less than an even
+    // split of what is left, until the rest all want more
+    for (int settled = 1; settled && weight > 0;)
+    {
+        settled = 0;
+        for (struct shape_client *sc = g_shape.clients; sc; sc = sc->next)
+        {
+            if (sc->fixed)
+                continue;
+            int hungry = now - sc->waited_us < SHAPE_ACTIVE_MS * 1000ull;
+            double want = sc->used * 1.25;
+            if (hungry || (cap > 0 && want > cap))
+                want = cap; // as much as it may have
+            if (hungry && cap == 0)
+                continue;   // takes whatever the others leave
+            if (want < left / weight * sc->weight)
+            {
+                sc->fixed = 1;
+                left -= want;
+                weight -= sc->weight;
+                settled = 1;
+            }
+        }
+    }
+    g_shape.level = weight > 0 ? left / weight : 0;
+}
+
+// Microseconds before sc may take its next step; 0 = go ahead
+static uint64_t shape_delay(struct shape_client *sc)
+{
+    if (!sc)
+        return 0;
+    uint64_t now = hist_now_us();
+    pthread_mutex_lock(&g_shape.mu);
+    shape_count_locked(now);
+
+    // Bytes per microsecond
+    double rate = g_conf.rate_client_kbps * 1024.0 / 1e6;
+    if (g_conf.rate_total_kbps > 0)
+    {
+        double total = g_conf.rate_total_kbps * 1024.0 / 1e6;
+        double share = g_shape.level > 0 ? g_shape.level * sc->weight : total;
+        if (share > total)
+            share = total;
+        if (rate == 0 || share < rate)
+            rate = share;
+    }
+    sc->tokens += rate * (double)(now - sc->refill_us);
+    if (sc->tokens > g_conf.rate_burst_kb * 1024.0)
+        sc->tokens = g_conf.rate_burst_kb * 1024.0;
+    sc->refill_us = now;
+    uint64_t wait = 0;
+    if (sc->tokens < 0)
+    {
+        wait = (uint64_t)(-sc->tokens / rate) + 1;
+        sc->waited_us = now;
+    }
+    pthread_mutex_unlock(&g_shape.mu);
+    return wait < SHAPE_MAX_WAIT_US ? wait : SHAPE_MAX_WAIT_US;
+}
+
+// Charge n bytes moved for sc
+static void shape_charge(struct shape_client *sc, size_t n)
+{
+    if (!sc || n == 0)
+        return;
+    pthread_mutex_lock(&g_shape.mu);
+    sc->tokens -= (double)n;
+    sc->bytes += n;
+    sc->active_us = hist_now_us();
+    pthread_mutex_unlock(&g_shape.mu);
+}
+
+// Largest step for a transfer that may want more
+static size_t shape_cap(const struct shape_client *sc, size_t want)
+{
+    return sc && want > SHAPE_CHUNK ? SHAPE_CHUNK : want;
+}
+
+// Worker threads: sleep until sc may take its next step
+static void shape_sleep(struct shape_client *sc)
+{
+    uint64_t us = shape_delay(sc);
+    if (us == 0)
+        return;
+    uint64_t started = hist_now_us();
+    STAT_ADD(shaped_pauses, 1);
+    do
+        usleep((useconds_t)us);
+    while ((us = shape_delay(sc)) > 0);
+    STAT_ADD(shaped_pause_us, hist_now_us() - started);
+}
+/* ============================================================ */
+
+/* ============================================================
+ * Client session (worker pool path)
+ *
+ * "HELLO <id>" keeps the original one-command-per-connection
+ * protocol: the READ reply ends at close and the WRITE payload ends
+ * when the client half-closes.
+ *
+ * "HELLO <id> SESSION" (answered with "OK SESSION") keeps the
+ * connection open for any number of length-delimited commands, which
+ * may be pipelined without waiting for each reply:
+ *   READ <name>            -> OK READ <name> <size> <tag>\n<size bytes>
+ *   READ <name> IF-NONE-MATCH <tag>
+ *                          -> OK NOTMODIFIED <name> <tag> while the file has
+ *                             that tag (see file_tag), else as READ <name>
+ *   WRITE <name> <len>     -> [NOTIFY BUSY <name> <pos>]... OK WRITE <name>, then
+ *                             <len> payload bytes, then the confirmation
+ *   WRITE <name>           -> as above, but after OK WRITE the client
+ *                             sends "SIZE <len>" + payload, or "ABORT"
+ *   DELTA <name>           -> OK DELTA + signatures, then like WRITE <name>
+ *                             with a delta as the payload (see delta_offer)
+ *   PUT, CHUNK, COMMIT     -> one upload split over several sessions (see put_begin)
+ *   BATCH <count>          -> many files in one go, one reply (see handle_batch)
+ *   LIST [PREFIX <p>] ...  -> OK LIST + name, size, mtime lines (see index_list_reply)
+ *   STAT <name>            -> OK STAT <name> <size> <mtime>
+ *   WATCH [<name>...] [PREFIX <p>]...
+ *                          -> OK WATCH <count>, then CHANGED events; the
+ *                             connection only takes WATCH and QUIT from
+ *                             then on (see watch_adopt)
+ *   QUIT                   -> BYE, connection closed
+ * Errors are reported as "ERR ..." and the session carries on.
+ *
+ * With "COMPRESS deflate" accepted in HELLO (either mode), READ reply
+ * data and WRITE payloads travel as zframe frames; every length in the
+ * command lines still counts raw file bytes, and files on disk and in
+ * the cache stay uncompressed.
+ * ============================================================ */
+struct session
+{
+    int fd;
+    int persistent; // SESSION negotiated in HELLO
+    int compress;   // COMPRESS deflate negotiated in HELLO
+    struct zcodec zc;
+    char client_id[64];
+    int pipefd[2];     // splice() staging pipe for WRITE payloads, created on first use
+    int no_splice;     // splice() unsupported here: use recv/write
+    struct connbuf cb; // shared by the line parser and payload reads
+    struct put_txn *put; // chunked upload started here with PUT, not yet committed
+    int binary;          // BINARY negotiated in HELLO: requests and replies are bframes
+    int crc_on;          // current payload is checksummed into crc (binary mode)
+    int crc_want;        // this binary READ asked for a CRC even if sent with sendfile()
+    uLong crc;
+    struct shape_client *shape; // bandwidth bucket of client_id, NULL = unshaped
+    struct conn_entry conn;     // place in the connection registry
+};
+
+// Account for payload bytes moved either way (shaping, shutdown report)
+static void session_moved(struct session *ss, size_t n)
+{
+    shape_charge(ss->shape, n);
+    __atomic_add_fetch(&ss->conn.bytes, n, __ATOMIC_RELAXED);
+}
+
+// Send a text reply, or its frame in binary mode
+static int session_reply(struct session *ss, const char *msg)
+{
+    stats_reply(msg);
+    if (!ss->binary)
+        return send_all(ss->fd, msg, strlen(msg));
+    unsigned char frame[BFRAME_HDR + BFRAME_META_MAX];
+    const char *meta;
+    size_t mlen;
+    uint8_t code = bin_status(msg, &meta, &mlen);
+    return send_all(ss->fd, frame, bframe_build(frame, code, 0, meta, mlen, 0));
+}
+
+// A reply line followed by len payload bytes (then session_reply_end)
+static int session_reply_data(struct session *ss, const char *msg, long long len)
+{
+    if (!ss->binary)
+        return session_reply(ss, msg);
+    unsigned char frame[BFRAME_HDR + BFRAME_META_MAX];
+    const char *meta;
+    size_t mlen;
+    uint8_t code = bin_status(msg, &meta, &mlen);
+    size_t flen = bframe_build(frame, code, ss->crc_on ? BF_FLAG_CRC : 0, meta, mlen,
+                               (uint64_t)len);
+    return send_all(ss->fd, frame, flen);
+}
+
+// After the payload of a session_reply_data(): the trailer in binary mode
+static int session_reply_end(struct session *ss, long long len)
+{
+    if (!ss->binary || len <= 0)
+        return 0;
+    unsigned char tr[BFRAME_TRAILER];
+    bframe_put_crc(tr, ss->crc_on ? (uint32_t)ss->crc : 0);
+    ss->crc_on = 0;
+    return send_all(ss->fd, tr, sizeof(tr));
+}
+
+// Sleep only when TEST_DELAYS is on (used to demo concurrent readers)
+static void test_delay(long ms)
+{
+    if (g_conf.test_delays)
+        nanosleep(&(struct timespec){ms / 1000, (ms % 1000) * 1000000L}, NULL);
+}
+
+#define SENDFILE_CHUNK (4 << 20) // per sendfile() call; bounds time between checks
+#define TEST_CHUNK 65536         // chunk size when TEST_DELAYS paces the stream
+
+// Fold the n bytes sendfile() just sent from fd (the file offset is now
+// right after them) into *crc. They are read back with pread(), from the
+// page cache they were just sent from: one copy into user space, the cost
+// zero-copy replies otherwise avoid, so only READs that ask pay it.
+static int crc_sent(uLong *crc, int fd, size_t n)
+{
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (off < (off_t)n)
+        return -1;
+    off -= (off_t)n;
+    unsigned char buf[65536];
+    while (n > 0)
+    {
+        ssize_t r = pread(fd, buf, n < sizeof(buf) ? n : sizeof(buf), off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        *crc = crc32(*crc, buf, (uInt)r);
+        off += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+/*
+ * Send a file to the socket. Regular files go through sendfile() so the
+ * data never enters user space; anything else (pipes, devices) uses the
+ * buffered fread/send loop. remaining < 0 means "until EOF".
+ * Returns bytes that could not be sent (0 on success), or -1 on a send error.
+ */
+static long long stream_file(struct session *ss, FILE *in, long long remaining)
+{
+    int connection = ss->fd;
+    struct shape_client *sc = ss->shape;
+    struct stat st;
+    if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        int fd = fileno(in);
+        while (remaining != 0)
+        {
+            size_t want = shape_cap(sc, g_conf.test_delays ? TEST_CHUNK : SENDFILE_CHUNK);
+            if (remaining > 0 && (long long)want > remaining)
+                want = (size_t)remaining;
+            shape_sleep(sc);
+            ssize_t n = sendfile(connection, fd, NULL, want);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+                break; // not supported here: finish with the buffered loop
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                return remaining > 0 ? remaining : 0;
+            if (ss->crc_on && crc_sent(&ss->crc, fd, (size_t)n) < 0)
+                return -1;
+            STAT_ADD(bytes_out, n);
+            session_moved(ss, (size_t)n);
+            if (remaining > 0)
+                remaining -= n;
+
+            // Test
+            test_delay(20);
+        }
+        if (remaining == 0)
+            return 0;
+    }
+
+    // Buffer used to send file data
+    char buf2[65536];
+
+    // Number of bytes read from file
+    size_t nread;
+
+    while (remaining != 0 && (nread = fread(buf2, 1, sizeof(buf2), in)) > 0)
+    {
+        if (remaining > 0 && (long long)nread > remaining)
+            nread = (size_t)remaining;
+        if (ss->crc_on)
+            ss->crc = crc32(ss->crc, (const Bytef *)buf2, (uInt)nread);
+        shape_sleep(sc);
+        if (send_all(connection, buf2, nread) < 0)
+            return -1;
+        STAT_ADD(bytes_out, nread);
+        session_moved(ss, nread);
+        if (remaining > 0)
+            remaining -= (long long)nread;
+
+        // Test
+        test_delay(20);
+    }
+    return remaining > 0 ? remaining : 0;
+}
+
+/*
+ * Compressed READ data: send remaining bytes (< 0 = until EOF) of mem,
+ * or of in when mem is NULL, as zframe frames. A file that ends early
+ * is an error only when the length was announced. Returns 0 or -1.
+ */
+static int stream_frames(struct session *ss, const char *mem, FILE *in, long long remaining)
+{
+    unsigned char raw[ZFRAME_BLOCK], out[ZFRAME_MAX];
+    unsigned streak = 0;
+    while (remaining != 0)
+    {
+        size_t n = ZFRAME_BLOCK;
+        if (remaining > 0 && (long long)n > remaining)
+            n = (size_t)remaining;
+        const void *src = mem;
+        if (mem)
+            mem += n;
+        else
+        {
+            n = fread(raw, 1, n, in);
+            if (n == 0)
+                return remaining > 0 ? -1 : 0;
+            src = raw;
+        }
+        if (ss->crc_on)
+            ss->crc = crc32(ss->crc, src, (uInt)n);
+        size_t len = zframe_encode(&ss->zc, &streak, src, n, out);
+        shape_sleep(ss->shape);
+        if (send_all(ss->fd, out, len) < 0)
+            return -1;
+        STAT_ADD(bytes_out, n);
+        session_moved(ss, n);
+        STAT_ADD(comp_raw, n);
+        STAT_ADD(comp_wire, len);
+        if (remaining > 0)
+            remaining -= (long long)n;
+
+        // Test
+        test_delay(20);
+    }
+    return 0;
+}
+
+/*
+ * Byte-range READ: "READ <name> <offset> [<length>]" (length omitted =
+ * to end of file) is answered with
+ *   OK RANGE <name> <offset> <length> <total> <tag>\n<length bytes>
+ * in both legacy and session mode; the length is clipped to the file and
+ * an offset past the end gets "ERR range not satisfiable <total>".
+ * "READ <name> 0 0" returns just the header, i.e. the total size. The
+ * version tag (file_tag) lets a client that fetches a file in pieces
+ * check that every piece came from the same version.
+ */
+struct read_range
+{
+    long long offset; // -1: plain READ of the whole file
+    long long length; // -1: to end of file
+    char match[TAG_LEN]; // IF-NONE-MATCH tag, "" for an unconditional READ
+};
+
+// Fill rg from what follows "READ <name>": "<offset> [<length>]" (already
+// scanned into len and arg2) or "IF-NONE-MATCH <tag>". Returns NULL, or
+// the ERR line to answer with.
+static const char *read_args(const char *line, int fields, long long len, long long arg2,
+                             int persistent, struct read_range *rg)
+{
+    rg->offset = rg->length = -1;
+    rg->match[0] = '\0';
+    if (fields >= 3)
+    {
+        rg->offset = len;
+        rg->length = fields == 4 ? arg2 : -1;
+        if (rg->offset < 0 || (fields == 4 && rg->length < 0))
+            return "ERR bad range\n";
+        return NULL;
+    }
+    char opt[16];
+    int n = sscanf(line, "%*s %*s %15s %63s", opt, rg->match);
+    if (n <= 0)
+        return NULL;
+    if (n != 2 || strcmp(opt, "IF-NONE-MATCH") != 0)
+    {
+        rg->match[0] = '\0';
+        return "ERR bad header\n";
+    }
+    // A legacy reply has no header that could say the body was left out
+    if (!persistent)
+        return "ERR session required\n";
+    return NULL;
+}
+
+// Clip rg against total and format the reply header. Returns -1 (with an
+// ERR line in hdr) when the offset lies past the end of the file.
+static int resolve_range(struct read_range *rg, const char *filename, long long total,
+                         const char *tag, char *hdr, size_t cap)
+{
+    if (rg->offset > total)
+    {
+        snprintf(hdr, cap, "ERR range not satisfiable %lld\n", total);
+        return -1;
+    }
+    if (rg->length < 0 || rg->length > total - rg->offset)
+        rg->length = total - rg->offset;
+    snprintf(hdr, cap, "OK RANGE %s %lld %lld %lld %s\n", filename, rg->offset, rg->length, total,
+             tag);
+    return 0;
+}
+
+// Binary READ replies carry a CRC when the data passes through memory
+// anyway: from the cache (summed here) or framed (summed as it is sent).
+// Replies from disk carry one only if the request set BF_FLAG_CRC, since
+// summing them costs the copy sendfile() saves (see crc_sent).
+static void bin_read_crc(struct session *ss, const struct cache_entry *ce, long long offset,
+                         long long len)
+{
+    ss->crc_on = ss->binary && (ce || ss->compress || ss->crc_want);
+    ss->crc = crc32(0L, Z_NULL, 0);
+    if (ss->crc_on && ce && !ss->compress)
+        for (long long done = 0; done < len;)
+        {
+            uInt n = len - done > (1 << 30) ? 1u << 30 : (uInt)(len - done);
+            ss->crc = crc32(ss->crc, (const Bytef *)ce->data + offset + done, n);
+            done += n;
+        }
+}
+
+// Handle READ command for one client. No lock is taken: the open fd
+// pins the published version even if a writer renames a new one over it.
+static int handle_read(struct session *ss, const char *filename, struct read_range *rg)
+{
+    int connection = ss->fd;
+
+    // Hot files are answered from memory without touching the disk
+    unsigned long gen = 0;
+    struct cache_entry *ce = cache_lookup(filename, &gen);
+    FILE *in = NULL;
+    long long total;
+    char tag[TAG_LEN];
+
+    if (ce)
+    {
+        total = (long long)ce->size;
+        snprintf(tag, sizeof(tag), "%s", ce->tag);
+
+        // Test
+        if (g_conf.test_delays)
+            printf("[T%lu] reading cached %s\n", (unsigned long)pthread_self(), filename);
+    }
+    else
+    {
+        // Buffer path
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+
+        // Open file for reading
+        in = fopen(path, "rb");
+
+        if (!in)
+        {
+            // Send error to client
+            return session_reply(ss, "ERR file not found\n");
+        }
+
+        // Test
+        if (g_conf.test_delays)
+            printf("[T%lu] reading snapshot of %s\n", (unsigned long)pthread_self(), filename);
+
+        struct stat st;
+        if (fstat(fileno(in), &st) < 0)
+        {
+            fclose(in);
+            return session_reply(ss, "ERR cannot read file\n");
+        }
+        total = (long long)st.st_size;
+        file_tag(&st, tag, sizeof(tag));
+
+        // Small regular files are loaded whole and kept for the next reader
+        if (S_ISREG(st.st_mode) && cache_admits(total) &&
+            (ce = cache_fill(filename, fileno(in), (size_t)total, tag, gen)) != NULL)
+        {
+            fclose(in);
+            in = NULL;
+        }
+    }
+
+    // Test
+    test_delay(200);
+
+    char hdr[1024];
+    long long offset = 0, remaining = -1;
+    int rc = 0;
+    uint64_t started = hist_now_us();
+
+    if (rg->match[0] && strcmp(rg->match, tag) == 0)
+    {
+        // The client's copy is current: one line and no body
+        STAT_ADD(not_modified, 1);
+        snprintf(hdr, sizeof(hdr), "OK NOTMODIFIED %s %s\n", filename, tag);
+        rc = session_reply(ss, hdr) < 0 ? -1 : 0;
+        if (ce)
+            cache_put(ce);
+        if (in)
+            fclose(in);
+        return rc;
+    }
+
+    if (rg->offset >= 0)
+    {
+        // Range replies carry offset, length and total size in every mode
+        if (resolve_range(rg, filename, total, tag, hdr, sizeof(hdr)) < 0)
+            rc = 1;
+        else if (in && fseeko(in, (off_t)rg->offset, SEEK_SET) < 0)
+        {
+            snprintf(hdr, sizeof(hdr), "ERR cannot read file\n");
+            rc = 1;
+        }
+        else
+        {
+            offset = rg->offset;
+            remaining = rg->length;
+        }
+        if (rc == 0)
+            bin_read_crc(ss, ce, offset, remaining);
+        if ((rc == 0 ? session_reply_data(ss, hdr, remaining) : session_reply(ss, hdr)) < 0)
+            rc = -1;
+    }
+    else if (ss->persistent)
+    {
+        // Session replies carry the size so the next reply can follow, and
+        // the version tag for a later READ IF-NONE-MATCH
+        remaining = total;
+        snprintf(hdr, sizeof(hdr), "OK READ %s %lld %s\n", filename, remaining, tag);
+        bin_read_crc(ss, ce, 0, remaining);
+        if (session_reply_data(ss, hdr, remaining) < 0)
+            rc = -1;
+    }
+
+    // A short session reply (send error) leaves the stream out of sync
+    if (rc == 0 && ss->compress)
+        rc = stream_frames(ss, ce ? ce->data + offset : NULL, in,
+                           ce && remaining < 0 ? (long long)ce->size : remaining);
+    else if (rc == 0 && ce)
+    {
+        const char *data = ce->data + offset;
+        size_t left = (size_t)(remaining >= 0 ? remaining : total);
+        while (rc == 0 && left > 0)
+        {
+            size_t n = shape_cap(ss->shape, left);
+            shape_sleep(ss->shape);
+            rc = send_all(connection, data, n);
+            if (rc == 0)
+            {
+                STAT_ADD(bytes_out, n);
+                session_moved(ss, n);
+            }
+            data += n;
+            left -= n;
+        }
+    }
+    else if (rc == 0 && stream_file(ss, in, remaining) != 0)
+        rc = -1;
+    if (rc == 0 && remaining > 0 && session_reply_end(ss, remaining) < 0)
+        rc = -1;
+    if (rc == 0)
+        hist_record(&g_stats.transfer, hist_now_us() - started);
+
+    // Release file or cache entry
+    if (ce)
+        cache_put(ce);
+    if (in)
+        fclose(in);
+    return rc < 0 ? -1 : 0;
+}
+
+// write() the whole buffer; returns 0 or the errno that stopped it
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return errno;
+        if (w == 0)
+            return EIO;
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+#define SPLICE_CHUNK (1 << 20) // bytes per socket -> pipe splice()
+
+// Staging pipe for splice(); grown so one call can move SPLICE_CHUNK
+static int open_splice_pipe(int fds[2], int flags)
+{
+    if (pipe2(fds, O_CLOEXEC | flags) < 0)
+        return -1;
+    fcntl(fds[1], F_SETPIPE_SZ, SPLICE_CHUNK); // best effort; default is 64 KB
+    return 0;
+}
+
+// Move len bytes already sitting in the pipe into out. The pipe is
+// always left empty so it can be reused. Returns 0 or an errno.
+static int pipe_to_file(int pipe_r, int out, size_t len, int *no_splice)
+{
+    int err = 0;
+    while (len > 0 && !*no_splice)
+    {
+        ssize_t m = splice(pipe_r, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0 && errno == EINVAL)
+        {
+            *no_splice = 1; // target can't take splice: copy the rest
+            break;
+        }
+        if (m <= 0)
+        {
+            err = m < 0 ? errno : EIO;
+            break;
+        }
+        len -= (size_t)m;
+    }
+
+    // Whatever is still in the pipe is copied, or dropped after an error
+    char buf[65536];
+    while (len > 0)
+    {
+        ssize_t n = read(pipe_r, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return err ? err : EIO;
+        if (err == 0)
+            err = write_all(out, buf, (size_t)n);
+        len -= (size_t)n;
+    }
+    return err;
+}
+
+// Compressed counterpart of receive_payload: decode frames until len raw
+// bytes (< 0: until the client half-closes between frames) are in. A
+// frame that overruns len or fails to decode (or a socket error) gets
+// "ERR bad frame" and ends the connection like a socket error.
+static long long receive_frames(struct session *ss, int out, long long len, int *werr)
+{
+    char buf[ZFRAME_BLOCK];
+    long long remaining = len;
+    while (remaining != 0)
+    {
+        size_t wire;
+        shape_sleep(ss->shape);
+        ssize_t r = connbuf_read_frame(&ss->cb, &ss->zc, buf, &wire);
+        if (r > 0 && remaining > 0 && r > remaining)
+            r = -1;
+        if (r < 0)
+        {
+            session_reply(ss, "ERR bad frame\n"); // the stream can't be resynced
+            return -1;
+        }
+        if (r == 0)
+            return remaining > 0 ? remaining : 0;
+        if (ss->crc_on)
+            ss->crc = crc32(ss->crc, (const Bytef *)buf, (uInt)r);
+        if (out >= 0 && *werr == 0)
+            *werr = write_all(out, buf, (size_t)r);
+        STAT_ADD(bytes_in, r);
+        session_moved(ss, (size_t)r);
+        STAT_ADD(comp_raw, r);
+        STAT_ADD(comp_wire, wire);
+        if (remaining > 0)
+            remaining -= r;
+    }
+    return 0;
+}
+
+/*
+ * Move a WRITE payload from the connection into out (-1 = discard).
+ * Bytes already in the connbuf are written first; the rest goes
+ * socket -> pipe -> file with splice() so it never passes through user
+ * space. Without splice support the recv/write loop is used. After a
+ * file error (*werr set) the rest of the payload is still read and
+ * dropped so the client gets a reply and a session stays in sync.
+ * len < 0 reads to EOF. Returns bytes that never arrived (0 when
+ * complete) or -1 on a socket error.
+ */
+static long long receive_payload(struct session *ss, int out, long long len, int *werr)
+{
+    if (ss->compress)
+        return receive_frames(ss, out, len, werr);
+
+    char buf[65536];
+    long long remaining = len;
+
+    // Payload that arrived with the header is already in cb; drain it first
+    while (remaining != 0 && connbuf_pending(&ss->cb) > 0)
+    {
+        size_t want = sizeof(buf);
+        if (remaining > 0 && (long long)want > remaining)
+            want = (size_t)remaining;
+        ssize_t r = connbuf_read(&ss->cb, buf, want);
+        if (ss->crc_on)
+            ss->crc = crc32(ss->crc, (const Bytef *)buf, (uInt)r);
+        if (out >= 0 && *werr == 0)
+            *werr = write_all(out, buf, (size_t)r);
+        STAT_ADD(bytes_in, r);
+        session_moved(ss, (size_t)r);
+        if (remaining > 0)
+            remaining -= r;
+    }
+
+    if (out >= 0 && ss->pipefd[0] < 0 && !ss->no_splice &&
+        open_splice_pipe(ss->pipefd, 0) < 0)
+        ss->no_splice = 1;
+
+    // A checksummed payload has to pass through memory
+    while (remaining != 0 && out >= 0 && *werr == 0 && !ss->no_splice && !ss->crc_on)
+    {
+        size_t want = shape_cap(ss->shape, SPLICE_CHUNK);
+        if (remaining > 0 && (long long)want > remaining)
+            want = (size_t)remaining;
+        shape_sleep(ss->shape);
+        ssize_t n = splice(ss->fd, NULL, ss->pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            ss->no_splice = 1; // socket type can't splice: use the loop below
+            break;
+        }
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return remaining > 0 ? remaining : 0;
+
+        *werr = pipe_to_file(ss->pipefd[0], out, (size_t)n, &ss->no_splice);
+        STAT_ADD(bytes_in, n);
+        session_moved(ss, (size_t)n);
+        if (remaining > 0)
+            remaining -= n;
+    }
+
+    // Buffered path: no splice, or discarding after an error
+    while (remaining != 0)
+    {
+        size_t want = sizeof(buf);
+        if (remaining > 0 && (long long)want > remaining)
+            want = (size_t)remaining;
+        shape_sleep(ss->shape);
+        ssize_t r = connbuf_read(&ss->cb, buf, want);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            return remaining > 0 ? remaining : 0;
+        if (ss->crc_on)
+            ss->crc = crc32(ss->crc, (const Bytef *)buf, (uInt)r);
+        if (out >= 0 && *werr == 0)
+            *werr = write_all(out, buf, (size_t)r);
+        STAT_ADD(bytes_in, r);
+        session_moved(ss, (size_t)r);
+        if (remaining > 0)
+            remaining -= r;
+    }
+    return 0;
+}
+
+// Binary WRITE payloads end with a trailer: check it against the CRC
+// summed while receiving. Returns 0, or -1 if the client went away;
+// a mismatch sets *werr to EBADMSG so nothing is published.
+static int receive_trailer(struct session *ss, long long len, int *werr)
+{
+    int crc_on = ss->crc_on;
+    ss->crc_on = 0;
+    if (!ss->binary || len <= 0)
+        return 0;
+    unsigned char tr[BFRAME_TRAILER];
+    if (connbuf_read_full(&ss->cb, tr, sizeof(tr)) != 1)
+        return -1;
+    if (crc_on && bframe_get_crc(tr) != (uint32_t)ss->crc && *werr == 0)
+        *werr = EBADMSG;
+    return 0;
+}
+
+// Handle WRITE (or DELTA) command for one client. len < 0 means "not given in the header".
+#define WRITER_PROBE_MS 1000 // how often a queued worker checks its client is still there
+
+// Queue for filename's write lock, keeping the client posted on its place
+// in line. Returns 0 once the lock is ours, -1 if the client went away.
+static int session_writer_wait(struct session *ss, struct file_lock *lk, const char *filename)
+{
+    int connection = ss->fd;
+
+    /*
+     * Part 3: Real-time notifications when file is already being edited.
+     * A busy file puts us in its writer queue; the client hears its place
+     * in line once and again whenever it moves up, and the lock is handed
+     * over the moment the previous writer releases it.
+     */
+    uint64_t queued = hist_now_us();
+    pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+    struct lock_waiter w = {.cv = &cv};
+    int pos = writer_acquire(lk, &w);
+    while (pos != 0)
+    {
+        // A reset connection gives up its place; a half-closed one may still
+        // carry a legacy payload and keeps it
+        struct pollfd pfd = {.fd = connection};
+        char note[1024];
+        snprintf(note, sizeof(note), "NOTIFY BUSY %s %d\n", filename, pos);
+        if ((pos > 0 && session_reply(ss, note) < 0) ||
+            (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLHUP))))
+        {
+            writer_cancel(lk, &w); // client went away while waiting
+            pthread_cond_destroy(&cv);
+            return -1;
+        }
+        pos = writer_wait(lk, &w, WRITER_PROBE_MS);
+    }
+    pthread_cond_destroy(&cv);
+    hist_record(&g_stats.lock_wait, hist_now_us() - queued);
+    return 0;
+}
+
+static int handle_write(struct session *ss, struct file_lock *lk, const char *filename,
+                        const char *confirmation, long long len, int delta)
+{
+    int connection = ss->fd;
+
+    // Test
+    printf("[T%lu] waiting WRLOCK %s\n", (unsigned long)pthread_self(), filename);
+    if (session_writer_wait(ss, lk, filename) < 0)
+        return -1;
+
+    printf("[T%lu] acquired WRLOCK %s\n", (unsigned long)pthread_self(), filename);
+
+    // Tell client it can start sending file contents now
+    struct delta_base base = {.fd = -1};
+    if (delta)
+    {
+        // A delta upload first needs the signatures of what it replaces
+        size_t mlen;
+        char *msg = delta_offer(filename, &base, &mlen);
+        if (!msg)
+        {
+            if (base.fd >= 0)
+                close(base.fd);
+            writer_release(lk);
+            session_reply(ss, "ERR cannot read file\n");
+            return -1;
+        }
+        send_all(connection, msg, mlen);
+        free(msg);
+    }
+    else
+    {
+        char ok[1024];
+        snprintf(ok, sizeof(ok), "OK WRITE %s\n", filename);
+        session_reply(ss, ok);
+    }
+
+    // Interactive session writes (and every delta) announce the size, or
+    // cancel, once they hold the lock
+    if ((ss->persistent && len < 0) || delta)
+    {
+        char line[1024];
+        int got = connbuf_getline(&ss->cb, line, sizeof(line));
+        if (got > 0 && strcmp(line, "ABORT") == 0)
+        {
+            if (base.fd >= 0)
+                close(base.fd);
+            writer_release(lk);
+            return session_reply(ss, "OK ABORT\n");
+        }
+        if (got <= 0 || sscanf(line, "SIZE %lld", &len) != 1 || len < 0)
+        {
+            if (base.fd >= 0)
+                close(base.fd);
+            writer_release(lk);
+            if (got > 0)
+                session_reply(ss, "ERR bad size\n");
+            return -1;
+        }
+    }
+
+    // Stage the upload next to the target; readers keep the old version meanwhile.
+    // A delta is staged on its own and rebuilt into the upload once complete.
+    char tmp[1024];
+    int out = delta ? delta_stage_open() : upload_open(filename, tmp, sizeof(tmp));
+    int werr = 0;
+
+    if (out < 0)
+    {
+        perror("Failed to open the file in the server");
+        // The payload is still consumed so the client gets the error reply
+    }
+    else
+    {
+        // Print where the server is saving the file
+        printf("Saving to '%s/%s'...\n", SHARED_DIR, filename);
+    }
+
+    uint64_t started = hist_now_us();
+    long long missing = receive_payload(ss, out, len, &werr);
+    if (missing == 0 && receive_trailer(ss, len, &werr) < 0)
+        missing = -1;
+    if (missing == 0)
+        hist_record(&g_stats.transfer, hist_now_us() - started);
+
+    // A delta becomes a staged upload like any other once it is applied
+    int staged = !delta;
+    if (delta && out >= 0 && missing == 0 && werr == 0)
+        staged = (werr = delta_rebuild(filename, &base, out, tmp, sizeof(tmp))) == 0;
+    if (base.fd >= 0)
+        close(base.fd);
+
+    // Close output file; a failed close can be a deferred write error
+    if (out >= 0 && close(out) < 0 && werr == 0)
+        werr = errno;
+
+    // Publish atomically only a complete upload, while writers are still serialized
+    if (out >= 0 && staged)
+    {
+        int err = upload_finish(filename, tmp, missing == 0 && werr == 0);
+        if (err && werr == 0)
+            werr = err;
+    }
+
+    // Release write lock after finishing write
+    writer_release(lk);
+
+    if (missing != 0)
+    {
+        printf("Client left before sending all of '%s'\n", filename);
+        return -1;
+    }
+    if (out < 0)
+        return session_reply(ss, "ERR cannot open file\n");
+    if (werr == -1)
+        return session_reply(ss, "ERR delta mismatch\n");
+    if (werr == EBADMSG)
+        return session_reply(ss, "ERR checksum mismatch\n");
+    if (werr)
+    {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "ERR write failed: %s\n", strerror(werr));
+        fprintf(stderr, "Write of '%s' failed: %s\n", filename, strerror(werr));
+        return session_reply(ss, msg);
+    }
+
+    // Send confirmation to client
+    if (session_reply(ss, confirmation) < 0)
+    {
+        perror("Confirmation");
+        return -1;
+    }
+
+    printf("Client done: file '%s' received\n", filename);
+    return 0;
+}
+
+// PUT / CHUNK / COMMIT (see put_begin). arg is the token for CHUNK and
+// COMMIT, the file name for PUT; a and b are the numbers that followed.
+static int handle_upload(struct session *ss, const char *cmd, const char *arg, long long a,
+                         long long b, const char *confirmation)
+{
+    char err[64];
+    if (strcmp(cmd, "PUT") == 0)
+    {
+        if (ss->put)
+            return session_reply(ss, "ERR upload in progress\n");
+        if (a < 0 || b <= 0)
+            return session_reply(ss, "ERR bad size\n");
+        struct file_lock *lk = file_lock_get(arg);
+        if (!lk)
+            return -1;
+        STAT_ADD(writes, 1);
+        printf("[T%lu] waiting WRLOCK %s\n", (unsigned long)pthread_self(), arg);
+        if (session_writer_wait(ss, lk, arg) < 0)
+        {
+            file_lock_put(lk);
+            return -1;
+        }
+        printf("[T%lu] acquired WRLOCK %s\n", (unsigned long)pthread_self(), arg);
+        if (!(ss->put = put_begin(arg, lk, a, b)))
+        {
+            int e = errno;
+            writer_release(lk);
+            file_lock_put(lk);
+            return session_reply(ss, e == EINVAL ? "ERR bad size\n" : "ERR cannot open file\n");
+        }
+        printf("Saving to '%s/%s' in %zu chunks...\n", SHARED_DIR, arg, ss->put->nchunks);
+        char ok[1024];
+        snprintf(ok, sizeof(ok), "OK PUT %s %s\n", arg, ss->put->token);
+        return session_reply(ss, ok);
+    }
+
+    if (strcmp(cmd, "CHUNK") == 0)
+    {
+        if (b < 0)
+        {
+            session_reply(ss, "ERR bad size\n");
+            return -1; // can't tell where the payload ends
+        }
+        struct put_txn *t = NULL;
+        const char *refused = NULL;
+        int out = put_chunk_open(arg, a, b, &t, &refused);
+        int werr = 0;
+        long long missing = receive_payload(ss, out, b, &werr); // consumed even if refused
+        if (out >= 0 && close(out) < 0 && werr == 0)
+            werr = errno;
+        if (t)
+            put_chunk_done(t, a, missing == 0 && werr == 0);
+        if (missing != 0)
+            return -1;
+        if (refused)
+            return session_reply(ss, refused);
+        if (werr)
+        {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "ERR write failed: %s\n", strerror(werr));
+            return session_reply(ss, msg);
+        }
+        snprintf(err, sizeof(err), "OK CHUNK %lld\n", a);
+        return session_reply(ss, err);
+    }
+
+    // COMMIT: only the session that started the upload may publish it
+    if (!ss->put || strcmp(ss->put->token, arg) != 0)
+        return session_reply(ss, "ERR unknown upload\n");
+    struct put_txn *t = ss->put;
+    int rc = put_commit(t, err, sizeof(err));
+    if (rc < 0)
+        return session_reply(ss, err);
+    char msg[1024];
+    if (rc)
+        snprintf(msg, sizeof(msg), "ERR write failed: %s\n", strerror(rc));
+    else
+        printf("Client done: file '%s' received\n", t->filename);
+    ss->put = NULL;
+    put_unref(t);
+    return session_reply(ss, rc ? msg : confirmation);
+}
+
+/*
+ * Batch upload: "BATCH <count>", then <count> times "FILE <name> <len>"
+ * followed by <len> payload bytes, with no reply in between. Each file is
+ * stored under its own write lock and published on its own, exactly like
+ * a WRITE; a file that fails is skipped without disturbing the rest. The
+ * one reply comes at the end:
+ *   OK BATCH <count> <stored>\n, then "<name> OK" or "<name> ERR <why>" per file
+ * so thousands of small files cost one round trip instead of one each.
+ */
+#define BATCH_MAX (1 << 20)
+
+// Status lines for a batch reply, grown as files are stored
+struct batch_status
+{
+    char *buf;
+    size_t len, cap;
+    long long count, stored;
+};
+
+// Record one file's outcome; msg is the reply a WRITE would have got
+static int batch_note(struct batch_status *bs, const char *filename, const char *msg)
+{
+    int ok = strcmp(msg, "File Received by server\n") == 0;
+    size_t need = strlen(filename) + strlen(msg) + 8;
+    if (bs->len + need > bs->cap)
+    {
+        size_t cap = bs->cap ? bs->cap * 2 : 4096;
+        while (cap < bs->len + need)
+            cap *= 2;
+        char *p = realloc(bs->buf, cap);
+        if (!p)
+            return -1;
+        bs->buf = p;
+        bs->cap = cap;
+    }
+    bs->len += (size_t)snprintf(bs->buf + bs->len, bs->cap - bs->len, "%s %s", filename,
+                                ok ? "OK\n" : msg);
+    bs->stored += ok;
+    return 0;
+}
+
+// Build "OK BATCH ..." followed by the status lines. Returns a malloc'd,
+// NUL-terminated reply (length in *len), or NULL.
+static char *batch_reply(const struct batch_status *bs, size_t *len)
+{
+    char hdr[64];
+    int hl = snprintf(hdr, sizeof(hdr), "OK BATCH %lld %lld\n", bs->count, bs->stored);
+    char *msg = malloc((size_t)hl + bs->len + 1);
+    if (!msg)
+        return NULL;
+    memcpy(msg, hdr, (size_t)hl);
+    if (bs->len)
+        memcpy(msg + hl, bs->buf, bs->len);
+    *len = (size_t)hl + bs->len;
+    msg[*len] = '\0';
+    return msg;
+}
+
+// Store one batch file; msg gets its WRITE-style outcome. Returns -1 if
+// the client went away mid-payload.
+static int batch_store(struct session *ss, const char *filename, long long len, char *msg,
+                       size_t cap)
+{
+    if (!valid_filename(filename))
+    {
+        int werr = 0;
+        snprintf(msg, cap, "ERR invalid filename\n");
+        return receive_payload(ss, -1, len, &werr) == 0 ? 0 : -1;
+    }
+    struct file_lock *lk = file_lock_get(filename);
+    if (!lk)
+        return -1;
+    STAT_ADD(writes, 1);
+    if (session_writer_wait(ss, lk, filename) < 0)
+    {
+        file_lock_put(lk);
+        return -1;
+    }
+
+    char tmp[1024];
+    int out = upload_open(filename, tmp, sizeof(tmp));
+    int werr = out < 0 ? errno : 0;
+    uint64_t started = hist_now_us();
+    long long missing = receive_payload(ss, out, len, &werr);
+    if (missing == 0)
+        hist_record(&g_stats.transfer, hist_now_us() - started);
+    if (out >= 0 && close(out) < 0 && werr == 0)
+        werr = errno;
+    if (out >= 0)
+    {
+        int err = upload_finish(filename, tmp, missing == 0 && werr == 0);
+        if (err && werr == 0)
+            werr = err;
+    }
+    writer_release(lk);
+    file_lock_put(lk);
+
+    if (out < 0)
+        snprintf(msg, cap, "ERR cannot open file\n");
+    else if (werr)
+        snprintf(msg, cap, "ERR write failed: %s\n", strerror(werr));
+    else
+        snprintf(msg, cap, "File Received by server\n");
+    return missing == 0 ? 0 : -1;
+}
+
+static int handle_batch(struct session *ss, long long count)
+{
+    struct batch_status bs = {.count = count};
+    int rc = -1;
+    for (long long i = 0; i < count; i++)
+    {
+        char line[1024], filename[512], msg[256];
+        long long len;
+        if (connbuf_getline(&ss->cb, line, sizeof(line)) <= 0)
+            goto out;
+        if (sscanf(line, "FILE %511s %lld", filename, &len) != 2 || len < 0)
+        {
+            session_reply(ss, "ERR bad batch\n"); // can't tell where the next file starts
+            goto out;
+        }
+        if (batch_store(ss, filename, len, msg, sizeof(msg)) < 0)
+        {
+            printf("Client left before sending all of '%s'\n", filename);
+            goto out;
+        }
+        if (batch_note(&bs, filename, msg) < 0)
+            goto out;
+    }
+
+    size_t mlen;
+    char *msg = batch_reply(&bs, &mlen);
+    if (msg)
+    {
+        printf("Batch done: %lld of %lld files received\n", bs.stored, bs.count);
+        stats_reply(msg);
+        rc = send_all(ss->fd, msg, mlen);
+        free(msg);
+    }
+out:
+    free(bs.buf);
+    return rc;
+}
+
+// Run one command line. Returns 0 to keep the session, -1 to close it.
+static int session_command(struct session *ss, const char *line)
+{
+    const char *confirmation = "File Received by server\n";
+    int fail = ss->persistent ? 0 : -1; // errors only end legacy connections
+
+    // Parse header into cmd, filename and optional numbers:
+    // WRITE <name> [len], READ <name> [offset [length]]
+    char cmd[16], filename[512];
+    long long len = -1, arg2 = -1;
+    int fields = sscanf(line, "%15s %511s %lld %lld", cmd, filename, &len, &arg2);
+    if (fields < 2)
+    {
+        session_reply(ss, "ERR bad header\n");
+        return fail;
+    }
+
+    // BATCH <count>: the file names come with each file
+    if (strcmp(cmd, "BATCH") == 0)
+    {
+        long long count = strtoll(filename, NULL, 10);
+        if (count < 0 || count > BATCH_MAX)
+        {
+            session_reply(ss, "ERR bad batch\n");
+            return -1; // the files that follow can't be skipped safely
+        }
+        uint64_t started = hist_now_us();
+        int rc = handle_batch(ss, count);
+        hist_record(&g_stats.request, hist_now_us() - started);
+        return ss->persistent ? rc : -1;
+    }
+
+    // Reject unsafe filenames
+    if (!valid_filename(filename))
+    {
+        session_reply(ss, "ERR invalid filename\n");
+        return fail;
+    }
+
+    // Chunked uploads span several connections, so they need sessions
+    if (strcmp(cmd, "PUT") == 0 || strcmp(cmd, "CHUNK") == 0 || strcmp(cmd, "COMMIT") == 0)
+    {
+        if (!ss->persistent)
+        {
+            session_reply(ss, "ERR session required\n");
+            return fail;
+        }
+        uint64_t started = hist_now_us();
+        int rc = handle_upload(ss, cmd, filename, len, arg2, confirmation);
+        hist_record(&g_stats.request, hist_now_us() - started);
+        return rc;
+    }
+
+    // If command is not READ, WRITE or DELTA
+    if (strcmp(cmd, "READ") != 0 && strcmp(cmd, "WRITE") != 0 && strcmp(cmd, "DELTA") != 0)
+    {
+        session_reply(ss, "ERR unknown command. Use READ or WRITE\n");
+        return fail;
+    }
+
+    uint64_t started = hist_now_us();
+
+    // Call Read handler (lock-free snapshot read)
+    if (strcmp(cmd, "READ") == 0)
+    {
+        STAT_ADD(reads, 1);
+        struct read_range rg;
+        const char *err = read_args(line, fields, len, arg2, ss->persistent, &rg);
+        if (err)
+        {
+            session_reply(ss, err);
+            return fail;
+        }
+        int rc = handle_read(ss, filename, &rg);
+        hist_record(&g_stats.request, hist_now_us() - started);
+        return ss->persistent ? rc : -1;
+    }
+
+    // Legacy WRITE payloads always run to end of stream; deltas always send SIZE
+    int delta = strcmp(cmd, "DELTA") == 0;
+    if (!ss->persistent || delta)
+        len = -1;
+
+    // Per-file lock entry, referenced until the writer has released it
+    struct file_lock *lk = file_lock_get(filename);
+    if (!lk)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    // Call Write handler
+    STAT_ADD(writes, 1);
+    int rc = handle_write(ss, lk, filename, confirmation, len, delta);
+    hist_record(&g_stats.request, hist_now_us() - started);
+
+    file_lock_put(lk);
+    return ss->persistent ? rc : -1;
+}
+
+// STATS, LIST and STAT are answered from memory, in any mode (after HELLO)
+static int info_command(const char *line)
+{
+    return strcmp(line, "STATS") == 0 || strncmp(line, "STAT ", 5) == 0 ||
+           (strncmp(line, "LIST", 4) == 0 && (line[4] == '\0' || line[4] == ' '));
+}
+
+// Returns a malloc'd reply (length in *len): a status line, followed by
+// a body for STATS and LIST. NULL if out of memory.
+static char *info_reply(const char *line, size_t *len)
+{
+    if (strcmp(line, "STATS") == 0)
+        return stats_reply_text(len);
+    char one[1024], filename[512], extra[2];
+    const char *err = one;
+    char *msg = NULL;
+    if (strncmp(line, "LIST", 4) == 0)
+        msg = index_list_reply(line + 4, len, &err);
+    else if (sscanf(line, "STAT %511s %1s", filename, extra) != 1)
+        err = "ERR bad header\n";
+    else if (!valid_filename(filename))
+        err = "ERR invalid filename\n";
+    else
+        index_stat_reply(filename, one, sizeof(one));
+    if (!msg && (msg = strdup(err)))
+        *len = strlen(msg);
+    return msg;
+}
+
+static int session_info(struct session *ss, const char *line)
+{
+    size_t len;
+    char *msg = info_reply(line, &len);
+    if (!msg)
+        return session_reply(ss, "ERR out of memory\n");
+    size_t hl = strcspn(msg, "\n") + 1;
+    int rc;
+    if (hl >= len)
+        rc = session_reply(ss, msg);
+    else if (ss->binary)
+    {
+        // "OK STATS <len>" / "OK LIST ..." becomes the frame, the lines its payload
+        ss->crc_on = 1;
+        ss->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)msg + hl, (uInt)(len - hl));
+        rc = session_reply_data(ss, msg, (long long)(len - hl));
+        if (rc == 0)
+            rc = send_all(ss->fd, msg + hl, len - hl);
+        if (rc == 0)
+            rc = session_reply_end(ss, (long long)(len - hl));
+        ss->crc_on = 0;
+    }
+    else
+        rc = send_all(ss->fd, msg, len);
+    free(msg);
+    return rc;
+}
+
+// WATCH: the watch thread takes the connection over, together with
+// whatever the client pipelined behind the command. Returns 1 once it
+// is gone, -1 if the session has to end here.
+static int session_watch(struct session *ss, const char *line)
+{
+    if (!ss->persistent)
+    {
+        session_reply(ss, "ERR session required\n");
+        return -1;
+    }
+    if (watch_adopt(ss->fd, line, ss->cb.buf + ss->cb.start, connbuf_pending(&ss->cb), "", 0) < 0)
+        return -1; // shutting down
+    return 1;
+}
+
+// Read one binary request and run it as the equivalent text command.
+// Returns 0 to keep the session, -1 to close it.
+static int session_binary(struct session *ss)
+{
+    unsigned char hdr[BFRAME_HDR];
+    char meta[BFRAME_META_MAX + 1], line[BFRAME_META_MAX + 64];
+    struct bframe f;
+    if (connbuf_read_full(&ss->cb, hdr, sizeof(hdr)) != 1)
+        return -1;
+    if (bframe_unpack(hdr, &f) < 0 || connbuf_read_full(&ss->cb, meta, f.meta_len) != 1 ||
+        (f.payload_len > 0 && f.code != BF_WRITE))
+    {
+        session_reply(ss, "ERR bad frame\n"); // can't find the next request
+        return -1;
+    }
+    meta[f.meta_len] = '\0';
+
+    static const char *const names[] = {
+        [BF_READ] = "READ", [BF_WRITE] = "WRITE", [BF_STATS] = "STATS",
+        [BF_QUIT] = "QUIT", [BF_LIST] = "LIST",   [BF_STAT] = "STAT",
+    };
+    snprintf(line, sizeof(line), "%s %s",
+             f.code < sizeof(names) / sizeof(names[0]) && names[f.code] ? names[f.code] : "?",
+             meta);
+    if (conn_begin(&ss->conn, line) < 0)
+        return -1; // shutting down: no new requests
+
+    int rc;
+    switch (f.code)
+    {
+    case BF_QUIT:
+        session_reply(ss, "BYE\n");
+        rc = -1;
+        break;
+    case BF_STATS:
+        rc = session_info(ss, "STATS");
+        break;
+    case BF_LIST:
+    case BF_STAT:
+        snprintf(line, sizeof(line), "%s%s%s", f.code == BF_LIST ? "LIST" : "STAT",
+                 f.meta_len ? " " : "", meta);
+        rc = session_info(ss, line);
+        break;
+    case BF_READ:
+        snprintf(line, sizeof(line), "READ %s", meta);
+        ss->crc_want = (f.flags & BF_FLAG_CRC) != 0;
+        rc = session_command(ss, line);
+        ss->crc_want = 0;
+        break;
+    case BF_WRITE:
+        // The payload length comes from the frame, so the name must be one word
+        if (f.meta_len == 0 || strcspn(meta, " \t\r\n") != f.meta_len || !valid_filename(meta))
+        {
+            // Drop the payload so the next request is found
+            int werr = 0;
+            if (receive_payload(ss, -1, (long long)f.payload_len, &werr) != 0 ||
+                receive_trailer(ss, (long long)f.payload_len, &werr) < 0)
+                rc = -1;
+            else
+                rc = session_reply(ss, "ERR invalid filename\n");
+            break;
+        }
+        snprintf(line, sizeof(line), "WRITE %s %llu", meta, (unsigned long long)f.payload_len);
+        ss->crc_on = (f.flags & BF_FLAG_CRC) != 0;
+        ss->crc = crc32(0L, Z_NULL, 0);
+        rc = session_command(ss, line);
+        break;
+    default:
+        rc = session_reply(ss, "ERR unknown command. Use READ or WRITE\n");
+        break;
+    }
+    return conn_end(&ss->conn, rc < 0) < 0 ? -1 : rc;
+}
+
+// Serve one client connection (runs on a pool worker); accepted_us is
+// when accept() returned it, so the handshake time includes the queue wait
+static void *handle_client(int connection, uint64_t accepted_us)
+{
+    // Line buffer
+    char line[1024];
+
+    struct session *ss = malloc(sizeof(*ss));
+    if (!ss)
+    {
+        close(connection);
+        STAT_ADD(active, -1);
+        return NULL;
+    }
+    ss->fd = connection;
+    ss->persistent = 0;
+    ss->compress = 0;
+    zcodec_init(&ss->zc);
+    ss->client_id[0] = '\0';
+    ss->pipefd[0] = ss->pipefd[1] = -1;
+    ss->no_splice = 0;
+    ss->put = NULL;
+    ss->binary = 0;
+    ss->crc_on = 0;
+    ss->shape = NULL;
+    connbuf_init(&ss->cb, connection);
+    if (conn_register(&ss->conn, connection) < 0)
+    {
+        // Accepted just before shutdown began
+        send_all(connection, "SERVER_SHUTDOWN\n", 16);
+        close(connection);
+        free(ss);
+        STAT_ADD(active, -1);
+        return NULL;
+    }
+
+    // ===== PHASE 1 PARTIAL: HANDSHAKE =====
+    if (connbuf_getline(&ss->cb, line, sizeof(line)) <= 0 ||
+        strncmp(line, "HELLO", 5) != 0)
+    {
+        session_reply(ss, conn_unregister(&ss->conn) ? "SERVER_SHUTDOWN\n"
+                                                     : "ERR Handshake required\n");
+        close(connection);
+        free(ss);
+        STAT_ADD(active, -1);
+        return NULL;
+    }
+    struct hello h;
+    char reply[64];
+    hello_parse(line, &h, reply, sizeof(reply));
+    memcpy(ss->client_id, h.id, sizeof(ss->client_id));
+    ss->shape = shape_get(h.id);
+    ss->persistent = h.persistent;
+    ss->compress = h.compress;
+    session_reply(ss, reply);
+    ss->binary = h.binary; // the handshake reply itself is always text
+    hist_record(&g_stats.handshake, hist_now_us() - accepted_us);
+    // ====================================
+
+    while (ss->binary && session_binary(ss) == 0)
+        ;
+
+    int watching = 0; // 1: the watch thread owns the connection now
+
+    // Read commands until the client quits (legacy clients send exactly one)
+    while (!ss->binary && connbuf_getline(&ss->cb, line, sizeof(line)) > 0)
+    {
+        if (ss->persistent && strcmp(line, "QUIT") == 0)
+        {
+            session_reply(ss, "BYE\n");
+            break;
+        }
+        if (conn_begin(&ss->conn, line) < 0)
+            break; // shutting down: no new commands
+        int rc;
+        if (watch_command(line))
+            rc = watching = session_watch(ss, line);
+        else if (info_command(line))
+            rc = session_info(ss, line) < 0 || !ss->persistent ? -1 : 0;
+        else
+            rc = session_command(ss, line);
+        if (conn_end(&ss->conn, rc < 0) < 0 || rc != 0)
+            break;
+    }
+    if (conn_unregister(&ss->conn) && watching <= 0)
+        send_all(connection, "SERVER_SHUTDOWN\n", 16);
+
+    if (ss->put)
+        put_abort(ss->put);
+    if (ss->pipefd[0] >= 0)
+    {
+        close(ss->pipefd[0]);
+        close(ss->pipefd[1]);
+    }
+    shape_put(ss->shape);
+    zcodec_free(&ss->zc);
+    if (watching <= 0)
+    {
+        close(connection);
+        STAT_ADD(active, -1);
+    }
+    free(ss);
+    return NULL;
+}
+
+/* ============================================================
+ * WORKER POOL (IO_MODE threads)
+ *
+ * POOL_SIZE workers are started up front and fed from a bounded
+ * ring of accepted connections (QUEUE_SIZE). When the ring is full
+ * the accept loop answers "ERR busy, retry" and closes instead of
+ * growing threads without limit.
+ * ============================================================ */
+struct pool_stats
+{
+    unsigned long admitted;  // connections queued for a worker
+    unsigned long rejected;  // connections turned away with ERR busy
+    int depth;               // connections currently queued
+    int max_depth;           // high-water mark of depth
+    double wait_total_ms;    // summed queue wait of dequeued connections
+    double wait_max_ms;      // longest queue wait seen
+};
+
+static struct
+{
+    struct client_ctx *ring;
+    int cap, head, count;
+    int limit; // QUEUE_SIZE: connections allowed to wait beyond idle workers
+    int idle;  // workers blocked waiting for a connection
+    int workers;
+    pthread_mutex_t mu;
+    pthread_cond_t nonempty;
+    struct pool_stats stats;
+} g_pool = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .nonempty = PTHREAD_COND_INITIALIZER,
+};
+
+static double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// Queue an accepted connection; returns -1 if the queue is full
+static int pool_submit(int fd)
+{
+    pthread_mutex_lock(&g_pool.mu);
+    if (g_pool.count >= g_pool.idle + g_pool.limit)
+    {
+        g_pool.stats.rejected++;
+        pthread_mutex_unlock(&g_pool.mu);
+        return -1;
+    }
+    struct client_ctx *slot = &g_pool.ring[(g_pool.head + g_pool.count) % g_pool.cap];
+    slot->fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &slot->queued_at);
+    g_pool.count++;
+
+    g_pool.stats.admitted++;
+    g_pool.stats.depth = g_pool.count;
+    if (g_pool.count > g_pool.stats.max_depth)
+        g_pool.stats.max_depth = g_pool.count;
+
+    pthread_cond_signal(&g_pool.nonempty);
+    pthread_mutex_unlock(&g_pool.mu);
+    return 0;
+}
+
+static void *pool_worker(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&g_pool.mu);
+        g_pool.idle++;
+        while (g_pool.count == 0)
+            pthread_cond_wait(&g_pool.nonempty, &g_pool.mu);
+        g_pool.idle--;
+
+        struct client_ctx ctx = g_pool.ring[g_pool.head];
+        g_pool.head = (g_pool.head + 1) % g_pool.cap;
+        g_pool.count--;
+
+        double waited = elapsed_ms(&ctx.queued_at);
+        g_pool.stats.depth = g_pool.count;
+        g_pool.stats.wait_total_ms += waited;
+        if (waited > g_pool.stats.wait_max_ms)
+            g_pool.stats.wait_max_ms = waited;
+        pthread_mutex_unlock(&g_pool.mu);
+
+        handle_client(ctx.fd, (uint64_t)ctx.queued_at.tv_sec * 1000000u +
+                                  (uint64_t)ctx.queued_at.tv_nsec / 1000u);
+    }
+    return NULL;
+}
+
+// Allocate the queue and start the workers; returns workers started
+static int pool_start(int workers, int queue_cap)
+{
+    // Room for one pending connection per idle worker plus the wait queue
+    g_pool.ring = calloc((size_t)(queue_cap + workers), sizeof(*g_pool.ring));
+    if (!g_pool.ring)
+        return 0;
+    g_pool.cap = queue_cap + workers;
+    g_pool.limit = queue_cap;
+
+    int started = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, pool_worker, NULL) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        pthread_detach(tid);
+        started++;
+    }
+    pthread_mutex_lock(&g_pool.mu);
+    g_pool.workers = started;
+    pthread_mutex_unlock(&g_pool.mu);
+    return started;
+}
+
+// No connection queued or being served
+static int pool_quiet(void)
+{
+    pthread_mutex_lock(&g_pool.mu);
+    int quiet = g_pool.count == 0 && g_pool.idle == g_pool.workers;
+    pthread_mutex_unlock(&g_pool.mu);
+    return quiet;
+}
+
+#define DRAIN_POLL_MS 50
+#define DRAIN_GRACE_MS 1000 // for cut-off workers to notice and clean up
+
+/*
+ * Graceful shutdown (the accept loop has stopped): idle sessions are
+ * told SERVER_SHUTDOWN and closed right away, commands in flight may
+ * finish for up to DRAIN_SECS (a second SIGINT ends the wait), then
+ * the rest are told and cut off. An upload cut off this way is
+ * discarded, never published half written.
+ */
+static void conns_drain(void)
+{
+    uint64_t start = hist_now_us();
+    uint64_t deadline = start + (uint64_t)g_conf.drain_secs * 1000000u;
+    uint64_t cut_us = 0;
+    int reported = 0;
+    while (!pool_quiet())
+    {
+        uint64_t now = hist_now_us();
+        if (!cut_us && (drain_now || now >= deadline))
+            cut_us = now;
+        if (cut_us && now - cut_us >= DRAIN_GRACE_MS * 1000u)
+            break;
+
+        int busy = 0;
+        pthread_mutex_lock(&g_conns.mu);
+        for (struct conn_entry *e = g_conns.head; e; e = e->next)
+        {
+            if (e->closing)
+                continue;
+            if (e->op[0] == '\0')
+            {
+                // Idle: wake the worker, which tells the client on its way out
+                e->closing = 1;
+                shutdown(e->fd, SHUT_RD);
+            }
+            else if (cut_us)
+            {
+                printf("Cutting off %s %s after %llu bytes\n", e->op, e->file,
+                       (unsigned long long)__atomic_load_n(&e->bytes, __ATOMIC_RELAXED));
+                e->closing = 2;
+                send(e->fd, "SERVER_SHUTDOWN\n", 16, MSG_NOSIGNAL | MSG_DONTWAIT);
+                shutdown(e->fd, SHUT_RDWR);
+            }
+            else
+                busy++;
+        }
+        pthread_mutex_unlock(&g_conns.mu);
+        if (busy && !reported)
+        {
+            printf("Draining: waiting up to %d s for %d command(s) in flight\n",
+                   g_conf.drain_secs, busy);
+            reported = 1;
+        }
+        usleep(DRAIN_POLL_MS * 1000);
+    }
+    printf("Drained in %.1f s\n", (double)(hist_now_us() - start) / 1e6);
+}
+
+static void pool_report(void)
+{
+    pthread_mutex_lock(&g_pool.mu);
+    struct pool_stats st = g_pool.stats;
+    unsigned long served = st.admitted - (unsigned long)g_pool.count;
+    pthread_mutex_unlock(&g_pool.mu);
+
+    printf("Pool: admitted %lu, rejected %lu, queue depth %d (max %d), "
+           "queue wait avg %.3f ms (max %.3f ms)\n",
+           st.admitted, st.rejected, st.depth, st.max_depth,
+           served ? st.wait_total_ms / (double)served : 0.0, st.wait_max_ms);
+}
+/* ============================================================ */
+
+/* ============================================================
+ * EPOLL REACTOR (IO_MODE epoll)
+ *
+ * Each reactor thread owns an epoll set and drives its
+ * connections through a small state machine with non-blocking
+ * sockets, so idle or slow clients only cost a struct rconn
+ * instead of a thread stack. A connection stays on the reactor
+ * that accepted it; writers queued on a busy file are woken via
+ * the reactor's eventfd when the writer queue hands them the lock.
+ * The wire protocol, including SESSION mode, is the same as
+ * handle_client's. IO_MODE uring drives the same state machine
+ * with io_uring requests instead (see reactor_ring_main).
+ * ============================================================ */
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_IDLE_MS 500 // wake-up period to notice shutdown
+#define RCONN_CHUNK 16384   // transfer buffer, allocated on demand
+
+enum rconn_state
+{
+    RC_HELLO,      // waiting for "HELLO <id> [SESSION]"
+    RC_HEADER,     // waiting for a command line
+    RC_READ,       // streaming file to client
+    RC_WRITE_WAIT, // WRITE queued behind another writer
+    RC_WRITE_SIZE, // session WRITE without length, or DELTA: waiting for SIZE/ABORT
+    RC_WRITE_RECV, // receiving payload
+    RC_BATCH,      // BATCH: waiting for the next FILE line
+    RC_TRAILER,    // binary WRITE: waiting for the payload's CRC trailer
+    RC_COMMIT,     // upload complete, queued for the commit thread (DURABILITY)
+    RC_FLUSH       // draining queued output, then close
+};
+
+struct rconn
+{
+    int fd;
+    enum rconn_state state;
+    uint32_t events; // current epoll interest
+    int persistent;  // SESSION negotiated in HELLO
+    int compress;    // COMPRESS deflate negotiated in HELLO
+    int binary;      // BINARY negotiated in HELLO: requests and replies are bframes
+    int crc_on;      // current payload (either way) is checksummed into crc
+    int crc_want;    // this binary READ asked for a CRC even if sent with sendfile()
+    uLong crc;
+    long long bin_len; // payload length of the current binary frame; trailer still due if > 0
+    unsigned zstreak; // incompressible blocks in a row (current READ)
+    unsigned char *zin; // compressed WRITE frame being assembled (ZFRAME_MAX)
+    size_t zin_len;
+
+    char in[1024]; // unparsed input: lines and payload that came with them
+    size_t in_len;
+
+    char filename[512];
+    struct file_lock *lock; // referenced for the current command
+    struct lock_waiter waiter; // place in lock's writer queue
+    int locked;
+    int file_fd;
+    char *tmp_path; // WRITE staging file until it is published
+    struct commit_req *commit; // queued for the commit thread, not yet seen done
+    int delta;      // current write is a DELTA: file_fd stages the delta
+    struct delta_base base; // DELTA: the version being replaced
+    int putting;            // current write is a PUT of put_size in put_chunk pieces
+    long long put_size, put_chunk;
+    struct put_txn *put;   // chunked upload started here, not yet committed
+    int chunking;          // current write is a CHUNK
+    struct put_txn *chunk; // its upload (NULL if refused), chunk_idx its index
+    long long chunk_idx;
+    const char *refused;   // current payload is consumed but refused: the reply
+    struct batch_status *batch; // BATCH in progress, batch_left files to come
+    long long batch_left;
+    long long remaining; // READ/WRITE bytes left, -1 = until EOF
+    int discard;         // WRITE payload is consumed but not stored
+    int werr;            // first error writing the payload, reported at the end
+    int zero_copy;       // READ of a regular file: sendfile() instead of read()+send()
+    struct cache_entry *cache; // READ served from the content cache
+    size_t cache_off;          // next byte of cache->data to send
+
+    // IO_MODE uring: while ring_ops > 0 the kernel owns in, out or rbuf,
+    // so nothing else may touch the connection
+    int ring_ops;
+    int ring_slot;          // fixed-file slot of fd, -1 = not registered
+    int ring_eof;           // a ring read or receive hit end of file
+    int ring_err;           // a ring request failed: close once all are back
+    int ring_wake;          // woken as a queued writer while busy
+    char *rbuf;             // file data buffer (registered pool index rbuf_idx, -1 = heap)
+    int rbuf_idx;
+    size_t rbuf_len, rbuf_off; // bytes in rbuf, and how many are sent/written
+
+    uint64_t accepted_us; // STATS timestamps (hist_now_us)
+    uint64_t cmd_us;      // current command started, 0 = none
+    uint64_t queued_us;   // WRITE joined the writer queue
+    uint64_t xfer_us;     // payload / file data started
+
+    char *out; // queued control lines / file data
+    size_t out_cap, out_off, out_len;
+
+    struct rconn *prev, *next;          // reactor connection list
+    struct rconn *wait_prev, *wait_next; // reactor lock-wait list (writers)
+    int waiting;
+
+    struct shape_client *shape; // bandwidth bucket of the HELLO id, NULL = unshaped
+    struct rconn *thr_prev, *thr_next; // reactor list of paused transfers
+    int throttled;
+    uint64_t throttled_us, resume_us; // paused since, may go on at
+    uint64_t moved; // payload bytes moved either way, for the shutdown report
+};
+
+struct reactor
+{
+    int id;
+    int epfd;
+    int listen_fd;
+    struct rconn *conns;
+    struct rconn *waiters; // writers queued on a file lock
+    struct rconn *throttled; // transfers paused by bandwidth shaping
+    uint64_t drain_until;    // shutting down: commands in flight may finish until then
+    int drain_told;          // ... and the wait was announced
+    int wake_fd;           // eventfd: a queued writer was granted or moved up
+    int pipefd[2]; // splice() staging pipe, always empty between events
+    int no_splice; // splice() unsupported: WRITE payloads use recv/write
+    struct zcodec zc;     // compressed transfers; reset for every frame
+    unsigned char *zraw;  // ZFRAME_BLOCK scratch: file data to frame, frame decoded
+
+    int uring;            // IO_MODE uring: ring replaces epfd (see reactor_ring_main)
+    struct uring ring;
+    char *ring_mem;       // RING_BUFS transfer buffers of RING_BUF_SIZE
+    int bufs_ok;          // ... registered with the ring
+    int *buf_free, nbuf_free;
+    int *slot_fds;        // fixed-file table (RING_FILES), -1 = free
+    int files_ok;         // ... registered with the ring
+    int *slot_free, nslot_free;
+};
+
+static void rconn_set_events(struct reactor *r, struct rconn *c, uint32_t ev)
+{
+    if (c->events == ev)
+        return;
+    struct epoll_event e = {.events = ev, .data.ptr = c};
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &e);
+    c->events = ev;
+}
+
+// Account for payload bytes moved either way (shaping, shutdown report)
+static void rconn_moved(struct rconn *c, size_t n)
+{
+    shape_charge(c->shape, n);
+    c->moved += n;
+}
+
+static int rconn_wants_input(const struct rconn *c)
+{
+    return c->state == RC_HELLO || c->state == RC_HEADER || c->state == RC_WRITE_SIZE ||
+           c->state == RC_WRITE_RECV || c->state == RC_BATCH || c->state == RC_TRAILER;
+}
+
+// IO_MODE uring: file data of the current READ goes out in ring SENDs:
+// from the cache, or read into a buffer first. Large uncached files keep
+// using sendfile() once the socket is writable.
+#define RING_SENDFILE_MIN (256 << 10)
+
+static int rconn_ring_sends(const struct rconn *c)
+{
+    return c->cache || !c->zero_copy || (c->remaining >= 0 && c->remaining <= RING_SENDFILE_MIN);
+}
+
+static void rconn_ring_arm(struct reactor *r, struct rconn *c);
+
+// Recompute epoll interest from the connection state
+static void rconn_update_events(struct reactor *r, struct rconn *c)
+{
+    if (r->uring)
+    {
+        rconn_ring_arm(r, c); // the next ring request instead
+        return;
+    }
+    // A paused transfer leaves its payload in the socket and produces no
+    // data, but already queued output still goes out
+    uint32_t ev = 0;
+    if (rconn_wants_input(c) && !(c->throttled && c->state == RC_WRITE_RECV))
+        ev |= EPOLLIN;
+    if (c->out_len > c->out_off || (c->state == RC_READ && !c->throttled))
+        ev |= EPOLLOUT;
+    rconn_set_events(r, c, ev);
+}
+
+static int rconn_reserve(struct rconn *c, size_t add)
+{
+    if (c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+    if (c->out_len + add <= c->out_cap)
+        return 0;
+    size_t cap = c->out_cap ? c->out_cap : RCONN_CHUNK;
+    while (cap < c->out_len + add)
+        cap *= 2;
+    char *tmp = realloc(c->out, cap);
+    if (!tmp)
+        return -1;
+    c->out = tmp;
+    c->out_cap = cap;
+    return 0;
+}
+
+// Queue reply bytes (which may be binary) behind any pending output
+static void rconn_queue_bytes(struct rconn *c, const char *data, size_t len)
+{
+    if (rconn_reserve(c, len) < 0)
+        return;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+// Queue a control line behind any pending output
+static void rconn_queue(struct rconn *c, const char *msg)
+{
+    stats_reply(msg);
+    if (!c->binary)
+    {
+        rconn_queue_bytes(c, msg, strlen(msg));
+        return;
+    }
+    unsigned char frame[BFRAME_HDR + BFRAME_META_MAX];
+    const char *meta;
+    size_t mlen;
+    uint8_t code = bin_status(msg, &meta, &mlen);
+    rconn_queue_bytes(c, (const char *)frame, bframe_build(frame, code, 0, meta, mlen, 0));
+}
+
+// A reply line followed by len payload bytes; in binary mode the trailer
+// is queued by rconn_queue_trailer() once they are sent
+static void rconn_queue_data(struct rconn *c, const char *msg, long long len)
+{
+    if (!c->binary)
+    {
+        rconn_queue(c, msg);
+        return;
+    }
+    unsigned char frame[BFRAME_HDR + BFRAME_META_MAX];
+    const char *meta;
+    size_t mlen;
+    uint8_t code = bin_status(msg, &meta, &mlen);
+    size_t flen = bframe_build(frame, code, c->crc_on ? BF_FLAG_CRC : 0, meta, mlen,
+                               (uint64_t)len);
+    rconn_queue_bytes(c, (const char *)frame, flen);
+    c->bin_len = len;
+}
+
+static void rconn_queue_trailer(struct rconn *c)
+{
+    if (!c->binary || c->bin_len <= 0)
+        return;
+    unsigned char tr[BFRAME_TRAILER];
+    bframe_put_crc(tr, c->crc_on ? (uint32_t)c->crc : 0);
+    rconn_queue_bytes(c, (const char *)tr, sizeof(tr));
+    c->bin_len = 0;
+}
+
+// Send queued output. Returns -1 on error, 0 if data remains, 1 when empty.
+static int rconn_flush(struct rconn *c)
+{
+    while (c->out_off < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    c->out_off = c->out_len = 0;
+    return 1;
+}
+
+// Called by whichever thread hands a lock to, or moves up, one of our writers
+static void reactor_wake(struct reactor *r)
+{
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+}
+
+static void reactor_wait_add(struct reactor *r, struct rconn *c)
+{
+    if (c->waiting)
+        return;
+    c->wait_prev = NULL;
+    c->wait_next = r->waiters;
+    if (r->waiters)
+        r->waiters->wait_prev = c;
+    r->waiters = c;
+    c->waiting = 1;
+}
+
+static void reactor_wait_remove(struct reactor *r, struct rconn *c)
+{
+    if (!c->waiting)
+        return;
+    if (c->wait_prev)
+        c->wait_prev->wait_next = c->wait_next;
+    else
+        r->waiters = c->wait_next;
+    if (c->wait_next)
+        c->wait_next->wait_prev = c->wait_prev;
+    c->waiting = 0;
+}
+
+/*
+ * Bandwidth shaping: 1 if c's transfer has to pause before its next
+ * step. It is put on the reactor's throttled list and carried on by
+ * reactor_resume() once the bucket has refilled.
+ */
+static int rconn_throttle(struct reactor *r, struct rconn *c)
+{
+    if (c->throttled)
+        return 1;
+    uint64_t wait = shape_delay(c->shape);
+    if (wait == 0)
+        return 0;
+    c->throttled = 1;
+    c->throttled_us = hist_now_us();
+    c->resume_us = c->throttled_us + wait;
+    c->thr_prev = NULL;
+    c->thr_next = r->throttled;
+    if (r->throttled)
+        r->throttled->thr_prev = c;
+    r->throttled = c;
+    STAT_ADD(shaped_pauses, 1);
+    return 1;
+}
+
+static void rconn_unthrottle(struct reactor *r, struct rconn *c)
+{
+    if (!c->throttled)
+        return;
+    if (c->thr_prev)
+        c->thr_prev->thr_next = c->thr_next;
+    else
+        r->throttled = c->thr_next;
+    if (c->thr_next)
+        c->thr_next->thr_prev = c->thr_prev;
+    c->throttled = 0;
+    STAT_ADD(shaped_pause_us, hist_now_us() - c->throttled_us);
+}
+
+// Event loop timeout: the idle period, or less if a paused transfer is
+// due or the reactor is draining
+static int reactor_timeout(struct reactor *r)
+{
+    int ms = server_running ? REACTOR_IDLE_MS : DRAIN_POLL_MS;
+    uint64_t now = hist_now_us();
+    for (struct rconn *c = r->throttled; c; c = c->thr_next)
+    {
+        int left = c->resume_us > now ? (int)((c->resume_us - now + 999) / 1000) : 0;
+        if (left < ms)
+            ms = left;
+    }
+    return ms;
+}
+
+// Drop the file, lock and lock reference held by the current command
+static void rconn_release(struct reactor *r, struct rconn *c)
+{
+    rconn_unthrottle(r, c);
+    if (c->file_fd >= 0)
+    {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+    if (c->cache)
+    {
+        cache_put(c->cache);
+        c->cache = NULL;
+    }
+    if (c->rbuf)
+    {
+        if (c->rbuf_idx >= 0)
+            r->buf_free[r->nbuf_free++] = c->rbuf_idx;
+        else
+            free(c->rbuf);
+        c->rbuf = NULL;
+        c->rbuf_len = c->rbuf_off = 0;
+    }
+    if (c->commit)
+    {
+        // Don't wait for the flush: the commit thread finishes the upload
+        // and hands on the write lock (the COMMITted PUT's, or ours)
+        struct file_lock *lk = NULL;
+        if (c->locked)
+        {
+            lk = c->lock;
+            c->lock = NULL;
+            c->locked = 0;
+        }
+        else if (c->put && c->put->closed)
+        {
+            lk = c->put->lock;
+            c->put->lock = NULL;
+        }
+        reactor_wait_remove(r, c);
+        commit_disown(c->commit, lk);
+        c->commit = NULL;
+    }
+    if (c->tmp_path)
+    {
+        upload_finish(c->filename, c->tmp_path, 0); // abandoned upload
+        free(c->tmp_path);
+        c->tmp_path = NULL;
+    }
+    if (c->base.fd >= 0)
+    {
+        close(c->base.fd);
+        c->base.fd = -1;
+    }
+    if (c->chunk)
+    {
+        put_chunk_done(c->chunk, c->chunk_idx, 0); // client left mid-chunk
+        c->chunk = NULL;
+    }
+    c->chunking = 0;
+    c->refused = NULL;
+    c->crc_on = 0;
+    c->bin_len = 0;
+    if (c->waiting)
+    {
+        reactor_wait_remove(r, c);
+        writer_cancel(c->lock, &c->waiter);
+    }
+    if (c->locked)
+    {
+        printf("[R%d] releasing lock %s\n", r->id, c->filename);
+        writer_release(c->lock);
+        c->locked = 0;
+    }
+    if (c->lock)
+    {
+        file_lock_put(c->lock);
+        c->lock = NULL;
+    }
+}
+
+static void rconn_close(struct reactor *r, struct rconn *c)
+{
+    rconn_release(r, c);
+    shape_put(c->shape);
+    if (c->put)
+        put_abort(c->put);
+    if (c->batch)
+    {
+        free(c->batch->buf);
+        free(c->batch);
+    }
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        r->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (c->ring_slot >= 0)
+    {
+        // Drop the table's reference too, or the socket would stay open
+        r->slot_fds[c->ring_slot] = -1;
+        uring_prep(&r->ring, IORING_OP_FILES_UPDATE, -1, &r->slot_fds[c->ring_slot], 1,
+                   (uint64_t)c->ring_slot, 0);
+        r->slot_free[r->nslot_free++] = c->ring_slot;
+    }
+    if (c->fd >= 0) // -1: handed to the watch thread
+    {
+        close(c->fd);
+        STAT_ADD(active, -1);
+    }
+    free(c->out);
+    free(c->zin);
+    free(c);
+}
+
+// Queue a final message and close once it has been sent
+static void rconn_finish(struct rconn *c, const char *msg)
+{
+    if (msg)
+        rconn_queue(c, msg);
+    c->state = RC_FLUSH;
+}
+
+// End the current command: sessions go back to reading commands,
+// legacy connections close after the reply
+static void rconn_batch_next(struct reactor *r, struct rconn *c);
+
+static void rconn_complete(struct reactor *r, struct rconn *c, const char *msg)
+{
+    if (c->batch)
+    {
+        // One file of a BATCH is done: its reply goes into the status list
+        rconn_release(r, c);
+        if (batch_note(c->batch, c->filename, msg) < 0)
+        {
+            rconn_finish(c, NULL);
+            return;
+        }
+        rconn_batch_next(r, c);
+        return;
+    }
+    if (c->cmd_us)
+    {
+        uint64_t now = hist_now_us();
+        if (c->state == RC_READ)
+            hist_record(&g_stats.transfer, now - c->xfer_us);
+        hist_record(&g_stats.request, now - c->cmd_us);
+        c->cmd_us = 0;
+    }
+    if (c->state == RC_READ)
+        rconn_queue_trailer(c);
+    rconn_release(r, c);
+    if (!c->persistent)
+    {
+        rconn_finish(c, msg);
+        return;
+    }
+    if (msg)
+        rconn_queue(c, msg);
+    c->state = RC_HEADER;
+    if (!server_running)
+        rconn_finish(c, "SERVER_SHUTDOWN\n"); // draining: no new commands
+}
+
+// Binary READ replies carry a CRC when cached, compressed or asked for
+// (see bin_read_crc)
+static void rconn_read_crc(struct rconn *c)
+{
+    c->crc_on = c->binary && (c->cache || c->compress || c->crc_want);
+    c->crc = crc32(0L, Z_NULL, 0);
+    if (c->crc_on && c->cache && !c->compress)
+        for (long long done = 0; done < c->remaining;)
+        {
+            uInt n = c->remaining - done > (1 << 30) ? 1u << 30 : (uInt)(c->remaining - done);
+            c->crc = crc32(c->crc, (const Bytef *)c->cache->data + c->cache_off + done, n);
+            done += n;
+        }
+}
+
+// Open the published version of the file; no lock needed (see upload_open)
+static void rconn_start_read(struct reactor *r, struct rconn *c, struct read_range *rg)
+{
+    unsigned long gen = 0;
+    long long total;
+    char tag[TAG_LEN];
+    c->cache = cache_lookup(c->filename, &gen);
+    if (c->cache)
+    {
+        total = (long long)c->cache->size;
+        snprintf(tag, sizeof(tag), "%s", c->cache->tag);
+    }
+    else
+    {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, c->filename);
+        c->file_fd = open(path, O_RDONLY);
+        if (c->file_fd < 0)
+        {
+            rconn_complete(r, c, "ERR file not found\n");
+            return;
+        }
+
+        struct stat st;
+        if (fstat(c->file_fd, &st) < 0)
+        {
+            close(c->file_fd);
+            c->file_fd = -1;
+            rconn_complete(r, c, "ERR cannot read file\n");
+            return;
+        }
+        total = (long long)st.st_size;
+        file_tag(&st, tag, sizeof(tag));
+        c->zero_copy = S_ISREG(st.st_mode);
+        if (c->zero_copy && cache_admits(total) &&
+            (c->cache = cache_fill(c->filename, c->file_fd, (size_t)total, tag, gen)) != NULL)
+        {
+            close(c->file_fd);
+            c->file_fd = -1;
+        }
+    }
+
+    // Cached replies always know their length; legacy ones still end with the connection
+    c->remaining = c->cache ? total : -1;
+    c->cache_off = 0;
+    char hdr[1024];
+    if (rg->match[0] && strcmp(rg->match, tag) == 0)
+    {
+        STAT_ADD(not_modified, 1);
+        snprintf(hdr, sizeof(hdr), "OK NOTMODIFIED %s %s\n", c->filename, tag);
+        rconn_complete(r, c, hdr);
+        return;
+    }
+    if (rg->offset >= 0)
+    {
+        if (resolve_range(rg, c->filename, total, tag, hdr, sizeof(hdr)) < 0)
+        {
+            rconn_complete(r, c, hdr);
+            return;
+        }
+        if (!c->cache && lseek(c->file_fd, (off_t)rg->offset, SEEK_SET) < 0)
+        {
+            rconn_complete(r, c, "ERR cannot read file\n");
+            return;
+        }
+        c->cache_off = (size_t)rg->offset;
+        c->remaining = rg->length;
+        rconn_read_crc(c);
+        rconn_queue_data(c, hdr, c->remaining);
+    }
+    else if (c->persistent)
+    {
+        c->remaining = total;
+        snprintf(hdr, sizeof(hdr), "OK READ %s %lld %s\n", c->filename, c->remaining, tag);
+        rconn_read_crc(c);
+        rconn_queue_data(c, hdr, c->remaining);
+    }
+    c->state = RC_READ;
+    c->zstreak = 0;
+    c->xfer_us = hist_now_us();
+}
+
+static void rconn_write_reply(struct reactor *r, struct rconn *c, int opened);
+
+// Publish a complete staging file as durably as DURABILITY asks. Returns
+// 1 if it went to the commit thread (rconn_on_wake() replies once it is
+// done), 0 when done here with the outcome in *err.
+static int rconn_publish(struct reactor *r, struct rconn *c, const char *filename,
+                         const char *tmp, int *err)
+{
+    if (g_conf.durability == DUR_NONE)
+    {
+        *err = upload_finish(filename, tmp, 1);
+        return 0;
+    }
+    if (!(c->commit = commit_queue(filename, tmp, r)))
+    {
+        upload_finish(filename, tmp, 0);
+        *err = ENOMEM;
+        return 0;
+    }
+    c->state = RC_COMMIT;
+    reactor_wait_add(r, c);
+    return 1;
+}
+
+// Payload fully received: close the file and report the outcome
+static void rconn_write_done(struct reactor *r, struct rconn *c)
+{
+    if (c->binary && c->bin_len > 0)
+    {
+        c->state = RC_TRAILER; // the payload's CRC comes first
+        return;
+    }
+    hist_record(&g_stats.transfer, hist_now_us() - c->xfer_us);
+    if (c->refused)
+    {
+        rconn_complete(r, c, c->refused);
+        return;
+    }
+    if (c->chunking)
+    {
+        if (c->file_fd >= 0 && close(c->file_fd) < 0 && c->werr == 0)
+            c->werr = errno;
+        c->file_fd = -1;
+        if (c->chunk)
+            put_chunk_done(c->chunk, c->chunk_idx, c->werr == 0);
+        c->chunk = NULL;
+        c->chunking = 0;
+        char msg[256];
+        if (c->werr)
+            snprintf(msg, sizeof(msg), "ERR write failed: %s\n", strerror(c->werr));
+        else
+            snprintf(msg, sizeof(msg), "OK CHUNK %lld\n", c->chunk_idx);
+        rconn_complete(r, c, msg);
+        return;
+    }
+    int opened = c->file_fd >= 0;
+    if (c->delta && opened && c->werr == 0)
+    {
+        // The applied delta is published like a plain upload
+        char tmp[1024];
+        c->werr = delta_rebuild(c->filename, &c->base, c->file_fd, tmp, sizeof(tmp));
+        if (c->werr == 0 && !(c->tmp_path = strdup(tmp)))
+        {
+            unlink(tmp);
+            c->werr = ENOMEM;
+        }
+    }
+    // A failed close can be a deferred write error
+    if (opened && close(c->file_fd) < 0 && c->werr == 0)
+        c->werr = errno;
+    c->file_fd = -1;
+
+    // Publish only a complete upload; the rename happens before the lock is released
+    if (c->tmp_path)
+    {
+        int queued = 0, err = 0;
+        if (c->werr == 0)
+            queued = rconn_publish(r, c, c->filename, c->tmp_path, &err);
+        else
+            upload_finish(c->filename, c->tmp_path, 0);
+        free(c->tmp_path);
+        c->tmp_path = NULL;
+        if (queued)
+            return;
+        if (err)
+            c->werr = err;
+    }
+    rconn_write_reply(r, c, opened);
+}
+
+// Reply to a WRITE whose upload is published or failed
+static void rconn_write_reply(struct reactor *r, struct rconn *c, int opened)
+{
+    if (!opened)
+    {
+        rconn_complete(r, c, "ERR cannot open file\n");
+        return;
+    }
+    if (c->werr == -1)
+    {
+        rconn_complete(r, c, "ERR delta mismatch\n");
+        return;
+    }
+    if (c->werr == EBADMSG)
+    {
+        rconn_complete(r, c, "ERR checksum mismatch\n");
+        return;
+    }
+    if (c->werr)
+    {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "ERR write failed: %s\n", strerror(c->werr));
+        fprintf(stderr, "Write of '%s' failed: %s\n", c->filename, strerror(c->werr));
+        rconn_complete(r, c, msg);
+        return;
+    }
+    printf("Client done: file '%s' received\n", c->filename);
+    rconn_complete(r, c, "File Received by server\n");
+}
+
+// Open the target once the payload size is known
+static void rconn_open_write(struct reactor *r, struct rconn *c)
+{
+    char tmp[1024];
+    c->file_fd = c->delta ? delta_stage_open() : upload_open(c->filename, tmp, sizeof(tmp));
+    c->discard = 0;
+    c->werr = 0;
+    if (c->file_fd >= 0 && !c->delta && !(c->tmp_path = strdup(tmp)))
+    {
+        close(c->file_fd);
+        unlink(tmp);
+        c->file_fd = -1;
+    }
+    if (c->file_fd < 0)
+    {
+        perror("Failed to open the file in the server");
+        c->discard = 1; // consume the payload so the client gets the error
+    }
+    else
+    {
+        printf("Saving to '%s/%s'...\n", SHARED_DIR, c->filename);
+    }
+    c->state = RC_WRITE_RECV;
+    c->xfer_us = hist_now_us();
+    if (c->remaining == 0)
+        rconn_write_done(r, c);
+}
+
+// Tell a queued writer its place in line
+static void rconn_notify_busy(struct rconn *c, int pos)
+{
+    char note[1024];
+    snprintf(note, sizeof(note), "NOTIFY BUSY %s %d\n", c->filename, pos);
+    if (c->out_len - c->out_off < RCONN_CHUNK) // don't pile up on a stalled client
+        rconn_queue(c, note);
+}
+
+// The lock is ours: let the client send the payload
+static void rconn_write_granted(struct reactor *r, struct rconn *c)
+{
+    hist_record(&g_stats.lock_wait, hist_now_us() - c->queued_us);
+    c->locked = 1;
+    printf("[R%d] acquired WRLOCK %s\n", r->id, c->filename);
+
+    if (c->putting)
+    {
+        // The upload takes over the lock and our reference to it
+        if (!(c->put = put_begin(c->filename, c->lock, c->put_size, c->put_chunk)))
+        {
+            rconn_complete(r, c, errno == EINVAL ? "ERR bad size\n" : "ERR cannot open file\n");
+            return;
+        }
+        c->locked = 0;
+        c->lock = NULL;
+        printf("Saving to '%s/%s' in %zu chunks...\n", SHARED_DIR, c->filename,
+               c->put->nchunks);
+        char ok[1024];
+        snprintf(ok, sizeof(ok), "OK PUT %s %s\n", c->filename, c->put->token);
+        rconn_complete(r, c, ok);
+        return;
+    }
+
+    if (c->delta)
+    {
+        size_t len;
+        char *msg = delta_offer(c->filename, &c->base, &len);
+        if (!msg)
+        {
+            rconn_complete(r, c, "ERR cannot read file\n");
+            return;
+        }
+        rconn_queue_bytes(c, msg, len);
+        free(msg);
+        c->state = RC_WRITE_SIZE;
+        return;
+    }
+
+    // Batch files go straight to the payload; their outcome is reported at the end
+    if (!c->batch)
+    {
+        char ok[1024];
+        snprintf(ok, sizeof(ok), "OK WRITE %s\n", c->filename);
+        rconn_queue(c, ok);
+    }
+
+    if (c->persistent && c->remaining < 0)
+    {
+        c->state = RC_WRITE_SIZE;
+        return;
+    }
+    rconn_open_write(r, c);
+}
+
+// Take the write lock, or queue for it and NOTIFY BUSY the client
+static void rconn_try_write(struct reactor *r, struct rconn *c)
+{
+    c->queued_us = hist_now_us();
+    c->waiter = (struct lock_waiter){.r = r};
+    int pos = writer_acquire(c->lock, &c->waiter);
+    if (pos > 0)
+    {
+        rconn_notify_busy(c, pos);
+        c->state = RC_WRITE_WAIT;
+        reactor_wait_add(r, c);
+        return;
+    }
+    rconn_write_granted(r, c);
+}
+
+// Account for len payload bytes and finish when all of them are in
+static void rconn_payload_advance(struct reactor *r, struct rconn *c, size_t len)
+{
+    STAT_ADD(bytes_in, len);
+    rconn_moved(c, len);
+    if (c->remaining > 0)
+    {
+        c->remaining -= (long long)len;
+        if (c->remaining == 0)
+            rconn_write_done(r, c);
+    }
+}
+
+// Store (or discard) payload bytes received into memory
+static void rconn_payload(struct reactor *r, struct rconn *c, const char *data, size_t len)
+{
+    if (c->crc_on)
+        c->crc = crc32(c->crc, (const Bytef *)data, (uInt)len);
+    if (!c->discard && (c->werr = write_all(c->file_fd, data, len)) != 0)
+        c->discard = 1;
+    rconn_payload_advance(r, c, len);
+}
+
+/*
+ * Compressed WRITE payload: move input (buffered first, then the socket)
+ * into the frame being assembled and store each frame's decoded bytes
+ * once it is complete. Returns 1 after progress, 0 when the socket has
+ * nothing more, -1 if the connection was closed.
+ */
+static int rconn_frame_recv(struct reactor *r, struct rconn *c)
+{
+    if ((!c->zin && !(c->zin = malloc(ZFRAME_MAX))) ||
+        (!r->zraw && !(r->zraw = malloc(ZFRAME_BLOCK))))
+    {
+        rconn_close(r, c);
+        return -1;
+    }
+
+    size_t raw = 0, wire = 0;
+    if (c->zin_len >= ZFRAME_HDR)
+        zframe_parse(c->zin, &raw, &wire);
+    size_t want = ZFRAME_HDR + wire - c->zin_len;
+
+    ssize_t n;
+    if (c->in_len > 0)
+    {
+        n = (ssize_t)(c->in_len < want ? c->in_len : want);
+        memcpy(c->zin + c->zin_len, c->in, (size_t)n);
+        memmove(c->in, c->in + n, c->in_len - (size_t)n);
+        c->in_len -= (size_t)n;
+    }
+    else
+    {
+        n = recv(c->fd, c->zin + c->zin_len, want, 0);
+        if (n < 0 && errno == EINTR)
+            return 1;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 || (n == 0 && (c->remaining >= 0 || c->zin_len > 0)))
+        {
+            if (n == 0)
+                printf("Client left before sending all of '%s'\n", c->filename);
+            rconn_close(r, c);
+            return -1;
+        }
+        if (n == 0)
+        {
+            // Legacy client half-closed between frames: payload complete
+            rconn_write_done(r, c);
+            return 1;
+        }
+    }
+    c->zin_len += (size_t)n;
+    STAT_ADD(comp_wire, n);
+
+    if (c->zin_len == ZFRAME_HDR)
+    {
+        // Header complete: the frame may not overrun the announced payload
+        if (zframe_parse(c->zin, &raw, &wire) < 0 ||
+            (c->remaining >= 0 && (long long)raw > c->remaining))
+            rconn_finish(c, "ERR bad frame\n");
+        return 1;
+    }
+    if (c->zin_len < ZFRAME_HDR + wire)
+        return 1;
+
+    c->zin_len = 0;
+    if (zframe_decode(&r->zc, c->zin + ZFRAME_HDR, wire, r->zraw, raw) < 0)
+    {
+        rconn_finish(c, "ERR bad frame\n");
+        return 1;
+    }
+    STAT_ADD(comp_raw, raw);
+    rconn_payload(r, c, (const char *)r->zraw, raw);
+    return 1;
+}
+
+// Reply to a PUT's COMMIT once the upload is published or failed
+static void rconn_put_reply(struct reactor *r, struct rconn *c, int err)
+{
+    struct put_txn *t = c->put;
+    char msg[256];
+    put_release(t);
+    if (err)
+        snprintf(msg, sizeof(msg), "ERR write failed: %s\n", strerror(err));
+    else
+        printf("Client done: file '%s' received\n", t->filename);
+    c->put = NULL;
+    put_unref(t);
+    rconn_complete(r, c, err ? msg : "File Received by server\n");
+}
+
+// PUT / CHUNK / COMMIT (see put_begin); c->filename holds the token for
+// CHUNK and COMMIT
+static void rconn_upload(struct reactor *r, struct rconn *c, const char *cmd, long long a,
+                         long long b)
+{
+    char msg[1024];
+    if (strcmp(cmd, "PUT") == 0)
+    {
+        if (c->put)
+        {
+            rconn_complete(r, c, "ERR upload in progress\n");
+            return;
+        }
+        if (a < 0 || b <= 0)
+        {
+            rconn_complete(r, c, "ERR bad size\n");
+            return;
+        }
+        if (!(c->lock = file_lock_get(c->filename)))
+        {
+            rconn_finish(c, NULL);
+            return;
+        }
+        c->delta = 0;
+        c->putting = 1;
+        c->put_size = a;
+        c->put_chunk = b;
+        STAT_ADD(writes, 1);
+        rconn_try_write(r, c);
+        return;
+    }
+
+    if (strcmp(cmd, "CHUNK") == 0)
+    {
+        if (b < 0)
+        {
+            rconn_finish(c, "ERR bad size\n"); // can't tell where the payload ends
+            return;
+        }
+        // Received like any payload, into a private fd at the chunk's offset;
+        // a refused chunk is consumed and then answered with the error
+        c->chunk = NULL;
+        c->refused = NULL;
+        c->file_fd = put_chunk_open(c->filename, a, b, &c->chunk, &c->refused);
+        c->chunking = 1;
+        c->chunk_idx = a;
+        c->remaining = b;
+        c->delta = 0;
+        c->discard = c->file_fd < 0;
+        c->werr = 0;
+        c->state = RC_WRITE_RECV;
+        c->xfer_us = hist_now_us();
+        if (c->remaining == 0)
+            rconn_write_done(r, c);
+        return;
+    }
+
+    if (!c->put || strcmp(c->put->token, c->filename) != 0)
+    {
+        rconn_complete(r, c, "ERR unknown upload\n");
+        return;
+    }
+    struct put_txn *t = c->put;
+    if (put_close(t, msg, sizeof(msg)) < 0)
+    {
+        rconn_complete(r, c, msg);
+        return;
+    }
+    int err = 0;
+    if (!rconn_publish(r, c, t->filename, t->tmp, &err))
+        rconn_put_reply(r, c, err);
+}
+
+// Wait for the next FILE of a BATCH, or send the reply once all are in
+static void rconn_batch_next(struct reactor *r, struct rconn *c)
+{
+    if (c->batch_left > 0)
+    {
+        c->state = RC_BATCH;
+        return;
+    }
+    struct batch_status *bs = c->batch;
+    c->batch = NULL;
+    size_t len;
+    char *msg = batch_reply(bs, &len);
+    printf("Batch done: %lld of %lld files received\n", bs->stored, bs->count);
+    rconn_complete(r, c, msg ? msg : "ERR out of memory\n");
+    free(msg);
+    free(bs->buf);
+    free(bs);
+}
+
+// "FILE <name> <len>" of a BATCH: store it like a WRITE of len bytes
+static void rconn_batch_file(struct reactor *r, struct rconn *c, const char *line)
+{
+    long long len;
+    if (sscanf(line, "FILE %511s %lld", c->filename, &len) != 2 || len < 0)
+    {
+        rconn_finish(c, "ERR bad batch\n"); // can't tell where the next file starts
+        return;
+    }
+    c->batch_left--;
+    c->delta = 0;
+    c->putting = 0;
+    c->remaining = len;
+    if (!valid_filename(c->filename))
+    {
+        c->refused = "ERR invalid filename\n";
+        c->file_fd = -1;
+        c->discard = 1;
+        c->werr = 0;
+        c->state = RC_WRITE_RECV;
+        c->xfer_us = hist_now_us();
+        if (len == 0)
+            rconn_write_done(r, c);
+        return;
+    }
+    if (!(c->lock = file_lock_get(c->filename)))
+    {
+        rconn_finish(c, NULL);
+        return;
+    }
+    STAT_ADD(writes, 1);
+    rconn_try_write(r, c);
+}
+
+// Start a READ/WRITE command line received in RC_HEADER
+// WATCH: the watch thread takes the socket over, with the replies still
+// queued and whatever the client pipelined; c itself is then closed
+// without it
+static void rconn_watch(struct reactor *r, struct rconn *c, const char *line)
+{
+    if (!c->persistent)
+    {
+        rconn_complete(r, c, "ERR session required\n");
+        return;
+    }
+    if (watch_adopt(c->fd, line, c->in, c->in_len, c->out ? c->out + c->out_off : "",
+                    c->out_len - c->out_off) < 0)
+    {
+        rconn_finish(c, "SERVER_SHUTDOWN\n");
+        return;
+    }
+    if (!r->uring)
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->fd = -1;
+    c->in_len = 0;
+    c->out_off = c->out_len = 0;
+    c->state = RC_FLUSH;
+}
+
+static void rconn_command(struct reactor *r, struct rconn *c, const char *line)
+{
+    if (c->persistent && strcmp(line, "QUIT") == 0)
+    {
+        rconn_finish(c, "BYE\n");
+        return;
+    }
+    if (info_command(line))
+    {
+        size_t len;
+        char *msg = info_reply(line, &len);
+        size_t hl = msg ? strcspn(msg, "\n") + 1 : 0;
+        if (msg && hl < len && c->binary)
+        {
+            // "OK STATS <len>" / "OK LIST ..." becomes the frame, the lines its payload
+            c->crc_on = 1;
+            c->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)msg + hl, (uInt)(len - hl));
+            rconn_queue_data(c, msg, (long long)(len - hl));
+            rconn_queue_bytes(c, msg + hl, len - hl);
+            rconn_queue_trailer(c);
+            rconn_complete(r, c, NULL);
+        }
+        else
+            rconn_complete(r, c, msg ? msg : "ERR out of memory\n");
+        free(msg);
+        return;
+    }
+    if (watch_command(line))
+    {
+        rconn_watch(r, c, line);
+        return;
+    }
+
+    char cmd[16];
+    long long len = -1, arg2 = -1;
+    int fields = sscanf(line, "%15s %511s %lld %lld", cmd, c->filename, &len, &arg2);
+    if (fields < 2)
+    {
+        rconn_complete(r, c, "ERR bad header\n");
+        return;
+    }
+    if (strcmp(cmd, "BATCH") == 0)
+    {
+        long long count = strtoll(c->filename, NULL, 10);
+        if (count < 0 || count > BATCH_MAX || !(c->batch = calloc(1, sizeof(*c->batch))))
+        {
+            rconn_finish(c, "ERR bad batch\n"); // the files that follow can't be skipped safely
+            return;
+        }
+        c->cmd_us = hist_now_us();
+        c->batch->count = count;
+        c->batch_left = count;
+        rconn_batch_next(r, c);
+        return;
+    }
+    if (!valid_filename(c->filename))
+    {
+        rconn_complete(r, c, "ERR invalid filename\n");
+        return;
+    }
+    int upload = strcmp(cmd, "PUT") == 0 || strcmp(cmd, "CHUNK") == 0 || strcmp(cmd, "COMMIT") == 0;
+    if (!upload && strcmp(cmd, "READ") != 0 && strcmp(cmd, "WRITE") != 0 &&
+        strcmp(cmd, "DELTA") != 0)
+    {
+        rconn_complete(r, c, "ERR unknown command. Use READ or WRITE\n");
+        return;
+    }
+    if (upload && !c->persistent)
+    {
+        rconn_complete(r, c, "ERR session required\n");
+        return;
+    }
+
+    c->cmd_us = hist_now_us();
+    if (upload)
+    {
+        rconn_upload(r, c, cmd, len, arg2);
+        return;
+    }
+    if (strcmp(cmd, "READ") == 0)
+    {
+        STAT_ADD(reads, 1);
+        struct read_range rg;
+        const char *err = read_args(line, fields, len, arg2, c->persistent, &rg);
+        if (err)
+        {
+            rconn_complete(r, c, err);
+            return;
+        }
+        rconn_start_read(r, c, &rg);
+        return;
+    }
+
+    c->lock = file_lock_get(c->filename);
+    if (!c->lock)
+    {
+        rconn_finish(c, NULL);
+        return;
+    }
+    c->delta = strcmp(cmd, "DELTA") == 0;
+    c->putting = 0;
+    c->remaining = c->persistent && !c->delta ? len : -1;
+    STAT_ADD(writes, 1);
+    rconn_try_write(r, c);
+}
+
+// Run one binary request as the equivalent text command
+static void rconn_bin_request(struct reactor *r, struct rconn *c, const struct bframe *f,
+                              const char *meta)
+{
+    char line[BFRAME_META_MAX + 64];
+    switch (f->code)
+    {
+    case BF_QUIT:
+        rconn_command(r, c, "QUIT");
+        return;
+    case BF_STATS:
+        rconn_command(r, c, "STATS");
+        return;
+    case BF_LIST:
+    case BF_STAT:
+        snprintf(line, sizeof(line), "%s%s%s", f->code == BF_LIST ? "LIST" : "STAT",
+                 f->meta_len ? " " : "", meta);
+        rconn_command(r, c, line);
+        return;
+    case BF_READ:
+        snprintf(line, sizeof(line), "READ %s", meta);
+        c->crc_want = (f->flags & BF_FLAG_CRC) != 0;
+        rconn_command(r, c, line);
+        c->crc_want = 0;
+        return;
+    case BF_WRITE:
+        c->crc_on = (f->flags & BF_FLAG_CRC) != 0;
+        c->crc = crc32(0L, Z_NULL, 0);
+        c->bin_len = (long long)f->payload_len;
+        if (f->meta_len == 0 || strcspn(meta, " \t\r\n") != f->meta_len || !valid_filename(meta))
+        {
+            // Drop the payload so the next request is found
+            snprintf(c->filename, sizeof(c->filename), "%.511s", meta);
+            c->refused = "ERR invalid filename\n";
+            c->file_fd = -1;
+            c->discard = 1;
+            c->werr = 0;
+            c->remaining = c->bin_len;
+            c->state = RC_WRITE_RECV;
+            c->xfer_us = hist_now_us();
+            if (c->remaining == 0)
+                rconn_write_done(r, c);
+            return;
+        }
+        snprintf(line, sizeof(line), "WRITE %s %lld", meta, c->bin_len);
+        rconn_command(r, c, line);
+        return;
+    default:
+        rconn_complete(r, c, "ERR unknown command. Use READ or WRITE\n");
+    }
+}
+
+// Dispatch one complete line by connection state
+static void rconn_on_line(struct reactor *r, struct rconn *c, const char *line)
+{
+    if (c->state == RC_HELLO)
+    {
+        if (strncmp(line, "HELLO", 5) != 0)
+        {
+            rconn_finish(c, "ERR Handshake required\n");
+            return;
+        }
+        struct hello h;
+        char reply[64];
+        hello_parse(line, &h, reply, sizeof(reply));
+        c->persistent = h.persistent;
+        c->compress = h.compress;
+        c->shape = shape_get(h.id);
+        rconn_queue(c, reply);
+        c->binary = h.binary; // the handshake reply itself is always text
+        hist_record(&g_stats.handshake, hist_now_us() - c->accepted_us);
+        c->state = RC_HEADER;
+        return;
+    }
+
+    if (c->state == RC_WRITE_SIZE)
+    {
+        if (strcmp(line, "ABORT") == 0)
+        {
+            rconn_complete(r, c, "OK ABORT\n");
+            return;
+        }
+        if (sscanf(line, "SIZE %lld", &c->remaining) != 1 || c->remaining < 0)
+        {
+            rconn_finish(c, "ERR bad size\n");
+            return;
+        }
+        rconn_open_write(r, c);
+        return;
+    }
+
+    if (c->state == RC_BATCH)
+    {
+        rconn_batch_file(r, c, line);
+        return;
+    }
+
+    rconn_command(r, c, line);
+}
+
+// Consume buffered input, then the socket, for as long as the state
+// wants input. Returns -1 if the connection was closed.
+static int rconn_on_readable(struct reactor *r, struct rconn *c)
+{
+    for (;;)
+    {
+        int line_state = c->state == RC_HELLO || c->state == RC_HEADER ||
+                         c->state == RC_WRITE_SIZE || c->state == RC_BATCH ||
+                         c->state == RC_TRAILER;
+        int framed = c->binary && (c->state == RC_HEADER || c->state == RC_TRAILER);
+
+        // Binary requests and trailers instead of lines
+        if (framed && c->state == RC_TRAILER && c->in_len >= BFRAME_TRAILER)
+        {
+            if (c->crc_on && bframe_get_crc((unsigned char *)c->in) != (uint32_t)c->crc &&
+                c->werr == 0)
+            {
+                c->werr = EBADMSG;
+                c->discard = 1;
+            }
+            memmove(c->in, c->in + BFRAME_TRAILER, c->in_len - BFRAME_TRAILER);
+            c->in_len -= BFRAME_TRAILER;
+            c->bin_len = 0;
+            rconn_write_done(r, c);
+            continue;
+        }
+        if (framed && c->state == RC_HEADER && c->in_len >= BFRAME_HDR)
+        {
+            struct bframe f;
+            if (bframe_unpack((unsigned char *)c->in, &f) < 0 ||
+                (f.payload_len > 0 && f.code != BF_WRITE))
+            {
+                rconn_finish(c, "ERR bad frame\n"); // can't find the next request
+                continue;
+            }
+            if (c->in_len >= BFRAME_HDR + f.meta_len)
+            {
+                char meta[BFRAME_META_MAX + 1];
+                memcpy(meta, c->in + BFRAME_HDR, f.meta_len);
+                meta[f.meta_len] = '\0';
+                size_t take = BFRAME_HDR + f.meta_len;
+                memmove(c->in, c->in + take, c->in_len - take);
+                c->in_len -= take;
+                rconn_bin_request(r, c, &f, meta);
+                continue;
+            }
+        }
+
+        // Bytes already buffered: pipelined commands or early payload
+        if (line_state && !framed && c->in_len > 0)
+        {
+            char *nl = memchr(c->in, '\n', c->in_len);
+            // An over-long line is cut like recv_line does
+            if (nl || c->in_len == sizeof(c->in) - 1)
+            {
+                size_t take = nl ? (size_t)(nl - c->in) + 1 : c->in_len;
+                size_t ll = nl ? take - 1 : take;
+                char line[1024];
+                memcpy(line, c->in, ll);
+                line[ll] = '\0';
+                memmove(c->in, c->in + take, c->in_len - take);
+                c->in_len -= take;
+
+                rconn_on_line(r, c, line);
+                continue;
+            }
+        }
+        // Shaping: the rest of the payload waits in the socket
+        if (c->state == RC_WRITE_RECV && rconn_throttle(r, c))
+            return 0;
+        if (c->state == RC_WRITE_RECV && c->compress)
+        {
+            int fr = rconn_frame_recv(r, c);
+            if (fr <= 0)
+                return fr;
+            continue;
+        }
+        if (c->state == RC_WRITE_RECV && c->in_len > 0)
+        {
+            size_t take = c->in_len;
+            if (c->remaining >= 0 && (long long)take > c->remaining)
+                take = (size_t)c->remaining;
+            char chunk[sizeof(c->in)];
+            memcpy(chunk, c->in, take);
+            memmove(c->in, c->in + take, c->in_len - take);
+            c->in_len -= take;
+
+            rconn_payload(r, c, chunk, take);
+            continue;
+        }
+
+        // Then the socket (IO_MODE uring: rconn_ring_arm() posts the receive)
+        if (r->uring && (line_state || (c->state == RC_WRITE_RECV && !c->compress)))
+            return 0;
+        if (line_state)
+        {
+            ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (n <= 0)
+            {
+                rconn_close(r, c);
+                return -1;
+            }
+            c->in_len += (size_t)n;
+            continue;
+        }
+        if (c->state == RC_WRITE_RECV)
+        {
+            // Never read past the announced payload: the rest is the next command
+            char buf[RCONN_CHUNK];
+            int spliced = !c->discard && !r->no_splice && !c->crc_on;
+            size_t want = spliced ? shape_cap(c->shape, SPLICE_CHUNK) : sizeof(buf);
+            if (c->remaining >= 0 && (long long)want > c->remaining)
+                want = (size_t)c->remaining;
+
+            // socket -> pipe -> file keeps the payload out of user space
+            ssize_t n = spliced
+                            ? splice(c->fd, NULL, r->pipefd[1], NULL, want,
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+                            : recv(c->fd, buf, want, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (n < 0 && spliced && (errno == EINVAL || errno == ENOSYS))
+            {
+                r->no_splice = 1;
+                continue;
+            }
+            if (n < 0 || (n == 0 && c->remaining >= 0))
+            {
+                if (n == 0)
+                    printf("Client left before sending all of '%s'\n", c->filename);
+                rconn_close(r, c);
+                return -1;
+            }
+            if (n == 0)
+            {
+                // Legacy client half-closed: payload complete
+                rconn_write_done(r, c);
+                continue;
+            }
+            if (spliced)
+            {
+                if ((c->werr = pipe_to_file(r->pipefd[0], c->file_fd, (size_t)n, &r->no_splice)) != 0)
+                    c->discard = 1;
+                rconn_payload_advance(r, c, (size_t)n);
+            }
+            else
+            {
+                rconn_payload(r, c, buf, (size_t)n);
+            }
+            continue;
+        }
+        return 0;
+    }
+}
+
+// Flush output and stream file data; returns -1 if the connection was closed
+static int rconn_on_writable(struct reactor *r, struct rconn *c)
+{
+    for (;;)
+    {
+        // IO_MODE uring: queued output goes out in a ring SEND
+        int fr = r->uring && c->out_off < c->out_len ? 0 : rconn_flush(c);
+        if (fr < 0)
+        {
+            rconn_close(r, c);
+            return -1;
+        }
+        if (fr == 0)
+            return 0;
+
+        if (c->state == RC_FLUSH)
+        {
+            rconn_close(r, c);
+            return -1;
+        }
+        if (c->state != RC_READ)
+            return 0;
+
+        if (c->remaining == 0)
+        {
+            // Session READ done: pick up any pipelined commands
+            rconn_complete(r, c, NULL);
+            if (rconn_on_readable(r, c) < 0)
+                return -1;
+            continue;
+        }
+        if (rconn_throttle(r, c))
+            return 0;
+
+        if (c->compress)
+        {
+            // Frame the next block from the cache or the file
+            if (rconn_reserve(c, ZFRAME_MAX) < 0 ||
+                (!r->zraw && !(r->zraw = malloc(ZFRAME_BLOCK))))
+            {
+                rconn_close(r, c);
+                return -1;
+            }
+            size_t want = ZFRAME_BLOCK;
+            if (c->remaining > 0 && (long long)want > c->remaining)
+                want = (size_t)c->remaining;
+            const char *src;
+            ssize_t n;
+            if (c->cache)
+            {
+                src = c->cache->data + c->cache_off;
+                c->cache_off += want;
+                n = (ssize_t)want;
+            }
+            else
+            {
+                src = (const char *)r->zraw;
+                n = read(c->file_fd, r->zraw, want);
+            }
+            if (n <= 0)
+            {
+                if (c->remaining > 0)
+                {
+                    rconn_close(r, c);
+                    return -1;
+                }
+                rconn_complete(r, c, NULL);
+                continue;
+            }
+            if (c->crc_on)
+                c->crc = crc32(c->crc, (const Bytef *)src, (uInt)n);
+            c->out_len = zframe_encode(&r->zc, &c->zstreak, src, (size_t)n,
+                                       (unsigned char *)c->out);
+            if (c->remaining > 0)
+                c->remaining -= n;
+            STAT_ADD(bytes_out, n);
+            rconn_moved(c, (size_t)n);
+            STAT_ADD(comp_raw, n);
+            STAT_ADD(comp_wire, c->out_len);
+            continue;
+        }
+
+        if (r->uring && rconn_ring_sends(c))
+            return 0;
+
+        if (c->cache)
+        {
+            // Send straight from the cached copy
+            size_t want = shape_cap(c->shape, (size_t)c->remaining);
+            if (want > SENDFILE_CHUNK)
+                want = SENDFILE_CHUNK;
+            ssize_t n = send(c->fd, c->cache->data + c->cache_off, want, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (n < 0)
+            {
+                rconn_close(r, c);
+                return -1;
+            }
+            c->cache_off += (size_t)n;
+            c->remaining -= n;
+            STAT_ADD(bytes_out, n);
+            rconn_moved(c, (size_t)n);
+            continue;
+        }
+
+        if (c->zero_copy)
+        {
+            // Kernel moves file pages straight to the socket
+            size_t want = shape_cap(c->shape, SENDFILE_CHUNK);
+            if (c->remaining > 0 && (long long)want > c->remaining)
+                want = (size_t)c->remaining;
+            ssize_t n = sendfile(c->fd, c->file_fd, NULL, want);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                c->zero_copy = 0; // fall back to the buffered path below
+                continue;
+            }
+            if (n < 0 || (n == 0 && c->remaining > 0) ||
+                (n > 0 && c->crc_on && crc_sent(&c->crc, c->file_fd, (size_t)n) < 0))
+            {
+                rconn_close(r, c);
+                return -1;
+            }
+            if (n == 0)
+                rconn_complete(r, c, NULL);
+            else if (c->remaining > 0)
+                c->remaining -= n;
+            STAT_ADD(bytes_out, n);
+            rconn_moved(c, (size_t)n);
+            continue;
+        }
+
+        // Refill from the file
+        if (rconn_reserve(c, RCONN_CHUNK) < 0)
+        {
+            rconn_close(r, c);
+            return -1;
+        }
+        size_t want = RCONN_CHUNK;
+        if (c->remaining > 0 && (long long)want > c->remaining)
+            want = (size_t)c->remaining;
+        ssize_t n = read(c->file_fd, c->out, want);
+        if (n <= 0)
+        {
+            // Legacy EOF ends the reply; a short session file would desync the stream
+            if (c->remaining > 0)
+            {
+                rconn_close(r, c);
+                return -1;
+            }
+            rconn_complete(r, c, NULL);
+            continue;
+        }
+        if (c->crc_on)
+            c->crc = crc32(c->crc, (const Bytef *)c->out, (uInt)n);
+        c->out_len = (size_t)n;
+        if (c->remaining > 0)
+            c->remaining -= n;
+        STAT_ADD(bytes_out, n);
+        rconn_moved(c, (size_t)n);
+    }
+}
+
+// Grant or re-notify a queued writer, or reply once its upload is
+// committed; returns -1 if it was closed
+static int rconn_on_wake(struct reactor *r, struct rconn *c)
+{
+    if (c->state == RC_COMMIT)
+    {
+        if (!commit_done(c->commit))
+            return 0; // the wake was for someone else
+        reactor_wait_remove(r, c);
+        int err = c->commit->err;
+        free(c->commit);
+        c->commit = NULL;
+        if (c->put && c->put->closed)
+            rconn_put_reply(r, c, err); // a PUT's COMMIT
+        else
+        {
+            c->werr = err;
+            rconn_write_reply(r, c, 1);
+        }
+        // Then whatever the client pipelined behind the payload
+        if (rconn_on_readable(r, c) < 0 || rconn_on_writable(r, c) < 0)
+            return -1;
+        rconn_update_events(r, c);
+        return 0;
+    }
+    int pos = writer_poll(c->lock, &c->waiter);
+    if (pos < 0)
+        return 0;
+    if (pos > 0)
+        rconn_notify_busy(c, pos);
+    else
+    {
+        reactor_wait_remove(r, c);
+        rconn_write_granted(r, c);
+        // Consume payload/SIZE already buffered, then reply
+        if (rconn_on_readable(r, c) < 0)
+            return -1;
+    }
+    if (rconn_on_writable(r, c) < 0)
+        return -1;
+    rconn_update_events(r, c);
+    return 0;
+}
+
+// The eventfd fired: grant or re-notify the writers whose queue place changed
+static void reactor_on_wake(struct reactor *r)
+{
+    uint64_t n;
+    while (read(r->wake_fd, &n, sizeof(n)) < 0 && errno == EINTR)
+        ;
+
+    struct rconn *c = r->waiters;
+    while (c)
+    {
+        struct rconn *next = c->wait_next;
+        if (c->ring_ops > 0)
+            c->ring_wake = 1; // IO_MODE uring: once its requests are back
+        else
+            rconn_on_wake(r, c);
+        c = next;
+    }
+}
+
+// Carry on the paused transfers whose bucket has refilled
+static void reactor_resume(struct reactor *r)
+{
+    if (!r->throttled)
+        return;
+    uint64_t now = hist_now_us();
+    struct rconn *c = r->throttled;
+    while (c)
+    {
+        struct rconn *next = c->thr_next;
+        if (c->resume_us <= now)
+        {
+            rconn_unthrottle(r, c);
+            // IO_MODE uring: a request still out drives it on completion
+            if (!(r->uring && c->ring_ops > 0) && rconn_on_readable(r, c) == 0 &&
+                rconn_on_writable(r, c) == 0)
+                rconn_update_events(r, c);
+        }
+        c = next;
+    }
+}
+
+// Track a new connection; NULL if it had to be dropped
+static struct rconn *rconn_new(struct reactor *r, int fd)
+{
+    printf("New client connected\n");
+    set_nodelay(fd);
+
+    struct rconn *c = calloc(1, sizeof(*c));
+    if (!c)
+    {
+        fprintf(stderr, "Out of memory\n");
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->file_fd = -1;
+    c->base.fd = -1;
+    c->ring_slot = -1;
+    c->state = RC_HELLO;
+    c->accepted_us = hist_now_us();
+    c->events = EPOLLIN;
+
+    if (r->uring)
+    {
+        // Register the socket in the fixed-file table ahead of its first receive
+        if (r->files_ok && r->nslot_free > 0)
+        {
+            int slot = r->slot_free[--r->nslot_free];
+            r->slot_fds[slot] = fd;
+            uring_reserve(&r->ring, 2);
+            struct io_uring_sqe *sqe = uring_prep(&r->ring, IORING_OP_FILES_UPDATE, -1,
+                                                  &r->slot_fds[slot], 1, (uint64_t)slot, 0);
+            if (sqe)
+            {
+                sqe->flags |= IOSQE_IO_LINK;
+                c->ring_slot = slot;
+            }
+            else
+            {
+                r->slot_fds[slot] = -1;
+                r->nslot_free++;
+            }
+        }
+    }
+    else
     {
-        // owner only permissions
-        mkdir(SHARED_DIR, 0700);
+        struct epoll_event e = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &e) < 0)
+        {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+            return NULL;
+        }
     }
+    c->next = r->conns;
+    if (r->conns)
+        r->conns->prev = c;
+    r->conns = c;
+    STAT_ADD(accepted, 1);
+    STAT_ADD(active, 1);
+    return c;
 }
 
-// rwlock for a given filename
-static pthread_rwlock_t *get_file_rwlock(const char *filename)
+static void reactor_accept(struct reactor *r)
 {
-    // Mutex Lock to lock gloabal list
-    pthread_mutex_lock(&g_locks_mu);
-
-    FileLockNode *cur = g_locks;
-    while (cur)
+    for (;;)
     {
-        if (strcmp(cur->name, filename) == 0)
+        int fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
         {
-            // Unlock global list mutex
-            pthread_mutex_unlock(&g_locks_mu);
-            // Return address of rwlock
-            return &cur->rw;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && server_running)
+                perror("Accept failed");
+            return;
         }
-        // Move to next node
-        cur = cur->next;
+        rconn_new(r, fd);
     }
-
-    FileLockNode *node = (FileLockNode *)calloc(1, sizeof(*node));
-    node->name = strdup(filename);
-
-    // Initialize rwlock
-    pthread_rwlock_init(&node->rw, NULL);
-
-    // Insert node at head of list
-    node->next = g_locks;
-    g_locks = node;
-
-    // Unlock global list mutex
-    pthread_mutex_unlock(&g_locks_mu);
-    return &node->rw;
 }
 
-// Receive one line ending with newline from socket
-static int recv_line(int fd, char *buf, size_t cap)
+// What c is in the middle of, for the shutdown report; NULL = nothing
+static const char *rconn_op(const struct rconn *c)
 {
-    size_t i = 0;
-    while (i + 1 < cap)
+    switch (c->state)
     {
-        char ch;
-        ssize_t r = recv(fd, &ch, 1, 0);
-        if (r == 0)
-            return 0; // connection closed
-        if (r < 0)
-            return -1; // error
-        if (ch == '\n')
-            break;
-        buf[i++] = ch;
+    case RC_READ:
+        return "READ";
+    case RC_BATCH:
+        return "BATCH";
+    case RC_WRITE_WAIT:
+    case RC_WRITE_SIZE:
+    case RC_WRITE_RECV:
+    case RC_TRAILER:
+    case RC_COMMIT:
+        return c->batch                   ? "BATCH"
+               : c->delta                 ? "DELTA"
+               : c->chunking              ? "CHUNK"
+               : c->putting               ? "PUT"
+               : c->put && c->put->closed ? "COMMIT"
+                                          : "WRITE";
+    default:
+        return NULL;
     }
-    buf[i] = '\0';
-    return 1;
 }
 
-// Handle READ command for one client
-static void *handle_read(int connection, pthread_rwlock_t *rw, const char *filename)
+/*
+ * Graceful shutdown, per reactor: stop accepting, tell idle
+ * connections SERVER_SHUTDOWN and close them, and let commands in
+ * flight finish (rconn_complete then closes them) for up to
+ * DRAIN_SECS or until a second SIGINT. Returns 1 while there is
+ * something to wait for; the caller closes whatever is left.
+ */
+static int reactor_drain(struct reactor *r)
 {
-    // Test
-    printf("[T%lu] waiting RDLOCK %s\n", (unsigned long)pthread_self(), filename);
+    uint64_t now = hist_now_us();
+    if (!r->drain_until)
+    {
+        r->drain_until = now + (uint64_t)g_conf.drain_secs * 1000000u;
+        if (!r->uring)
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listen_fd, NULL);
+        shutdown(r->listen_fd, SHUT_RD); // frees the port for the next server
+    }
+    if (drain_now || now >= r->drain_until)
+        return 0;
 
-    // Acquire read lock so multiple readers can read together
-    pthread_rwlock_rdlock(rw);
+    int busy = 0;
+    struct rconn *c = r->conns;
+    while (c)
+    {
+        struct rconn *next = c->next;
+        if ((c->state == RC_HELLO || c->state == RC_HEADER) && c->out_off == c->out_len)
+        {
+            send(c->fd, "SERVER_SHUTDOWN\n", 16, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (c->ring_ops > 0)
+            {
+                // IO_MODE uring: this ends its receive, and it is closed once back
+                shutdown(c->fd, SHUT_RDWR);
+                c->state = RC_FLUSH;
+            }
+            else
+                rconn_close(r, c);
+        }
+        else if (c->state != RC_FLUSH)
+            busy++;
+        c = next;
+    }
+    if (busy && !r->drain_told)
+    {
+        printf("[R%d] draining: waiting up to %d s for %d command(s) in flight\n", r->id,
+               g_conf.drain_secs, busy);
+        r->drain_told = 1;
+    }
+    return r->conns != NULL;
+}
 
-    // Test
-    printf("[T%lu] acquired RDLOCK %s\n", (unsigned long)pthread_self(), filename);
+// Shutdown report for a connection about to be cut off
+static void rconn_cut_report(struct reactor *r, const struct rconn *c)
+{
+    const char *op = rconn_op(c);
+    if (op)
+        printf("[R%d] cutting off %s %s after %llu bytes\n", r->id, op, c->filename,
+               (unsigned long long)c->moved);
+}
 
-    // Test
-    nanosleep(&(struct timespec){0, 200000000}, NULL);
+static void *reactor_main(void *arg)
+{
+    struct reactor *r = (struct reactor *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
 
-    // Buffer path
-    char path[1024];
-    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+    while (server_running || reactor_drain(r))
+    {
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, reactor_timeout(r));
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
 
-    // Open file for reading
-    FILE *in = fopen(path, "rb");
+        for (int i = 0; i < n; i++)
+        {
+            struct rconn *c = (struct rconn *)events[i].data.ptr;
+            if (!c)
+            {
+                reactor_accept(r);
+                continue;
+            }
+            if ((void *)c == (void *)r)
+            {
+                reactor_on_wake(r);
+                continue;
+            }
+            uint32_t ev = events[i].events;
+            if ((ev & (EPOLLERR | EPOLLHUP)) && !(ev & EPOLLIN))
+            {
+                rconn_close(r, c);
+                continue;
+            }
+            if ((ev & EPOLLIN) && rconn_on_readable(r, c) < 0)
+                continue;
+            // Flush replies queued above right away instead of waiting for EPOLLOUT
+            if (rconn_on_writable(r, c) < 0)
+                continue;
+            rconn_update_events(r, c);
+        }
+        reactor_resume(r);
+    }
 
-    if (!in)
+    // Shutdown: notify and close everything this reactor owns
+    while (r->conns)
     {
-        printf("[T%lu] releasing RDLOCK %s\n", (unsigned long)pthread_self(), filename);
-        // Release read lock
-        pthread_rwlock_unlock(rw);
-
-        const char *msg = "ERR file not found\n";
+        rconn_cut_report(r, r->conns);
+        send(r->conns->fd, "SERVER_SHUTDOWN\n", 16, MSG_NOSIGNAL | MSG_DONTWAIT);
+        rconn_close(r, r->conns);
+    }
+    if (r->pipefd[0] >= 0)
+    {
+        close(r->pipefd[0]);
+        close(r->pipefd[1]);
+    }
+    zcodec_free(&r->zc);
+    free(r->zraw);
+    close(r->epfd);
+    return NULL;
+}
 
-        // Send error to client
-        send(connection, msg, strlen(msg), 0);
+/* ============================================================
+ * IO_URING REACTOR (IO_MODE uring)
+ *
+ * The same reactors and connection state machine, but instead of
+ * waiting for readiness and then making one syscall per receive,
+ * send, file read or write, each reactor queues those operations
+ * as io_uring requests and hands all of them to the kernel in the
+ * single io_uring_enter() that also waits for completions. Sockets
+ * sit in a fixed-file table and file data moves through registered
+ * buffers. A connection has at most one request (or one read->send
+ * chain) in flight; its handlers only run when all are back.
+ * Compressed uploads and large uncached READs still use the
+ * non-blocking syscalls (rconn_frame_recv, sendfile), after a ring
+ * poll says the socket is ready.
+ * ============================================================ */
+#define RING_ENTRIES 256
+#define RING_BUFS 32              // registered transfer buffers per reactor
+#define RING_BUF_SIZE (64 << 10)
+#define RING_FILES 1024           // fixed-file slots per reactor
 
-        // Close connection
-        close(connection);
+// user_data: the connection with its request kind in the low bits
+// (calloc'ed, so aligned), or one of the reactor's own requests
+enum ring_op
+{
+    RING_RECV = 1,   // command input into c->in
+    RING_RECV_DATA,  // upload payload into rbuf
+    RING_SEND,       // queued output from c->out
+    RING_SEND_DATA,  // READ data from rbuf or the cache
+    RING_FILE_READ,  // file into rbuf (linked to a RING_SEND_DATA)
+    RING_FILE_WRITE, // rbuf into the upload's file
+    RING_POLL        // readiness for the syscall fallbacks
+};
+#define RING_OP_MASK 7u
+#define RING_ACCEPT 1 // user_data of the reactor's accept
+#define RING_WAKE 2   // ... and of its eventfd poll
 
-        // Ends thread
+static struct io_uring_sqe *rconn_ring_prep(struct reactor *r, struct rconn *c, int op,
+                                            uint8_t opcode, const void *addr, size_t len)
+{
+    int file = op == RING_FILE_READ || op == RING_FILE_WRITE;
+    int fixed = !file && c->ring_slot >= 0;
+    int fd = file ? c->file_fd : fixed ? c->ring_slot : c->fd;
+    uint64_t off = file ? (uint64_t)-1 : 0; // files: at the current position
+    struct io_uring_sqe *sqe = uring_prep(&r->ring, opcode, fd, addr, (unsigned)len, off,
+                                          (uint64_t)(uintptr_t)c | (uint64_t)op);
+    if (!sqe)
         return NULL;
+    if (fixed)
+        sqe->flags |= IOSQE_FIXED_FILE;
+    if (file && c->rbuf_idx >= 0 && r->bufs_ok)
+    {
+        sqe->opcode = op == RING_FILE_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)c->rbuf_idx;
     }
+    if (opcode == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; // the kernel retries short sends
+    c->ring_ops++;
+    return sqe;
+}
 
-    // Buffer used to send file data
-    char buf2[65536];
+// A transfer buffer for the current command: registered if one is free
+static int rconn_ring_buf(struct reactor *r, struct rconn *c)
+{
+    if (c->rbuf)
+        return 0;
+    if (r->nbuf_free > 0)
+    {
+        c->rbuf_idx = r->buf_free[--r->nbuf_free];
+        c->rbuf = r->ring_mem + (size_t)c->rbuf_idx * RING_BUF_SIZE;
+        return 0;
+    }
+    c->rbuf_idx = -1;
+    c->rbuf = malloc(RING_BUF_SIZE);
+    return c->rbuf ? 0 : -1;
+}
 
-    // Number of bytes read from file
-    size_t nread;
+static int rconn_ring_poll(struct reactor *r, struct rconn *c, unsigned events)
+{
+    struct io_uring_sqe *sqe = rconn_ring_prep(r, c, RING_POLL, IORING_OP_POLL_ADD, NULL, 0);
+    if (!sqe)
+        return -1;
+    sqe->poll32_events = events;
+    return 0;
+}
 
-    while ((nread = fread(buf2, 1, sizeof(buf2), in)) > 0)
+// RC_READ: send what rbuf holds, the next piece of the cache, or read the
+// next piece of the file and send it in one linked chain
+static int rconn_ring_read(struct reactor *r, struct rconn *c)
+{
+    if (c->rbuf_len > c->rbuf_off)
+        return rconn_ring_prep(r, c, RING_SEND_DATA, IORING_OP_SEND, c->rbuf + c->rbuf_off,
+                               c->rbuf_len - c->rbuf_off)
+                   ? 0
+                   : -1;
+    if (c->cache)
     {
-        if (send(connection, buf2, nread, 0) < 0)
-            break;
-
-        // Test
-        nanosleep(&(struct timespec){0, 20000000}, NULL);
+        size_t want = shape_cap(c->shape, (size_t)c->remaining);
+        if (want > SENDFILE_CHUNK)
+            want = SENDFILE_CHUNK;
+        return rconn_ring_prep(r, c, RING_SEND_DATA, IORING_OP_SEND,
+                               c->cache->data + c->cache_off, want)
+                   ? 0
+                   : -1;
     }
+    if (!rconn_ring_sends(c))
+        return rconn_ring_poll(r, c, POLLOUT);
 
-    // Close file
-    fclose(in);
-
-    // Release read lock
-    pthread_rwlock_unlock(rw);
-    close(connection);
-    return NULL;
+    if (rconn_ring_buf(r, c) < 0)
+        return -1;
+    size_t want = RING_BUF_SIZE;
+    if (c->remaining >= 0 && (long long)want > c->remaining)
+        want = (size_t)c->remaining;
+    // A short read breaks the link: the send is cancelled and the bytes
+    // that did arrive go out from rconn_ring_arm() instead
+    uring_reserve(&r->ring, 2);
+    struct io_uring_sqe *sqe = rconn_ring_prep(r, c, RING_FILE_READ, IORING_OP_READ, c->rbuf, want);
+    if (!sqe)
+        return -1;
+    sqe->flags |= IOSQE_IO_LINK;
+    rconn_ring_prep(r, c, RING_SEND_DATA, IORING_OP_SEND, c->rbuf, want);
+    return 0;
 }
 
-// Handle WRITE command for one client
-static void *handle_write(int connection, pthread_rwlock_t *rw, const char *filename, const char *confirmation)
+// RC_WRITE_RECV: store what rbuf holds, or receive the next piece
+static int rconn_ring_payload(struct reactor *r, struct rconn *c)
 {
+    if (c->rbuf_len > c->rbuf_off)
+        return rconn_ring_prep(r, c, RING_FILE_WRITE, IORING_OP_WRITE, c->rbuf + c->rbuf_off,
+                               c->rbuf_len - c->rbuf_off)
+                   ? 0
+                   : -1;
+    if (rconn_ring_buf(r, c) < 0)
+        return -1;
+    size_t want = RING_BUF_SIZE;
+    if (c->remaining >= 0 && (long long)want > c->remaining)
+        want = (size_t)c->remaining;
+    return rconn_ring_prep(r, c, RING_RECV_DATA, IORING_OP_RECV, c->rbuf, want) ? 0 : -1;
+}
 
-    // Test
-    printf("[T%lu] waiting WRLOCK %s\n", (unsigned long)pthread_self(), filename);
-
-    /*
-     * Part 3: Real-time notifications when file is already being edited.
-     * We try to acquire WRLOCK. If busy, notify client immediately.
-     */
-    for (;;)
+// Queue the request the connection's state calls for, if it has none out
+static void rconn_ring_arm(struct reactor *r, struct rconn *c)
+{
+    if (c->ring_ops > 0)
+        return;
+    int rc = 0;
+    if (c->out_off < c->out_len)
     {
-        int trc = pthread_rwlock_trywrlock(rw);
-        if (trc == 0)
-            break; // acquired
-        // Busy (likely EBUSY). Notify client and retry.
-        char note[1024];
-        snprintf(note, sizeof(note), "NOTIFY BUSY %s\n", filename);
-        send(connection, note, strlen(note), 0);
-        nanosleep(&(struct timespec){0, 200000000}, NULL); // 200ms retry; keeps "real-time" feel
+        // A READ reply's data follows its header in the same chain
+        int data = c->state == RC_READ && !c->compress && c->remaining != 0 &&
+                   rconn_ring_sends(c) && !rconn_throttle(r, c);
+        if (data)
+            uring_reserve(&r->ring, 3);
+        struct io_uring_sqe *sqe = rconn_ring_prep(r, c, RING_SEND, IORING_OP_SEND,
+                                                   c->out + c->out_off, c->out_len - c->out_off);
+        if (!sqe)
+            rc = -1;
+        else if (data)
+        {
+            sqe->flags |= IOSQE_IO_LINK;
+            rconn_ring_read(r, c);
+        }
     }
+    else if ((c->state == RC_READ || c->state == RC_WRITE_RECV) && rconn_throttle(r, c))
+        ; // bandwidth shaping: reactor_resume() arms it again
+    else if (c->state == RC_READ && !c->compress)
+        rc = rconn_ring_read(r, c);
+    else if (c->state == RC_WRITE_RECV && !c->compress)
+        rc = rconn_ring_payload(r, c);
+    else if (c->state == RC_WRITE_RECV)
+        rc = rconn_ring_poll(r, c, POLLIN); // rconn_frame_recv() reads the frames
+    else if (rconn_wants_input(c))
+        rc = rconn_ring_prep(r, c, RING_RECV, IORING_OP_RECV, c->in + c->in_len,
+                             sizeof(c->in) - 1 - c->in_len)
+                 ? 0
+                 : -1;
+    if (rc < 0 && c->ring_ops == 0)
+        rconn_close(r, c);
+}
 
-    printf("[T%lu] acquired WRLOCK %s\n", (unsigned long)pthread_self(), filename);
+// One of the connection's requests completed with res
+static void rconn_ring_done(struct reactor *r, struct rconn *c, int op, int res)
+{
+    c->ring_ops--;
+    // Retried by the next rconn_ring_arm(); a cancelled first receive means
+    // the fixed-file registration linked ahead of it failed
+    int retry = res == -EAGAIN || res == -EINTR || res == -ECANCELED;
+    if (res == -ECANCELED && op == RING_RECV && c->ring_slot >= 0)
+    {
+        r->slot_fds[c->ring_slot] = -1;
+        r->slot_free[r->nslot_free++] = c->ring_slot;
+        c->ring_slot = -1;
+    }
 
-    // Tell client it can start sending file contents now
+    switch (op)
     {
-        char ok[1024];
-        snprintf(ok, sizeof(ok), "OK WRITE %s\n", filename);
-        send(connection, ok, strlen(ok), 0);
+    case RING_RECV:
+        if (res <= 0 && !retry)
+            c->ring_err = 1;
+        else if (res > 0)
+            c->in_len += (size_t)res;
+        break;
+    case RING_RECV_DATA:
+        if (res < 0 && !retry)
+            c->ring_err = 1;
+        else if (res == 0 && c->remaining >= 0)
+        {
+            printf("Client left before sending all of '%s'\n", c->filename);
+            c->ring_err = 1;
+        }
+        else if (res == 0)
+            c->ring_eof = 1; // legacy client half-closed: payload complete
+        else if (res > 0)
+        {
+            if (c->crc_on)
+                c->crc = crc32(c->crc, (const Bytef *)c->rbuf, (uInt)res);
+            if (c->discard)
+                rconn_payload_advance(r, c, (size_t)res);
+            else
+            {
+                c->rbuf_len = (size_t)res;
+                c->rbuf_off = 0;
+            }
+        }
+        break;
+    case RING_FILE_WRITE:
+        if (res <= 0)
+        {
+            // Like write_all(): keep consuming, report the error at the end
+            c->werr = res < 0 ? -res : EIO;
+            c->discard = 1;
+            c->rbuf_off = c->rbuf_len;
+        }
+        else
+            c->rbuf_off += (size_t)res;
+        if (c->rbuf_off == c->rbuf_len)
+        {
+            size_t n = c->rbuf_len;
+            c->rbuf_len = c->rbuf_off = 0;
+            rconn_payload_advance(r, c, n);
+        }
+        break;
+    case RING_SEND:
+        if (res < 0 && !retry)
+            c->ring_err = 1;
+        else if (res > 0)
+        {
+            c->out_off += (size_t)res;
+            if (c->out_off == c->out_len)
+                c->out_off = c->out_len = 0;
+        }
+        break;
+    case RING_FILE_READ:
+        if (res > 0)
+        {
+            if (c->crc_on)
+                c->crc = crc32(c->crc, (const Bytef *)c->rbuf, (uInt)res);
+            c->rbuf_len = (size_t)res;
+            c->rbuf_off = 0;
+        }
+        else if (res == 0)
+            c->ring_eof = 1;
+        else
+            c->ring_err = 1;
+        break;
+    case RING_SEND_DATA:
+        if (res < 0 && !retry)
+            c->ring_err = 1;
+        else if (res > 0 && c->rbuf_len > 0)
+        {
+            c->rbuf_off += (size_t)res;
+            if (c->rbuf_off == c->rbuf_len)
+            {
+                if (c->remaining > 0)
+                    c->remaining -= (long long)c->rbuf_len;
+                STAT_ADD(bytes_out, c->rbuf_len);
+                rconn_moved(c, c->rbuf_len);
+                c->rbuf_len = c->rbuf_off = 0;
+            }
+        }
+        else if (res > 0)
+        {
+            c->cache_off += (size_t)res;
+            c->remaining -= res;
+            STAT_ADD(bytes_out, res);
+            rconn_moved(c, (size_t)res);
+        }
+        break;
+    default: // RING_POLL: the handlers below make the syscalls
+        break;
     }
+    if (c->ring_ops > 0)
+        return;
 
-    // usleep(300000);
+    if (c->ring_err)
+    {
+        rconn_close(r, c);
+        return;
+    }
+    if (c->ring_eof)
+    {
+        c->ring_eof = 0;
+        if (c->state == RC_WRITE_RECV)
+            rconn_write_done(r, c);
+        else if (c->remaining > 0)
+        {
+            rconn_close(r, c); // the file got shorter: the stream would desync
+            return;
+        }
+        else
+            rconn_complete(r, c, NULL); // legacy READ: end of file ends the reply
+    }
+    if (rconn_on_readable(r, c) < 0 || rconn_on_writable(r, c) < 0)
+        return;
+    if (c->ring_wake && c->out_off == c->out_len)
+    {
+        c->ring_wake = 0;
+        if (c->waiting)
+        {
+            rconn_on_wake(r, c);
+            return;
+        }
+    }
+    rconn_ring_arm(r, c);
+}
 
-    char path[1024];
-    snprintf(path, sizeof(path), "%s/%s", SHARED_DIR, filename);
+static void reactor_ring_accept(struct reactor *r)
+{
+    struct io_uring_sqe *sqe = uring_prep(&r->ring, IORING_OP_ACCEPT, r->listen_fd, NULL, 0, 0,
+                                          RING_ACCEPT);
+    if (sqe)
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
 
-    // Open file for writing binary and overwrite
-    FILE *out = fopen(path, "wb");
+static void reactor_ring_wake(struct reactor *r)
+{
+    struct io_uring_sqe *sqe = uring_prep(&r->ring, IORING_OP_POLL_ADD, r->wake_fd, NULL, 0, 0,
+                                          RING_WAKE);
+    if (sqe)
+        sqe->poll32_events = POLLIN;
+}
 
-    if (!out)
+// Ring, registered buffers and fixed-file table of one reactor; a buffer
+// or file registration the kernel refuses only costs the fast path
+static int reactor_ring_setup(struct reactor *r)
+{
+    if (uring_init(&r->ring, RING_ENTRIES) < 0)
+        return -1;
+    r->buf_free = malloc(RING_BUFS * sizeof(int));
+    r->slot_fds = malloc(RING_FILES * sizeof(int));
+    r->slot_free = malloc(RING_FILES * sizeof(int));
+    if (!r->buf_free || !r->slot_fds || !r->slot_free ||
+        posix_memalign((void **)&r->ring_mem, 4096, (size_t)RING_BUFS * RING_BUF_SIZE) != 0)
     {
-        perror("Failed to open the file in the server");
-        pthread_rwlock_unlock(rw);
-        close(connection);
-        return NULL;
+        errno = ENOMEM;
+        return -1;
     }
 
-    // Print where the server is saving the file
-    printf("Saving to '%s'...\n", path);
-
-    char buf[65536];
-    ssize_t r;
-    while ((r = recv(connection, buf, sizeof(buf), 0)) > 0)
+    struct iovec iov[RING_BUFS];
+    for (int i = 0; i < RING_BUFS; i++)
     {
-        fwrite(buf, 1, r, out);
+        r->buf_free[r->nbuf_free++] = RING_BUFS - 1 - i;
+        iov[i].iov_base = r->ring_mem + (size_t)i * RING_BUF_SIZE;
+        iov[i].iov_len = RING_BUF_SIZE;
     }
+    r->bufs_ok = uring_register_buffers(&r->ring, iov, RING_BUFS) == 0;
+    if (!r->bufs_ok)
+        printf("[R%d] io_uring: buffers not registered (%s)\n", r->id, strerror(errno));
 
-    // Close output file
-    fclose(out);
-
-    // Release write lock after finishing write
-    pthread_rwlock_unlock(rw);
-
-    // Send confirmation to client
-    if (send(connection, confirmation, strlen(confirmation), 0) < 0)
+    for (int i = 0; i < RING_FILES; i++)
     {
-        perror("Confirmation");
+        r->slot_fds[i] = -1;
+        r->slot_free[r->nslot_free++] = RING_FILES - 1 - i;
     }
-
-    close(connection);
-    printf("Client done: file '%s' received\n", filename);
-    return NULL;
+    r->files_ok = uring_register_files(&r->ring, r->slot_fds, RING_FILES) == 0;
+    if (!r->files_ok)
+        printf("[R%d] io_uring: files not registered (%s)\n", r->id, strerror(errno));
+    return 0;
 }
 
-// Thread entry point
-static void *handle_client(void *arg)
+static void *reactor_ring_main(void *arg)
 {
-    // Cast thread argument
-    struct client_ctx *ctx = (struct client_ctx *)arg;
+    struct reactor *r = (struct reactor *)arg;
 
-    int connection = ctx->fd;
-    free(ctx); // Free context memory
+    reactor_ring_accept(r);
+    reactor_ring_wake(r);
+    while (server_running || reactor_drain(r))
+    {
+        if (uring_enter(&r->ring, reactor_timeout(r)) < 0)
+        {
+            perror("io_uring_enter");
+            break;
+        }
 
-    const char *confirmation = "File Received by server\n";
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&r->ring)) != NULL)
+        {
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(&r->ring);
 
-    // Line buffer
-    char line[1024];
+            struct rconn *c = (struct rconn *)(uintptr_t)(ud & ~(uint64_t)RING_OP_MASK);
+            if (c)
+                rconn_ring_done(r, c, (int)(ud & RING_OP_MASK), res);
+            else if (ud == RING_ACCEPT)
+            {
+                if (res >= 0 && (c = rconn_new(r, res)) != NULL)
+                    rconn_ring_arm(r, c);
+                else if (res < 0 && res != -EINTR && res != -EAGAIN && server_running)
+                    fprintf(stderr, "Accept failed: %s\n", strerror(-res));
+                if (server_running)
+                    reactor_ring_accept(r);
+            }
+            else if (ud == RING_WAKE)
+            {
+                reactor_on_wake(r);
+                reactor_ring_wake(r);
+            }
+        }
+        reactor_resume(r);
+    }
 
-    // ===== PHASE 1 PARTIAL: HANDSHAKE =====
-    if (recv_line(connection, line, sizeof(line)) <= 0 ||
-        strncmp(line, "HELLO", 5) != 0)
+    // Shutdown: notify everyone, let the kernel give back every buffer it
+    // still holds, then close
+    for (struct rconn *c = r->conns; c; c = c->next)
     {
-        send(connection, "ERR Handshake required\n", 24, 0);
-        close(connection);
-        return NULL;
+        if (c->state == RC_FLUSH)
+            continue; // told while draining
+        rconn_cut_report(r, c);
+        send(c->fd, "SERVER_SHUTDOWN\n", 16, MSG_NOSIGNAL | MSG_DONTWAIT);
+        shutdown(c->fd, SHUT_RDWR);
     }
-    send(connection, "OK\n", 3, 0);
-    // ====================================
+    for (int tries = 0; tries < 50; tries++)
+    {
+        int busy = 0;
+        for (struct rconn *c = r->conns; c; c = c->next)
+            busy |= c->ring_ops > 0;
+        if (!busy || uring_enter(&r->ring, 100) < 0)
+            break;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&r->ring)) != NULL)
+        {
+            struct rconn *c =
+                (struct rconn *)(uintptr_t)(cqe->user_data & ~(uint64_t)RING_OP_MASK);
+            if (c)
+                c->ring_ops--;
+            uring_seen(&r->ring);
+        }
+    }
+    while (r->conns)
+        rconn_close(r, r->conns);
+    printf("[R%d] io_uring: %llu requests in %llu io_uring_enter calls\n", r->id,
+           r->ring.submitted, r->ring.enters);
+    uring_free(&r->ring);
+    zcodec_free(&r->zc);
+    free(r->zraw);
+    free(r->ring_mem);
+    free(r->buf_free);
+    free(r->slot_fds);
+    free(r->slot_free);
+    return NULL;
+}
 
-    // Read actual command
-    if (recv_line(connection, line, sizeof(line)) <= 0)
+static void *reactor_ring_start(void *arg)
+{
+    struct reactor *r = (struct reactor *)arg;
+    if (reactor_ring_setup(r) < 0)
     {
-        close(connection);
+        perror("io_uring setup");
+        uring_free(&r->ring);
+        free(r->ring_mem);
+        free(r->buf_free);
+        free(r->slot_fds);
+        free(r->slot_free);
         return NULL;
     }
+    return reactor_ring_main(r);
+}
 
-    // Parse header into cmd and filename
-    char cmd[16], filename[512];
-    if (sscanf(line, "%15s %511s", cmd, filename) != 2)
+// Start the reactor threads and wait until shutdown
+static int run_reactors(int sockfd)
+{
+    int n = g_conf.reactor_threads;
+
+    // Each connection costs one fd; lift the soft limit as far as allowed
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
     {
-        send(connection, "ERR bad header\n", 15, 0);
-        close(connection);
-        return NULL;
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
 
-    // Reject unsafe filenames
-    if (strstr(filename, "..") != NULL || strchr(filename, '/') != NULL)
+    int uring = g_conf.mode == IO_URING;
+    if (uring)
     {
-        const char *msg = "ERR invalid filename\n";
-        send(connection, msg, strlen(msg), 0);
-        close(connection);
-        return NULL;
+        // Registered buffers count as locked memory
+        if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+        {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_MEMLOCK, &rl);
+        }
+        struct uring probe;
+        if (uring_init(&probe, 8) < 0)
+        {
+            printf("io_uring unavailable (%s), using epoll\n", strerror(errno));
+            uring = 0;
+        }
+        else
+            uring_free(&probe);
     }
+    // The ring's accept waits in the kernel; epoll needs accept4() to fail fast
+    if (!uring)
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 
-    // readlock
-    pthread_rwlock_t *rw = get_file_rwlock(filename);
+    struct reactor *rs = calloc((size_t)n, sizeof(*rs));
+    pthread_t *tids = calloc((size_t)n, sizeof(*tids));
+    if (!rs || !tids)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(rs);
+        free(tids);
+        return -1;
+    }
 
-    // If command is not READ and not WRITE
-    if (strcmp(cmd, "READ") != 0 && strcmp(cmd, "WRITE") != 0)
+    int started = 0;
+    for (int i = 0; i < n; i++)
     {
-        const char *msg = "ERR unknown command. Use READ or WRITE\n";
-        send(connection, msg, strlen(msg), 0);
-        close(connection);
-        return NULL;
+        rs[i].id = i;
+        rs[i].listen_fd = sockfd;
+        if (uring)
+        {
+            // Each thread sets up its own ring (one submitter per ring)
+            rs[i].uring = 1;
+            rs[i].epfd = -1;
+            rs[i].pipefd[0] = rs[i].pipefd[1] = -1;
+            rs[i].no_splice = 1;
+            rs[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (rs[i].wake_fd < 0 || pthread_create(&tids[i], NULL, reactor_ring_start, &rs[i]) != 0)
+            {
+                perror("reactor start");
+                if (rs[i].wake_fd >= 0)
+                    close(rs[i].wake_fd);
+                break;
+            }
+            started++;
+            continue;
+        }
+        if (open_splice_pipe(rs[i].pipefd, O_NONBLOCK) < 0)
+        {
+            rs[i].pipefd[0] = rs[i].pipefd[1] = -1;
+            rs[i].no_splice = 1;
+        }
+        rs[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        rs[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (rs[i].epfd < 0 || rs[i].wake_fd < 0)
+        {
+            perror("epoll_create1/eventfd");
+            break;
+        }
+        // EPOLLEXCLUSIVE: wake one reactor per incoming connection
+        struct epoll_event e = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+        struct epoll_event we = {.events = EPOLLIN, .data.ptr = &rs[i]};
+        if (epoll_ctl(rs[i].epfd, EPOLL_CTL_ADD, sockfd, &e) < 0 ||
+            epoll_ctl(rs[i].epfd, EPOLL_CTL_ADD, rs[i].wake_fd, &we) < 0 ||
+            pthread_create(&tids[i], NULL, reactor_main, &rs[i]) != 0)
+        {
+            perror("reactor start");
+            close(rs[i].epfd);
+            close(rs[i].wake_fd);
+            break;
+        }
+        started++;
     }
+    printf("Running %d %s reactor thread(s)\n", started, uring ? "io_uring" : "epoll");
 
-    // Call Read handler
-    if (strcmp(cmd, "READ") == 0)
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    // Only now: a closing reactor may still hand a lock to another's writer
+    for (int i = 0; i < started; i++)
+        close(rs[i].wake_fd);
+
+    free(rs);
+    free(tids);
+    return started > 0 ? 0 : -1;
+}
+/* ============================================================ */
+
+// Read server_conf; unknown keys are ignored
+static int load_server_conf(const char *path)
+{
+    FILE *cfg = fopen(path, "r");
+    if (cfg == NULL)
     {
-        return handle_read(connection, rw, filename);
+        printf("Please, check the server configuration file\n");
+        return -1;
     }
 
-    // Call Write handler
-    if (strcmp(cmd, "WRITE") == 0)
+    char key[64], val[256];
+    while (fscanf(cfg, "%63s %255s", key, val) == 2)
     {
-        return handle_write(connection, rw, filename, confirmation);
+        if (strcmp(key, "PORT_NO") == 0)
+            g_conf.port = atoi(val);
+        else if (strcmp(key, "IO_MODE") == 0)
+            g_conf.mode = strcmp(val, "epoll") == 0   ? IO_EPOLL
+                          : strcmp(val, "uring") == 0 ? IO_URING
+                                                      : IO_THREADS;
+        else if (strcmp(key, "REACTOR_THREADS") == 0)
+            g_conf.reactor_threads = atoi(val) > 0 ? atoi(val) : 1;
+        else if (strcmp(key, "POOL_SIZE") == 0)
+            g_conf.pool_size = atoi(val) > 0 ? atoi(val) : 1;
+        else if (strcmp(key, "QUEUE_SIZE") == 0)
+            g_conf.queue_size = atoi(val) > 0 ? atoi(val) : 1;
+        else if (strcmp(key, "BACKLOG") == 0)
+            g_conf.backlog = atoi(val) > 0 ? atoi(val) : SOMAXCONN;
+        else if (strcmp(key, "TEST_DELAYS") == 0)
+            g_conf.test_delays = atoi(val) != 0;
+        else if (strcmp(key, "CACHE_MB") == 0)
+            g_conf.cache_mb = atoi(val) > 0 ? atoi(val) : 0;
+        else if (strcmp(key, "CACHE_FILE_KB") == 0)
+            g_conf.cache_file_kb = atoi(val) > 0 ? atoi(val) : 0;
+        else if (strcmp(key, "COMPRESSION") == 0)
+            g_conf.compression = atoi(val) != 0;
+        else if (strcmp(key, "DURABILITY") == 0)
+            g_conf.durability = strcmp(val, "fdatasync") == 0 ? DUR_FDATASYNC
+                                : strcmp(val, "group") == 0   ? DUR_GROUP
+                                                              : DUR_NONE;
+        else if (strcmp(key, "GROUP_COMMIT_MS") == 0)
+            g_conf.group_commit_ms = atoi(val) > 0 ? atoi(val) : 0;
+        else if (strcmp(key, "RATE_CLIENT_KBPS") == 0)
+            g_conf.rate_client_kbps = atoi(val) > 0 ? atoi(val) : 0;
+        else if (strcmp(key, "RATE_TOTAL_KBPS") == 0)
+            g_conf.rate_total_kbps = atoi(val) > 0 ? atoi(val) : 0;
+        else if (strcmp(key, "RATE_BURST_KB") == 0)
+            g_conf.rate_burst_kb = atoi(val) > 0 ? atoi(val) : 0;
+        else if (strcmp(key, "RATE_WEIGHT") == 0)
+            shape_weight_conf(val);
+        else if (strcmp(key, "DRAIN_SECS") == 0)
+            g_conf.drain_secs = atoi(val) > 0 ? atoi(val) : 0;
     }
+    fclose(cfg);
 
-    // Error
-    const char *msg = "ERR unknown command. Use READ or WRITE\n";
-    send(connection, msg, strlen(msg), 0);
-    close(connection);
-    return NULL;
+    if (g_conf.port <= 0)
+    {
+        printf("Invalid server_conf format\n");
+        return -1;
+    }
+    return 0;
 }
 
 int main()
 {
-    signal(SIGINT, handle_sigint); // ===== PHASE 4 ADD =====
+    // ===== PHASE 4 ADD =====
+    // SIGINT/SIGTERM start the drain. Without SA_RESTART the blocking
+    // accept() returns; helper threads block both so it is the main
+    // thread that gets them.
+    struct sigaction sa = {.sa_handler = handle_sigint};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);      // peer resets surface as send() errors
+    sigset_t stop_sigs;
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGINT);
+    sigaddset(&stop_sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
 
-    int port;
-    char buf[64];
     struct sockaddr_in addr = {0};
-    int backlog = 10;
-    FILE *server_config = fopen("server_conf", "r");
 
-    if (server_config == NULL)
+    if (load_server_conf("server_conf") < 0)
+        return -1;
+    int backlog = g_conf.backlog;
+    int port = g_conf.port;
+    printf("Server will be Listening to the Port : %d\n", port);
+
+    shared_dir();
+    if (index_start() < 0)
     {
-        printf("Please, check the server configuration file\n");
+        perror("Could not index " SHARED_DIR);
         return -1;
     }
-    else
+    if (watch_start() < 0)
+        perror("Could not start the watch thread: WATCH is unavailable");
+    if (g_conf.durability != DUR_NONE && commit_start() < 0)
     {
-        if (fscanf(server_config, "%s %d", buf, &port) != 2)
-        {
-            printf("Invalid server_conf format\n");
-            fclose(server_config);
-            return -1;
-        }
-        printf("Server will be Listening to the Port : %d\n", port);
+        perror("Could not start the commit thread");
+        return -1;
     }
-    fclose(server_config);
-
-    shared_dir();
+    if (g_conf.durability == DUR_GROUP)
+        printf("Durability: group commit, %d ms window\n", g_conf.group_commit_ms);
+    else if (g_conf.durability == DUR_FDATASYNC)
+        printf("Durability: fdatasync every upload\n");
+    g_cache.budget = (size_t)g_conf.cache_mb << 20;
+    g_cache.max_file = (size_t)g_conf.cache_file_kb << 10;
 
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
@@ -402,6 +7332,30 @@ int main()
 
     printf("Server is Listening on the Port %d...\n", port);
 
+    if (g_conf.mode != IO_THREADS)
+    {
+        // The reactors notice server_running on their own
+        pthread_sigmask(SIG_UNBLOCK, &stop_sigs, NULL);
+        int rc = run_reactors(sockfd);
+        commit_drain();
+        watch_stop();
+        cache_report();
+        commit_report();
+        close(sockfd);
+        printf("Server shut down cleanly\n");
+        return rc;
+    }
+
+    int workers = pool_start(g_conf.pool_size, g_conf.queue_size);
+    if (workers == 0)
+    {
+        fprintf(stderr, "Could not start worker pool\n");
+        close(sockfd);
+        return -1;
+    }
+    printf("Running %d worker thread(s), queue of %d\n", workers, g_conf.queue_size);
+    pthread_sigmask(SIG_UNBLOCK, &stop_sigs, NULL);
+
     while (server_running)
     {
         int connection = accept(sockfd, NULL, NULL);
@@ -414,49 +7368,34 @@ int main()
             perror("Accept failed");
             continue;
         }
-        printf("New client connected\n");
-
-        /* ===== PHASE 4: track connected client ===== */
-        pthread_mutex_lock(&client_mu);
-        if (client_count < MAX_CLIENTS)
-            client_fds[client_count++] = connection;
-        pthread_mutex_unlock(&client_mu);
-        /* =========================================== */
-
-        struct client_ctx *ctx = malloc(sizeof(*ctx));
 
-        if (!ctx)
-        {
-            fprintf(stderr, "Out of memory\n");
-            close(connection);
-            continue;
-        }
-        ctx->fd = connection;
+        set_nodelay(connection);
+        STAT_ADD(accepted, 1);
+        STAT_ADD(active, 1); // before the worker can see it and count it down
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, ctx) != 0)
+        // Admission control: fail fast instead of queueing without bound
+        if (pool_submit(connection) < 0)
         {
-            perror("pthread_create");
+            STAT_ADD(rejected, 1);
+            STAT_ADD(active, -1);
+            const char *msg = "ERR busy, retry\n";
+            send(connection, msg, strlen(msg), MSG_DONTWAIT);
             close(connection);
-            free(ctx);
             continue;
         }
-
-        pthread_detach(tid);
+        printf("New client connected\n");
     }
 
+    close(sockfd); // frees the port for the next server
+
     /* ===== PHASE 4: notify all clients on shutdown ===== */
-    pthread_mutex_lock(&client_mu);
-    for (int i = 0; i < client_count; i++)
-    {
-        send(client_fds[i], "SERVER_SHUTDOWN\n", 16, 0);
-        close(client_fds[i]);
-    }
-    client_count = 0;
-    pthread_mutex_unlock(&client_mu);
+    conns_drain();
+    watch_stop();
     /* ================================================== */
 
-    close(sockfd);
+    pool_report();
+    cache_report();
+    commit_report();
     printf("Server shut down cleanly\n");
     return 0;
 }
@@ -0,0 +1,232 @@
+// uring.c
+// Minimal io_uring plumbing over the raw syscalls, for IO_MODE uring.
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg,
+                     size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(struct uring *u, unsigned entries)
+{
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    // One thread submits and reaps, so completion work can wait for our
+    // next io_uring_enter(); older kernels reject these flags
+    static const unsigned tries[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_COOP_TASKRUN,
+        0,
+    };
+    struct io_uring_params p;
+    int fd = -1;
+    for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]) && fd < 0; i++)
+    {
+        memset(&p, 0, sizeof(p));
+        p.flags = tries[i];
+        fd = sys_setup(entries, &p);
+        if (fd < 0 && errno != EINVAL)
+            return -1;
+    }
+    if (fd < 0)
+        return -1;
+    // The event loop waits with a timeout passed to io_uring_enter()
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+    {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    u->fd = fd;
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_map_len > u->sq_map_len)
+            u->sq_map_len = u->cq_map_len;
+        u->cq_map_len = u->sq_map_len;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED)
+    {
+        u->sq_map = NULL;
+        uring_free(u);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_map = u->sq_map;
+    else
+    {
+        u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED)
+        {
+            u->cq_map = NULL;
+            uring_free(u);
+            return -1;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        uring_free(u);
+        return -1;
+    }
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->entries = p.sq_entries;
+
+    // SQE i always sits in slot i, so the index array never changes
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    return 0;
+}
+
+void uring_free(struct uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map)
+        munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    u->sqes = NULL;
+    u->sq_map = u->cq_map = NULL;
+    u->fd = -1;
+}
+
+// Hand prepared SQEs to the kernel without waiting
+static int uring_submit(struct uring *u)
+{
+    while (u->queued > 0)
+    {
+        int n = sys_enter(u->fd, u->queued, 0, 0, NULL, 0);
+        u->enters++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        u->queued -= (unsigned)n;
+        u->submitted += (unsigned)n;
+    }
+    return 0;
+}
+
+void uring_reserve(struct uring *u, unsigned n)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (*u->sq_tail - head + n > u->entries)
+        uring_submit(u);
+}
+
+struct io_uring_sqe *uring_prep(struct uring *u, uint8_t op, int fd, const void *addr,
+                                unsigned len, uint64_t off, uint64_t user_data)
+{
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries)
+    {
+        if (uring_submit(u) < 0)
+            return NULL;
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    // The kernel only reads the tail in io_uring_enter(), but the caller
+    // may still set flags: publishing it now is safe for the same reason
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+int uring_enter(struct uring *u, int timeout_ms)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {.ts = (uint64_t)(uintptr_t)&ts};
+    for (;;)
+    {
+        int n = sys_enter(u->fd, u->queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+        u->enters++;
+        if (n >= 0)
+        {
+            u->queued -= (unsigned)n;
+            u->submitted += (unsigned)n;
+            return 0;
+        }
+        if (errno == ETIME || errno == EINTR)
+            return 0;
+        if (errno != EBUSY && errno != EAGAIN)
+            return -1;
+        // Completion queue overflowing: reap first, submit on the next call
+        if (uring_cqe(u))
+            return 0;
+    }
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_seen(struct uring *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned n)
+{
+    return sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+int uring_register_files(struct uring *u, const int *fds, unsigned n)
+{
+    return sys_register(u->fd, IORING_REGISTER_FILES, fds, n);
+}
@@ -0,0 +1,53 @@
+// uring.h
+// Minimal io_uring plumbing over the raw syscalls, for IO_MODE uring.
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// One submission/completion queue pair, used by a single thread. SQEs are
+// prepared into the shared ring and handed to the kernel in one
+// io_uring_enter() together with the wait for completions.
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned queued; // prepared but not yet submitted
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned long long enters, submitted; // syscalls vs. requests, for reports
+};
+
+// 0, or -1 with errno set (ENOSYS or EPERM where io_uring is not allowed)
+int uring_init(struct uring *u, unsigned entries);
+void uring_free(struct uring *u);
+
+// Make sure n SQEs can be prepared back to back (for linked requests),
+// submitting what is queued if needed
+void uring_reserve(struct uring *u, unsigned n);
+
+// A zeroed SQE for op on fd; addr, len and off mean what they mean for
+// op. A full queue is submitted first, so this only fails if that fails.
+struct io_uring_sqe *uring_prep(struct uring *u, uint8_t op, int fd, const void *addr,
+                                unsigned len, uint64_t off, uint64_t user_data);
+
+// Submit everything prepared and wait up to timeout_ms for at least one
+// completion. Returns 0 (also on timeout or signal) or -1 with errno set.
+int uring_enter(struct uring *u, int timeout_ms);
+
+// Oldest unconsumed completion or NULL; uring_seen() consumes it
+struct io_uring_cqe *uring_cqe(struct uring *u);
+void uring_seen(struct uring *u);
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned n);
+int uring_register_files(struct uring *u, const int *fds, unsigned n);
+
+#endif
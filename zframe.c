@@ -0,0 +1,124 @@
+// zframe.c
+// Compressed transfer framing, negotiated with "HELLO ... COMPRESS deflate".
+
+#include "zframe.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZFRAME_LEVEL 1    // fastest deflate level: keeps up with a gigabit link
+#define ZFRAME_MIN 128    // smaller blocks are never worth a deflate header
+#define ZFRAME_GIVE_UP 4  // stored blocks in a row before probing only occasionally
+#define ZFRAME_PROBE 16   // after giving up, try every 16th block
+
+void zcodec_init(struct zcodec *z)
+{
+    memset(z, 0, sizeof(*z));
+}
+
+void zcodec_free(struct zcodec *z)
+{
+    if (z->def_ready)
+        deflateEnd(&z->def);
+    if (z->inf_ready)
+        inflateEnd(&z->inf);
+    free(z->buf);
+    zcodec_init(z);
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Deflate src into at most cap bytes; returns the length, or 0 if it does not fit
+static size_t deflate_block(struct zcodec *z, const void *src, size_t len,
+                            unsigned char *out, size_t cap)
+{
+    if (!z->def_ready)
+    {
+        // Raw deflate (negative window bits): the frame header already
+        // carries the lengths, so zlib's own header and checksum are waste
+        if (deflateInit2(&z->def, ZFRAME_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return 0;
+        z->def_ready = 1;
+    }
+    else if (deflateReset(&z->def) != Z_OK)
+        return 0;
+
+    z->def.next_in = (Bytef *)src;
+    z->def.avail_in = (uInt)len;
+    z->def.next_out = out;
+    z->def.avail_out = (uInt)cap;
+    if (deflate(&z->def, Z_FINISH) != Z_STREAM_END)
+        return 0; // ran out of room: not worth sending compressed
+    return cap - z->def.avail_out;
+}
+
+size_t zframe_encode(struct zcodec *z, unsigned *streak, const void *src, size_t len,
+                     unsigned char *out)
+{
+    size_t wire = 0;
+    int probe = *streak < ZFRAME_GIVE_UP || *streak % ZFRAME_PROBE == 0;
+    if (probe && len >= ZFRAME_MIN)
+        wire = deflate_block(z, src, len, out + ZFRAME_HDR, len - len / 8);
+
+    if (wire > 0)
+        *streak = 0;
+    else
+    {
+        memcpy(out + ZFRAME_HDR, src, len);
+        wire = len;
+        (*streak)++;
+    }
+    put32(out, (uint32_t)len);
+    put32(out + 4, (uint32_t)wire);
+    return ZFRAME_HDR + wire;
+}
+
+int zframe_parse(const unsigned char *hdr, size_t *raw, size_t *wire)
+{
+    *raw = get32(hdr);
+    *wire = get32(hdr + 4);
+    if (*raw == 0 || *raw > ZFRAME_BLOCK || *wire == 0 || *wire > *raw)
+        return -1;
+    return 0;
+}
+
+int zframe_decode(struct zcodec *z, const unsigned char *wire, size_t wire_len,
+                  void *dst, size_t raw)
+{
+    if (wire_len == raw)
+    {
+        if (dst != wire)
+            memmove(dst, wire, raw);
+        return 0;
+    }
+
+    if (!z->inf_ready)
+    {
+        if (inflateInit2(&z->inf, -15) != Z_OK)
+            return -1;
+        z->inf_ready = 1;
+    }
+    else if (inflateReset(&z->inf) != Z_OK)
+        return -1;
+
+    z->inf.next_in = (Bytef *)wire;
+    z->inf.avail_in = (uInt)wire_len;
+    z->inf.next_out = dst;
+    z->inf.avail_out = (uInt)raw;
+    if (inflate(&z->inf, Z_FINISH) != Z_STREAM_END ||
+        z->inf.avail_out != 0 || z->inf.avail_in != 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,47 @@
+// zframe.h
+// Compressed transfer framing, negotiated with "HELLO ... COMPRESS deflate".
+
+#ifndef ZFRAME_H
+#define ZFRAME_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+// A payload is cut into blocks of at most ZFRAME_BLOCK bytes. Each block
+// travels as one frame: an 8-byte header (raw length, wire length, both
+// 32-bit big endian) and the wire bytes. A frame whose wire length equals
+// its raw length is stored as is; a shorter one is a complete raw deflate
+// stream. Frames are independent, so a receiver never needs more than
+// ZFRAME_MAX bytes to decode one.
+#define ZFRAME_BLOCK 65536
+#define ZFRAME_HDR 8
+#define ZFRAME_MAX (ZFRAME_HDR + ZFRAME_BLOCK)
+
+// Deflate/inflate state reused across frames (set up on first use)
+struct zcodec
+{
+    z_stream def, inf;
+    int def_ready, inf_ready;
+    unsigned char *buf; // ZFRAME_MAX scratch for connbuf_read_frame
+};
+
+void zcodec_init(struct zcodec *z);
+void zcodec_free(struct zcodec *z);
+
+// Frame len (1..ZFRAME_BLOCK) bytes of src into out (ZFRAME_MAX bytes).
+// Blocks that do not shrink by at least 1/8 are stored. *streak counts
+// stored blocks in a row; once it reaches a few, only every 16th block
+// is tried, so incompressible data costs almost no CPU. Keep one streak
+// per transfer, starting at 0. Returns the frame length.
+size_t zframe_encode(struct zcodec *z, unsigned *streak, const void *src, size_t len,
+                     unsigned char *out);
+
+// Read a frame header; returns -1 if the lengths are impossible
+int zframe_parse(const unsigned char *hdr, size_t *raw, size_t *wire);
+
+// Decode the wire bytes of a frame into dst (raw bytes). Returns 0, or -1
+// if they are not a valid deflate stream of exactly raw bytes.
+int zframe_decode(struct zcodec *z, const unsigned char *wire, size_t wire_len,
+                  void *dst, size_t raw);
+
+#endif